@@ -0,0 +1,168 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_benchmarks_Benchmark_h_INCLUDED
+#define MULTISHAPELET_benchmarks_Benchmark_h_INCLUDED
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <time.h>
+
+#include "ndarray.h"
+#include "lsst/afw/image/Image.h"
+#include "lsst/shapelet/MultiShapeletFunction.h"
+#include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
+
+/*
+ *  A minimal harness for the microbenchmarks in this directory.
+ *
+ *  Each benchmark program accepts the options
+ *
+ *    --filter=<substring>  only run benchmarks whose names contain the substring
+ *    --min-time=<seconds>  minimum total time spent timing each benchmark (default 0.5)
+ *    --repeat=<n>          number of timed repetitions (default 5); we report the fastest and median
+ *
+ *  and prints one JSON object per line for each benchmark, with fields
+ *
+ *    name, pixels, components   the benchmark and its parameters
+ *    iterations                 calls per timed repetition
+ *    repeat                     number of timed repetitions
+ *    best_ns, median_ns         nanoseconds per call over the repetitions
+ *    best_ns_per_pixel          best_ns / pixels
+ *
+ *  so the output of several programs can simply be concatenated and compared against a
+ *  previous run.
+ */
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet { namespace benchmarks {
+
+/// Use a result, to keep the compiler from optimizing away the code that computed it.
+inline void consume(double value) {
+    static volatile double sink = 0.0;
+    sink = value;
+}
+
+inline double getTime() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+class BenchmarkRunner {
+public:
+
+    BenchmarkRunner(int argc, char ** argv) : _minTime(0.5), _repeat(5) {
+        for (int i = 1; i < argc; ++i) {
+            if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+                _filter = argv[i] + 9;
+            } else if (std::strncmp(argv[i], "--min-time=", 11) == 0) {
+                _minTime = std::atof(argv[i] + 11);
+            } else if (std::strncmp(argv[i], "--repeat=", 9) == 0) {
+                _repeat = std::max(1, std::atoi(argv[i] + 9));
+            } else {
+                std::fprintf(stderr, "usage: %s [--filter=<substring>] [--min-time=<seconds>]"
+                             " [--repeat=<n>]\n", argv[0]);
+                std::exit(1);
+            }
+        }
+    }
+
+    /**
+     *  Time calls to f(), which should have no side effects that change its cost from one call
+     *  to the next.  The number of calls per repetition is chosen so each repetition takes at
+     *  least min-time/repeat seconds.
+     */
+    template <typename Function>
+    void run(std::string const & name, int pixels, int components, Function f) {
+        if (!_filter.empty() && name.find(_filter) == std::string::npos) return;
+        f(); // warm up caches, and any lazy initialization in the code being timed
+        long iterations = 1;
+        double const target = _minTime / _repeat;
+        while (true) {
+            double t = timeCalls(f, iterations);
+            if (t >= target) break;
+            iterations = (t > 0.0) ? std::max(2 * iterations, long(1.2 * iterations * target / t)) + 1
+                                   : 10 * iterations;
+        }
+        std::vector<double> times(_repeat);
+        for (int n = 0; n < _repeat; ++n) {
+            times[n] = 1E9 * timeCalls(f, iterations) / iterations;
+        }
+        std::sort(times.begin(), times.end());
+        std::printf(
+            "{\"name\": \"%s\", \"pixels\": %d, \"components\": %d, \"iterations\": %ld, \"repeat\": %d, "
+            "\"best_ns\": %.1f, \"median_ns\": %.1f, \"best_ns_per_pixel\": %.4f}\n",
+            name.c_str(), pixels, components, iterations, _repeat,
+            times.front(), times[_repeat / 2], times.front() / std::max(pixels, 1)
+        );
+        std::fflush(stdout);
+    }
+
+private:
+
+    template <typename Function>
+    static double timeCalls(Function & f, long iterations) {
+        double t0 = getTime();
+        for (long i = 0; i < iterations; ++i) f();
+        return getTime() - t0;
+    }
+
+    std::string _filter;
+    double _minTime;
+    int _repeat;
+};
+
+/// Image sizes (per side) used by the pixel-count parameterized benchmarks.
+inline std::vector<int> getImageSizes() {
+    std::vector<int> result;
+    result.push_back(11);
+    result.push_back(31);
+    result.push_back(101);
+    return result;
+}
+
+/// Return an image of the given function on a size x size box centered on the origin.
+inline afw::image::Image<double> makeImage(int size, shapelet::MultiShapeletFunction const & function) {
+    afw::geom::Box2I box(afw::geom::Point2I(-size / 2, -size / 2), afw::geom::Extent2I(size, size));
+    afw::image::Image<double> image(box);
+    shapelet::MultiShapeletFunctionEvaluator evaluator = function.evaluate();
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            image(x, y) = evaluator(afw::geom::Point2D(box.getMinX() + x, box.getMinY() + y));
+        }
+    }
+    return image;
+}
+
+/// Return inputs for the whole of an image made by makeImage, centered on the origin.
+inline ModelInputHandler makeInputs(afw::image::Image<double> const & image) {
+    return ModelInputHandler(image, afw::geom::Point2D(0.0, 0.0), image.getBBox(afw::image::PARENT));
+}
+
+}}}}} // namespace lsst::meas::extensions::multiShapelet::benchmarks
+
+#endif // !MULTISHAPELET_benchmarks_Benchmark_h_INCLUDED
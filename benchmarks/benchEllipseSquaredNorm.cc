@@ -0,0 +1,136 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+// Microbenchmarks for EllipseSquaredNorm, the innermost loop of every model evaluation.
+
+#include <vector>
+
+#include "Eigen/Core"
+
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/meas/extensions/multiShapelet/EllipseSquaredNorm.h"
+#include "Benchmark.h"
+
+namespace el = lsst::afw::geom::ellipses;
+namespace ms = lsst::meas::extensions::multiShapelet;
+namespace bm = lsst::meas::extensions::multiShapelet::benchmarks;
+
+namespace {
+
+struct Fixture {
+
+    explicit Fixture(int size) : x(size * size), y(size * size), rx(size * size), ry(size * size),
+                                 z(size * size), dz(size * size, 3) {
+        for (int i = 0; i < size; ++i) {
+            for (int j = 0; j < size; ++j) {
+                x[i * size + j] = j - size / 2;
+                y[i * size + j] = i - size / 2;
+            }
+        }
+        jacobian = esn.update(el::Quadrupole(3.0, 4.2, 0.25), true);
+    }
+
+    ms::EllipseSquaredNorm esn;
+    el::BaseCore::Jacobian jacobian;
+    Eigen::VectorXd x;
+    Eigen::VectorXd y;
+    Eigen::VectorXd rx;
+    Eigen::VectorXd ry;
+    Eigen::VectorXd z;
+    Eigen::Matrix<double,Eigen::Dynamic,3> dz;
+};
+
+struct Scalar {
+    void operator()() {
+        double total = 0.0;
+        for (int n = 0; n < f->x.size(); ++n) {
+            double rx, ry, z;
+            f->esn(f->x[n], f->y[n], rx, ry, z);
+            total += z;
+        }
+        bm::consume(total);
+    }
+    Fixture * f;
+};
+
+struct Vector {
+    void operator()() {
+        f->esn(f->x, f->y, f->rx, f->ry, f->z);
+        bm::consume(f->z[0]);
+    }
+    Fixture * f;
+};
+
+struct ScalarEllipseDerivative {
+    void operator()() {
+        Eigen::RowVector3d total = Eigen::RowVector3d::Zero();
+        for (int n = 0; n < f->x.size(); ++n) {
+            double rx, ry, z;
+            f->esn(f->x[n], f->y[n], rx, ry, z);
+            f->esn.dEllipse(f->x[n], f->y[n], rx, ry, f->jacobian, total);
+        }
+        bm::consume(total[0]);
+    }
+    Fixture * f;
+};
+
+struct VectorEllipseDerivative {
+    void operator()() {
+        f->esn(f->x, f->y, f->rx, f->ry, f->z);
+        f->dz.setZero();
+        f->esn.dEllipse(f->x, f->y, f->rx, f->ry, f->jacobian, f->dz);
+        bm::consume(f->dz(0, 0));
+    }
+    Fixture * f;
+};
+
+struct Update {
+    void operator()() {
+        bm::consume(f->esn.update(ellipse, true)(0, 0));
+    }
+    Fixture * f;
+    el::Quadrupole ellipse;
+};
+
+} // anonymous
+
+int main(int argc, char ** argv) {
+    bm::BenchmarkRunner runner(argc, argv);
+    std::vector<int> const sizes = bm::getImageSizes();
+    for (std::vector<int>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+        Fixture f(*i);
+        int const pixels = (*i) * (*i);
+        Scalar scalar = { &f };
+        runner.run("EllipseSquaredNorm/scalar", pixels, 1, scalar);
+        Vector vector = { &f };
+        runner.run("EllipseSquaredNorm/vector", pixels, 1, vector);
+        ScalarEllipseDerivative scalarDerivative = { &f };
+        runner.run("EllipseSquaredNorm/dEllipse/scalar", pixels, 1, scalarDerivative);
+        VectorEllipseDerivative vectorDerivative = { &f };
+        runner.run("EllipseSquaredNorm/dEllipse/vector", pixels, 1, vectorDerivative);
+    }
+    Fixture f(1);
+    Update quadrupoleUpdate = { &f, el::Quadrupole(3.0, 4.2, 0.25) };
+    runner.run("EllipseSquaredNorm/update", 0, 1, quadrupoleUpdate);
+    return 0;
+}
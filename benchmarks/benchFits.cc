@@ -0,0 +1,196 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+// Microbenchmarks for the complete nonlinear fits (HybridOptimizer::run) and the linear fits
+// that follow them (the fitShapeletTerms functions and FitComboAlgorithm), parameterized over
+// the number of pixels.  The component count reported is the number of convolved Gaussians
+// for the nonlinear fits and the number of linear basis functions for the linear fits.
+
+#include <cmath>
+#include <vector>
+
+#include "Eigen/Core"
+
+#include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/FitProfile.h"
+#include "lsst/meas/extensions/multiShapelet/FitCombo.h"
+#include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
+#include "Benchmark.h"
+
+namespace ms = lsst::meas::extensions::multiShapelet;
+namespace bm = lsst::meas::extensions::multiShapelet::benchmarks;
+
+namespace {
+
+ndarray::Array<double,1,1> makeParameters(double e1, double e2, double logRadius) {
+    ndarray::Array<double,1,1> result = ndarray::allocate(3);
+    result[0] = e1;
+    result[1] = e2;
+    result[2] = logRadius;
+    return result;
+}
+
+int computeShapeletSize(int order) { return (order + 1) * (order + 2) / 2; }
+
+// Includes construction of the objective and optimizer, as in FitPsfAlgorithm::apply.
+struct RunPsfOptimizer {
+    void operator()() {
+        ms::HybridOptimizer optimizer = ms::FitPsfAlgorithm::makeOptimizer(*ctrl, *inputs);
+        bm::consume(optimizer.run());
+    }
+    ms::FitPsfControl const * ctrl;
+    ms::ModelInputHandler const * inputs;
+};
+
+// Includes construction of the objective and optimizer, as in FitProfileAlgorithm::apply.
+struct RunProfileOptimizer {
+    void operator()() {
+        ms::HybridOptimizer optimizer = ms::FitProfileAlgorithm::makeOptimizer(
+            *ctrl, *psfModel, *initial, *inputs
+        );
+        bm::consume(optimizer.run());
+    }
+    ms::FitProfileControl const * ctrl;
+    ms::FitPsfModel const * psfModel;
+    ms::MultiGaussianObjective::EllipseCore const * initial;
+    ms::ModelInputHandler const * inputs;
+};
+
+struct FitPsfShapeletTerms {
+    void operator()() {
+        ms::FitPsfModel model(*initial);
+        ms::FitPsfAlgorithm::fitShapeletTerms(*ctrl, *inputs, model);
+        bm::consume(model.inner[0]);
+    }
+    ms::FitPsfControl const * ctrl;
+    ms::FitPsfModel const * initial;
+    ms::ModelInputHandler const * inputs;
+};
+
+// The linear fits clear the ConvolutionCache first, so every call pays for the convolutions, as
+// the first fit of each source does (otherwise we'd only time cache hits after the warm-up call).
+struct FitProfileShapeletTerms {
+    void operator()() {
+        ms::ConvolutionCache::clear();
+        ms::FitProfileModel model(*initial);
+        ms::FitProfileAlgorithm::fitShapeletTerms(*ctrl, *psfModel, *inputs, model);
+        bm::consume(model.flux);
+    }
+    ms::FitProfileControl const * ctrl;
+    ms::FitPsfModel const * psfModel;
+    ms::FitProfileModel const * initial;
+    ms::ModelInputHandler const * inputs;
+};
+
+struct FitCombo {
+    void operator()() {
+        ms::ConvolutionCache::clear();
+        bm::consume(ms::FitComboAlgorithm::apply(*ctrl, *psfModel, *components, *inputs).flux);
+    }
+    ms::FitComboControl const * ctrl;
+    ms::FitPsfModel const * psfModel;
+    std::vector<ms::FitProfileModel> const * components;
+    ms::ModelInputHandler const * inputs;
+};
+
+struct SolveNonNegative {
+    void operator()() {
+        bm::consume(ms::FitComboAlgorithm::solveNonNegative(fisher, rhs)[0]);
+    }
+    ndarray::Array<double const,2,2> fisher;
+    ndarray::Array<double const,1,1> rhs;
+};
+
+} // anonymous
+
+int main(int argc, char ** argv) {
+    bm::BenchmarkRunner runner(argc, argv);
+    ms::FitPsfControl psfCtrl;
+    ndarray::Array<double,1,1> psfParameters = makeParameters(0.1, -0.05, std::log(1.5));
+    ms::FitPsfModel psfModel(psfCtrl, 1.0, psfParameters);
+    ms::FitProfileControl expCtrl;
+    expCtrl.profile = "tractor-exponential";
+    ms::FitProfileControl devCtrl;
+    devCtrl.profile = "tractor-devaucouleur";
+    std::vector<ms::FitProfileControl const *> profileCtrls;
+    profileCtrls.push_back(&expCtrl);
+    profileCtrls.push_back(&devCtrl);
+    ms::FitComboControl comboCtrl;
+    ndarray::Array<double,1,1> profileParameters = makeParameters(0.2, -0.1, std::log(3.0));
+    ms::MultiGaussianObjective::EllipseCore initial(0.1, 0.0, std::log(2.5));
+    std::vector<int> const sizes = bm::getImageSizes();
+    for (std::vector<int>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+        int const pixels = (*i) * (*i);
+        lsst::afw::image::Image<double> psfImage = bm::makeImage(*i, psfModel.asMultiShapelet());
+        ms::ModelInputHandler psfInputs = bm::makeInputs(psfImage);
+        RunPsfOptimizer runPsfOptimizer = { &psfCtrl, &psfInputs };
+        runner.run("HybridOptimizer/run/psf", pixels, 2, runPsfOptimizer);
+        for (int order = 0; order <= 4; order += 2) {
+            for (int normal = 0; normal < 2; ++normal) {
+                ms::FitPsfControl ctrl;
+                ctrl.innerOrder = ctrl.outerOrder = order;
+                ctrl.useNormalEquations = normal;
+                ms::FitPsfModel model(ctrl, 1.0, psfParameters);
+                FitPsfShapeletTerms fitPsfShapeletTerms = { &ctrl, &model, &psfInputs };
+                runner.run(normal ? "FitPsfAlgorithm/fitShapeletTerms/normal"
+                                  : "FitPsfAlgorithm/fitShapeletTerms/matrix",
+                           pixels, 2 * computeShapeletSize(order), fitPsfShapeletTerms);
+            }
+        }
+        // The galaxy image is the sum of the exponential and de Vaucouleur models, so it can be
+        // used for FitCombo as well.
+        lsst::afw::image::Image<double> image(psfImage.getBBox(lsst::afw::image::PARENT));
+        image = 0.0;
+        std::vector<ms::FitProfileModel> models;
+        for (std::size_t p = 0; p < profileCtrls.size(); ++p) {
+            models.push_back(ms::FitProfileModel(*profileCtrls[p], 0.5, profileParameters));
+            image += bm::makeImage(*i, models.back().asMultiShapelet().convolve(psfModel.asMultiShapelet()));
+        }
+        ms::ModelInputHandler inputs = bm::makeInputs(image);
+        for (std::size_t p = 0; p < profileCtrls.size(); ++p) {
+            int const nComponents = profileCtrls[p]->getMultiGaussian().size();
+            RunProfileOptimizer runProfileOptimizer = { profileCtrls[p], &psfModel, &initial, &inputs };
+            runner.run("HybridOptimizer/run/" + profileCtrls[p]->profile, pixels,
+                       nComponents * 2, runProfileOptimizer);
+            FitProfileShapeletTerms fitProfileShapeletTerms = {
+                profileCtrls[p], &psfModel, &models[p], &inputs
+            };
+            runner.run("FitProfileAlgorithm/fitShapeletTerms/" + profileCtrls[p]->profile, pixels,
+                       psfModel.inner.getSize<0>() + psfModel.outer.getSize<0>(), fitProfileShapeletTerms);
+        }
+        FitCombo fitCombo = { &comboCtrl, &psfModel, &models, &inputs };
+        runner.run("FitComboAlgorithm/apply", pixels, int(models.size()), fitCombo);
+    }
+    int const solveSizes[] = { 2, 4, 8 };
+    for (int k = 0; k < 3; ++k) {
+        int const n = solveSizes[k];
+        Eigen::MatrixXd m = Eigen::MatrixXd::Random(4 * n, n);
+        ndarray::Array<double,2,2> fisher = ndarray::allocate(n, n);
+        ndarray::Array<double,1,1> rhs = ndarray::allocate(n);
+        fisher.asEigen() = m.transpose() * m;
+        rhs.asEigen() = m.transpose() * Eigen::VectorXd::Random(4 * n);
+        SolveNonNegative solveNonNegative = { fisher, rhs };
+        runner.run("FitComboAlgorithm/solveNonNegative", 0, n, solveNonNegative);
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+// Microbenchmarks for GaussianModelBuilder, parameterized over the number of pixels and the
+// number of builders (one per convolved Gaussian component) that share an ellipse.
+
+#include <cmath>
+
+#include "Eigen/Core"
+
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/meas/extensions/multiShapelet/GaussianModelBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
+#include "Benchmark.h"
+
+namespace el = lsst::afw::geom::ellipses;
+namespace ms = lsst::meas::extensions::multiShapelet;
+namespace bm = lsst::meas::extensions::multiShapelet::benchmarks;
+
+namespace {
+
+struct Fixture {
+
+    Fixture(int size, int nBuilders) :
+        x(ndarray::allocate(size * size)), y(ndarray::allocate(size * size)),
+        derivative(ndarray::allocate(size * size, 3)),
+        ellipse(0.2, -0.1, std::log(3.0))
+    {
+        for (int i = 0; i < size; ++i) {
+            for (int j = 0; j < size; ++j) {
+                x[i * size + j] = j - size / 2;
+                y[i * size + j] = i - size / 2;
+            }
+        }
+        el::Quadrupole psfEllipse(2.0, 2.2, 0.1);
+        for (int n = 0; n < nBuilders; ++n) {
+            builders.push_back(
+                ms::GaussianModelBuilder(x, y, 1.0 / nBuilders, 0.3 * std::pow(1.4, n), psfEllipse)
+            );
+        }
+        moments = ms::MultiGaussianObjective::computeQuadrupole(ellipse, jacobian);
+        for (int n = 0; n < nBuilders; ++n) {
+            builders[n].update(moments, jacobian);
+        }
+    }
+
+    ndarray::Array<double,1,1> x;
+    ndarray::Array<double,1,1> y;
+    ndarray::Array<double,2,-2> derivative;
+    ms::MultiGaussianObjective::EllipseCore ellipse;
+    el::Quadrupole moments;
+    Eigen::Matrix3d jacobian;
+    std::vector<ms::GaussianModelBuilder> builders;
+};
+
+// The generic update, which converts the ellipse to moments separately in each builder.
+struct Update {
+    void operator()() {
+        for (std::size_t n = 0; n < f->builders.size(); ++n) {
+            f->builders[n].update(f->ellipse);
+        }
+        bm::consume(f->builders.back().getModel()[0]);
+    }
+    Fixture * f;
+};
+
+// The update used by MultiGaussianObjective, with the moments and their derivatives computed once.
+struct UpdateMoments {
+    void operator()() {
+        for (std::size_t n = 0; n < f->builders.size(); ++n) {
+            f->builders[n].update(f->moments, f->jacobian);
+        }
+        bm::consume(f->builders.back().getModel()[0]);
+    }
+    Fixture * f;
+};
+
+struct ComputeDerivative {
+    void operator()() {
+        f->derivative.deep() = 0.0;
+        for (std::size_t n = 0; n < f->builders.size(); ++n) {
+            f->builders[n].computeDerivative(f->derivative, true);
+        }
+        bm::consume(f->derivative[0][0]);
+    }
+    Fixture * f;
+};
+
+} // anonymous
+
+int main(int argc, char ** argv) {
+    bm::BenchmarkRunner runner(argc, argv);
+    std::vector<int> const sizes = bm::getImageSizes();
+    int const builderCounts[] = { 1, 4, 16 };
+    for (std::vector<int>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+        for (int k = 0; k < 3; ++k) {
+            Fixture f(*i, builderCounts[k]);
+            int const pixels = (*i) * (*i);
+            Update update = { &f };
+            runner.run("GaussianModelBuilder/update", pixels, builderCounts[k], update);
+            UpdateMoments updateMoments = { &f };
+            runner.run("GaussianModelBuilder/update/moments", pixels, builderCounts[k], updateMoments);
+            ComputeDerivative computeDerivative = { &f };
+            runner.run("GaussianModelBuilder/computeDerivative", pixels, builderCounts[k], computeDerivative);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+// Microbenchmarks for MultiGaussianObjective, for the PSF model and each galaxy profile,
+// parameterized over the number of pixels.  The component count reported is the number of
+// convolved Gaussians in the model.
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/FitProfile.h"
+#include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
+#include "Benchmark.h"
+
+namespace ms = lsst::meas::extensions::multiShapelet;
+namespace bm = lsst::meas::extensions::multiShapelet::benchmarks;
+
+namespace {
+
+ndarray::Array<double,1,1> makeParameters(double e1, double e2, double logRadius) {
+    ndarray::Array<double,1,1> result = ndarray::allocate(3);
+    result[0] = e1;
+    result[1] = e2;
+    result[2] = logRadius;
+    return result;
+}
+
+struct Fixture {
+
+    Fixture(PTR(ms::MultiGaussianObjective) const & objective_, ndarray::Array<double,1,1> const & truth) :
+        objective(objective_), parameters(ndarray::copy(truth)),
+        function(ndarray::allocate(objective->getFunctionSize())),
+        derivative(ndarray::allocate(objective->getFunctionSize(), objective->getParameterSize()))
+    {
+        // evaluate away from the true parameters, as an optimizer would
+        parameters[0] += 0.05;
+        parameters[2] -= 0.1;
+        objective->computeFunction(parameters, function);
+    }
+
+    PTR(ms::MultiGaussianObjective) objective;
+    ndarray::Array<double,1,1> parameters;
+    ndarray::Array<double,1,1> function;
+    ndarray::Array<double,2,-2> derivative;
+};
+
+struct ComputeFunction {
+    void operator()() {
+        f->objective->computeFunction(f->parameters, f->function);
+        bm::consume(f->function[0]);
+    }
+    Fixture * f;
+};
+
+struct ComputeDerivative {
+    void operator()() {
+        f->objective->computeDerivative(f->parameters, f->function, f->derivative);
+        bm::consume(f->derivative[0][0]);
+    }
+    Fixture * f;
+};
+
+void runObjective(bm::BenchmarkRunner & runner, std::string const & name, int pixels, Fixture & f) {
+    ComputeFunction computeFunction = { &f };
+    runner.run("MultiGaussianObjective/computeFunction/" + name, pixels,
+               f.objective->getComponentCount(), computeFunction);
+    ComputeDerivative computeDerivative = { &f };
+    runner.run("MultiGaussianObjective/computeDerivative/" + name, pixels,
+               f.objective->getComponentCount(), computeDerivative);
+}
+
+} // anonymous
+
+int main(int argc, char ** argv) {
+    bm::BenchmarkRunner runner(argc, argv);
+    ms::FitPsfControl psfCtrl;
+    ndarray::Array<double,1,1> psfParameters = makeParameters(0.1, -0.05, std::log(1.5));
+    ms::FitPsfModel psfModel(psfCtrl, 1.0, psfParameters);
+    std::vector<std::string> profiles;
+    profiles.push_back("tractor-exponential");
+    profiles.push_back("tractor-devaucouleur");
+    // reduced profiles, if data/reduced.mgp can be found
+    char const * reduced[] = {
+        "tractor-exponential-3", "tractor-exponential-4", "tractor-exponential-6",
+        "tractor-devaucouleur-3", "tractor-devaucouleur-4", "tractor-devaucouleur-6"
+    };
+    for (int n = 0; n < 6; ++n) {
+        try {
+            ms::MultiGaussianRegistry::lookup(reduced[n]);
+            profiles.push_back(reduced[n]);
+        } catch (lsst::pex::exceptions::NotFoundError &) {
+            std::fprintf(stderr, "Skipping profile '%s', which is not registered.\n", reduced[n]);
+        }
+    }
+    ndarray::Array<double,1,1> profileParameters = makeParameters(0.2, -0.1, std::log(3.0));
+    std::vector<int> const sizes = bm::getImageSizes();
+    for (std::vector<int>::const_iterator i = sizes.begin(); i != sizes.end(); ++i) {
+        int const pixels = (*i) * (*i);
+        {
+            lsst::afw::image::Image<double> image = bm::makeImage(*i, psfModel.asMultiShapelet());
+            ms::ModelInputHandler inputs = bm::makeInputs(image);
+            Fixture f(ms::FitPsfAlgorithm::makeObjective(psfCtrl, inputs), psfParameters);
+            runObjective(runner, "psf", pixels, f);
+        }
+        for (std::vector<std::string>::const_iterator p = profiles.begin(); p != profiles.end(); ++p) {
+            ms::FitProfileControl ctrl;
+            ctrl.profile = *p;
+            ms::FitProfileModel model(ctrl, 1.0, profileParameters);
+            lsst::afw::image::Image<double> image = bm::makeImage(
+                *i, model.asMultiShapelet().convolve(psfModel.asMultiShapelet())
+            );
+            ms::ModelInputHandler inputs = bm::makeInputs(image);
+            Fixture f(ms::FitProfileAlgorithm::makeObjective(ctrl, psfModel, inputs), profileParameters);
+            runObjective(runner, *p, pixels, f);
+        }
+    }
+    return 0;
+}
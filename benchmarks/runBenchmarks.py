@@ -0,0 +1,78 @@
+#!/usr/bin/env python
+"""
+Run the microbenchmarks built by "scons benchmarks" and collect their results.
+
+Each benchmark program prints one JSON object per line (see Benchmark.h).  This script runs all
+of them (passing along --filter, --min-time and --repeat), writes the combined results as a JSON
+list, and, given the output of a previous run with --compare, reports the ratio of the new best
+time to the old one for each benchmark, flagging any slower than --threshold.
+"""
+from __future__ import print_function
+
+import os
+import sys
+import glob
+import json
+import optparse
+import subprocess
+
+def runPrograms(directory, args):
+    results = []
+    for program in sorted(glob.glob(os.path.join(directory, "bench*"))):
+        if os.path.splitext(program)[1] or not os.access(program, os.X_OK):
+            continue
+        print("running %s" % os.path.basename(program), file=sys.stderr)
+        output = subprocess.check_output([program] + args)
+        results.extend(json.loads(line) for line in output.decode("ascii").splitlines() if line.strip())
+    return results
+
+def makeKey(result):
+    return (result["name"], result["pixels"], result["components"])
+
+def compare(results, reference, threshold):
+    """Print the ratio of new to old best times; return the number of regressions."""
+    old = dict((makeKey(r), r) for r in reference)
+    regressions = 0
+    print("%-52s %8s %5s %12s %12s %7s" % ("benchmark", "pixels", "n", "old (ns)", "new (ns)", "ratio"))
+    for result in results:
+        previous = old.get(makeKey(result))
+        if previous is None:
+            continue
+        ratio = result["best_ns"] / previous["best_ns"]
+        slower = ratio > threshold
+        regressions += slower
+        print("%-52s %8d %5d %12.1f %12.1f %7.3f%s" % (
+            result["name"], result["pixels"], result["components"], previous["best_ns"],
+            result["best_ns"], ratio, "  SLOWER" if slower else ""))
+    return regressions
+
+def main():
+    parser = optparse.OptionParser(usage=__doc__)
+    parser.add_option("--dir", default=os.path.dirname(os.path.abspath(__file__)),
+                      help="directory containing the benchmark programs")
+    parser.add_option("--output", default=None, help="file to write results to (default stdout)")
+    parser.add_option("--compare", default=None, help="results of a previous run to compare with")
+    parser.add_option("--threshold", type=float, default=1.1,
+                      help="time ratio above which a benchmark is reported as a regression")
+    parser.add_option("--filter", default=None, help="only run benchmarks whose names contain this")
+    parser.add_option("--min-time", default=None, help="minimum time to spend on each benchmark (s)")
+    parser.add_option("--repeat", default=None, help="number of timed repetitions")
+    options, args = parser.parse_args()
+    programArgs = ["--%s=%s" % (name, value) for name, value in
+                   (("filter", options.filter), ("min-time", options.min_time), ("repeat", options.repeat))
+                   if value is not None]
+    results = runPrograms(options.dir, programArgs)
+    if options.output is None:
+        json.dump(results, sys.stdout, indent=1)
+        print()
+    else:
+        with open(options.output, "w") as f:
+            json.dump(results, f, indent=1)
+    if options.compare is not None:
+        with open(options.compare, "r") as f:
+            reference = json.load(f)
+        if compare(results, reference, options.threshold):
+            sys.exit(1)
+
+if __name__ == "__main__":
+    main()
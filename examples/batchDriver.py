@@ -0,0 +1,474 @@
+#!/usr/bin/env python
+"""
+Run the multiShapelet fits on one or more exposures, sharded across worker processes.
+
+usage: batchDriver.py [options] OUTPUT_DIR EXPOSURE[:CATALOG] [EXPOSURE[:CATALOG] ...]
+
+Each EXPOSURE is a FITS exposure with a PSF; CATALOG is a FITS SourceCatalog with centroids,
+shapes and footprints for it.  If no catalog is given, sources are detected and measured
+(without the multiShapelet algorithms) in the parent process, and the catalog is written to
+the output directory.
+
+The sources are split into chunks, and the chunks are handed to a pool of worker processes.
+Each source is fit as FitPsfAlgorithm.fit, FitProfileAlgorithm.adjustInputs/apply and
+FitComboAlgorithm.adjustInputs/apply would in SourceMeasurementTask (with the per-source PSF
+factor fits; the psfFactorGrid options are ignored).  The results are written directly into
+memory-mapped buffers, one per exposure, which are numpy .npy files in the output directory
+(read them with numpy.load); their columns are described in OUTPUT_DIR/manifest.json.
+
+Completed sources are recorded in an append-only journal (OUTPUT_DIR/journal), after the
+results for them have been flushed to disk.  Running the driver again with the same output
+directory (the exposures and catalogs can be omitted) resumes where it stopped, without
+refitting anything in the journal.
+
+Because the fits run in separate processes, a source that crashes or hangs its worker can't
+take down the run: the worker is replaced, the sources of its chunk are retried one at a time,
+and a source that kills a worker on its own is recorded with status CRASHED.
+"""
+from __future__ import print_function
+
+import os
+import sys
+import json
+import time
+import signal
+import optparse
+import multiprocessing
+import numpy
+
+import lsst.afw.geom as geom
+import lsst.afw.geom.ellipses
+import lsst.afw.image
+import lsst.afw.table
+import lsst.pex.exceptions
+import lsst.meas.algorithms
+import lsst.meas.extensions.multiShapelet as ms
+
+PSF_NAME = "multishapelet.psf"
+PROFILE_NAMES = ("multishapelet.exp", "multishapelet.dev")
+COMBO_NAME = "multishapelet.combo"
+
+# values of the "status" column and the journal
+PENDING = 0
+DONE = 1
+FAILED = 2    # a fit raised an exception; the columns of the failed stages are NaN
+CRASHED = 3   # the worker died or timed out on this source
+
+#-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+def getColumnName(algorithmName):
+    """Return the prefix used for an algorithm's columns, e.g. "exp" for "multishapelet.exp"."""
+    return algorithmName.split(".")[-1]
+
+def makeConfig(configFile=None):
+    config = lsst.meas.algorithms.SourceMeasurementConfig()
+    config.algorithms.names |= ms.algorithms
+    if configFile is not None:
+        config.load(configFile)
+    return config
+
+def makeDType(config):
+    """Return the numpy dtype of the result buffers for a measurement config."""
+    psfCtrl = config.algorithms[PSF_NAME].makeControl()
+    nInner = len(ms.FitPsfModel(psfCtrl, 1.0, numpy.zeros(3)).inner)
+    nOuter = len(ms.FitPsfModel(psfCtrl, 1.0, numpy.zeros(3)).outer)
+    fields = [
+        ("id", numpy.int64),
+        ("status", numpy.int8),
+        ("seconds", numpy.float64),
+        ("psf_ellipse", numpy.float64, (3,)),
+        ("psf_inner", numpy.float64, (nInner,)),
+        ("psf_outer", numpy.float64, (nOuter,)),
+        ("psf_chisq", numpy.float64),
+        ("psf_flags", numpy.bool_),
+    ]
+    for name in PROFILE_NAMES:
+        prefix = getColumnName(name)
+        fields += [
+            (prefix + "_flux", numpy.float64),
+            (prefix + "_fluxErr", numpy.float64),
+            (prefix + "_ellipse", numpy.float64, (3,)),
+            (prefix + "_chisq", numpy.float64),
+            (prefix + "_psfFactor", numpy.float64),
+            (prefix + "_flags", numpy.bool_),
+        ]
+    nComponents = len(config.algorithms[COMBO_NAME].componentNames)
+    fields += [
+        ("combo_flux", numpy.float64),
+        ("combo_fluxErr", numpy.float64),
+        ("combo_components", numpy.float64, (nComponents,)),
+        ("combo_chisq", numpy.float64),
+        ("combo_psfFactor", numpy.float64),
+        ("combo_flags", numpy.bool_),
+    ]
+    return numpy.dtype(fields)
+
+def getEllipse(quadrupole):
+    return (quadrupole.getIxx(), quadrupole.getIyy(), quadrupole.getIxy())
+
+#-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+class Journal(object):
+    """Append-only record of the sources that have been processed.
+
+    Each line is "<exposure index> <source index> <status>".  Lines are written with a single
+    write() on a file opened with O_APPEND, so lines from different processes don't interleave;
+    a partial last line (from a process killed mid-write) is ignored when reading.
+    """
+
+    def __init__(self, filename):
+        self.filename = filename
+        self.fd = os.open(filename, os.O_WRONLY | os.O_APPEND | os.O_CREAT, 0o644)
+
+    def read(self):
+        """Return a dict of {(exposure index, source index): status}."""
+        entries = {}
+        with open(self.filename, "r") as f:
+            for line in f:
+                if not line.endswith("\n"):
+                    break
+                try:
+                    k, n, status = [int(s) for s in line.split()]
+                except ValueError:
+                    continue
+                entries[k, n] = status
+        return entries
+
+    def append(self, entries):
+        """Append a list of (exposure index, source index, status) and sync them to disk."""
+        if not entries:
+            return
+        text = "".join("%d %d %d\n" % entry for entry in entries)
+        os.write(self.fd, text.encode("ascii"))
+        os.fsync(self.fd)
+
+    def close(self):
+        os.close(self.fd)
+
+#-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+class Fitter(object):
+    """Fit sources in one exposure, as the multiShapelet algorithms would in _apply."""
+
+    def __init__(self, config, exposurePath, catalogPath):
+        self.exposure = lsst.afw.image.ExposureF(exposurePath)
+        self.sources = lsst.afw.table.SourceCatalog.readFits(catalogPath)
+        self.psf = self.exposure.getPsf()
+        self.mi = self.exposure.getMaskedImage()
+        self.psfCtrl = config.algorithms[PSF_NAME].makeControl()
+        self.profileCtrls = [config.algorithms[name].makeControl() for name in PROFILE_NAMES]
+        self.comboCtrl = config.algorithms[COMBO_NAME].makeControl()
+        # FitPsfAlgorithm.fit needs a record to save to; we just reuse one
+        schema = lsst.afw.table.Schema()
+        self.psfAlgorithm = self.psfCtrl.makeAlgorithm(schema)
+        self.psfRecord = lsst.afw.table.BaseCatalog(schema).addNew()
+        if self.psfCtrl.useGrid:
+            self.psfGrid = ms.FitPsfGrid(self.psfCtrl, self.psf,
+                                         geom.Box2D(self.mi.getBBox(lsst.afw.image.PARENT)))
+        else:
+            self.psfGrid = None
+
+    def fit(self, n, row):
+        """Fit source n, filling the given row of a result buffer; return the status."""
+        source = self.sources[n]
+        center = source.getCentroid()
+        row["id"] = source.getId()
+        if self.psfGrid is not None:
+            psfModel = self.psfGrid.evaluate(center)
+        else:
+            psfModel = self.psfAlgorithm.fit(self.psfRecord, self.psf, center)
+        row["psf_ellipse"] = getEllipse(psfModel.ellipse)
+        row["psf_inner"] = psfModel.inner
+        row["psf_outer"] = psfModel.outer
+        row["psf_chisq"] = psfModel.chisq
+        row["psf_flags"] = psfModel.hasFailed()
+        if psfModel.hasFailed() or not psfModel.ellipse.getArea() > 0.0:
+            return FAILED
+        status = DONE
+        components = ms.FitProfileModelList()
+        psfComponents = ms.FitProfileModelList()
+        for name, ctrl in zip(PROFILE_NAMES, self.profileCtrls):
+            prefix = getColumnName(name)
+            try:
+                # adjustInputs modifies the shape in place
+                shape = lsst.afw.geom.ellipses.Quadrupole(psfModel.ellipse if source.getShapeFlag()
+                                                          else source.getShape())
+                inputs = ms.FitProfileAlgorithm.adjustInputs(ctrl, psfModel, shape, source.getFootprint(),
+                                                             self.mi, center)
+                model = ms.FitProfileAlgorithm.apply(ctrl, psfModel,
+                                                     ms.MultiGaussianObjective.EllipseCore(shape), inputs)
+                row[prefix + "_flux"] = model.flux
+                row[prefix + "_fluxErr"] = model.fluxErr
+                row[prefix + "_ellipse"] = getEllipse(model.ellipse)
+                row[prefix + "_chisq"] = model.chisq
+                row[prefix + "_flags"] = model.fluxFlag
+                components.append(model)
+                psfFactorModel = ms.FitProfileAlgorithm.computePsfFactor(ctrl, psfModel, self.psf, center)
+                row[prefix + "_psfFactor"] = psfFactorModel.flux
+                psfComponents.append(psfFactorModel)
+            except lsst.pex.exceptions.Exception:
+                status = FAILED
+        if status != DONE or any(model.fluxFlag for model in components):
+            return FAILED
+        try:
+            inputs = ms.FitComboAlgorithm.adjustInputs(self.comboCtrl, psfModel, components,
+                                                       source.getFootprint(), self.mi, center)
+            model = ms.FitComboAlgorithm.apply(self.comboCtrl, psfModel, components, inputs)
+            row["combo_flux"] = model.flux
+            row["combo_fluxErr"] = model.fluxErr
+            row["combo_components"] = model.components
+            row["combo_chisq"] = model.chisq
+            row["combo_flags"] = False
+            psfComboModel = ms.FitComboAlgorithm.computePsfFactor(self.comboCtrl, psfModel, psfComponents,
+                                                                   self.psf, center)
+            row["combo_psfFactor"] = psfComboModel.flux
+        except lsst.pex.exceptions.Exception:
+            return FAILED
+        return DONE
+
+def clearRows(rows):
+    """Reset result rows to NaN values and set flags, before fitting."""
+    for name in rows.dtype.names:
+        kind = rows.dtype[name].base.kind
+        if kind == "f":
+            rows[name] = numpy.nan
+        elif kind == "b":
+            rows[name] = True
+    rows["status"] = PENDING
+
+def markCrashed(outputDir, entry, n):
+    """Reset a source's result row to NaN values and set flags, with status CRASHED.
+
+    This is done by the parent, as the worker that was fitting the source may have died after
+    writing only part of its row.
+    """
+    results = numpy.load(os.path.join(outputDir, entry["results"]), mmap_mode="r+")
+    row = results[n:n+1]
+    clearRows(row)
+    row["status"] = CRASHED
+    results.flush()
+    del results
+
+def runWorker(config, manifest, outputDir, conn):
+    """Worker process entry point: fit the chunks sent over conn until None is received.
+
+    For each chunk (exposure index, list of source indices), the results are written to the
+    exposure's buffer, flushed, and then recorded in the journal; "done" is sent back when
+    the chunk is complete.
+    """
+    signal.signal(signal.SIGINT, signal.SIG_IGN)  # the parent handles interrupts
+    journal = Journal(os.path.join(outputDir, "journal"))
+    fitters = {}
+    buffers = {}
+    while True:
+        task = conn.recv()
+        if task is None:
+            break
+        k, indices = task
+        if k not in fitters:
+            # only keep one exposure in memory at a time
+            fitters.clear()
+            buffers.clear()
+            entry = manifest["exposures"][k]
+            fitters[k] = Fitter(config, entry["exposure"], entry["catalog"])
+            buffers[k] = numpy.load(os.path.join(outputDir, entry["results"]), mmap_mode="r+")
+        fitter = fitters[k]
+        results = buffers[k]
+        entries = []
+        for n in indices:
+            row = results[n:n+1]
+            clearRows(row)
+            t0 = time.time()
+            try:
+                status = fitter.fit(n, row)
+            except lsst.pex.exceptions.Exception:
+                status = FAILED
+            row["seconds"] = time.time() - t0
+            row["status"] = status
+            entries.append((k, n, status))
+        results.flush()
+        journal.append(entries)
+        conn.send("done")
+    journal.close()
+
+#-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+class Worker(object):
+    """A worker process, as seen from the parent."""
+
+    def __init__(self, config, manifest, outputDir):
+        self.conn, child = multiprocessing.Pipe()
+        self.process = multiprocessing.Process(target=runWorker, args=(config, manifest, outputDir, child))
+        self.process.daemon = True
+        self.process.start()
+        self.task = None
+        self.deadline = None
+
+    def send(self, task, timeout):
+        self.task = task
+        self.deadline = time.time() + timeout * len(task[1]) if timeout else None
+        self.conn.send(task)
+
+    def stop(self):
+        try:
+            self.conn.send(None)
+        except (IOError, OSError):
+            pass
+        self.process.join(5.0)
+        if self.process.is_alive():
+            self.process.terminate()
+
+    def kill(self):
+        self.process.terminate()
+        self.process.join()
+
+def prepare(options, args, config):
+    """Create the output directory, catalogs and result buffers, or load them to resume."""
+    outputDir = args[0]
+    manifestPath = os.path.join(outputDir, "manifest.json")
+    if os.path.exists(manifestPath):
+        with open(manifestPath, "r") as f:
+            manifest = json.load(f)
+        if len(args) > 1 and args[1:] != manifest["arguments"]:
+            raise RuntimeError("Output directory %s was created for different inputs" % outputDir)
+        return outputDir, manifest
+    if len(args) < 2:
+        raise RuntimeError("No exposures given, and no manifest to resume from in %s" % outputDir)
+    if not os.path.isdir(outputDir):
+        os.makedirs(outputDir)
+    config.save(os.path.join(outputDir, "config.py"))
+    dtype = makeDType(config)
+    manifest = {"arguments": args[1:], "exposures": [], "columns": dtype.descr}
+    for k, arg in enumerate(args[1:]):
+        exposurePath, sep, catalogPath = arg.partition(":")
+        exposurePath = os.path.abspath(exposurePath)
+        if catalogPath:
+            catalogPath = os.path.abspath(catalogPath)
+        else:
+            catalogPath = os.path.join(outputDir, "%d.sources.fits" % k)
+            detect(exposurePath, catalogPath)
+        nSources = len(lsst.afw.table.SourceCatalog.readFits(catalogPath))
+        results = "%d.results.npy" % k
+        buffer = numpy.lib.format.open_memmap(os.path.join(outputDir, results), mode="w+",
+                                              dtype=dtype, shape=(nSources,))
+        clearRows(buffer)
+        buffer.flush()
+        del buffer
+        manifest["exposures"].append({"exposure": exposurePath, "catalog": catalogPath,
+                                      "results": results, "sources": nSources})
+    # written last, so an interrupted setup is just started over
+    with open(manifestPath + ".tmp", "w") as f:
+        json.dump(manifest, f, indent=1)
+    os.rename(manifestPath + ".tmp", manifestPath)
+    return outputDir, manifest
+
+def detect(exposurePath, catalogPath):
+    """Detect and measure sources (without the multiShapelet algorithms) and write the catalog."""
+    exposure = lsst.afw.image.ExposureF(exposurePath)
+    schema = lsst.afw.table.SourceTable.makeMinimalSchema()
+    detectionTask = lsst.meas.algorithms.SourceDetectionTask(schema=schema)
+    measureConfig = lsst.meas.algorithms.SourceMeasurementConfig()
+    measureConfig.algorithms.names -= ms.algorithms
+    measureTask = lsst.meas.algorithms.SourceMeasurementTask(schema=schema, config=measureConfig)
+    table = lsst.afw.table.SourceTable.make(schema)
+    sources = detectionTask.makeSourceCatalog(table, exposure).sources
+    measureTask.run(exposure, sources)
+    sources.writeFits(catalogPath)
+
+def run(options, config, outputDir, manifest):
+    """Distribute the sources not yet in the journal over the workers; return a summary dict."""
+    journal = Journal(os.path.join(outputDir, "journal"))
+    completed = journal.read()
+    pending = []   # chunks, in order; crashed chunks are split and put at the front
+    for k, entry in enumerate(manifest["exposures"]):
+        indices = [n for n in range(entry["sources"]) if (k, n) not in completed]
+        for i in range(0, len(indices), options.chunk):
+            pending.append((k, indices[i:i + options.chunk]))
+    skipped = len(completed)
+    crashed = 0
+    nWorkers = options.processes if options.processes > 0 else multiprocessing.cpu_count()
+    workers = [Worker(config, manifest, outputDir) for i in range(min(nWorkers, len(pending)))]
+    t0 = time.time()
+    try:
+        while workers:
+            for i, worker in enumerate(workers):
+                if worker.task is None:
+                    if pending:
+                        worker.send(pending.pop(0), options.timeout)
+                    else:
+                        worker.stop()
+                        workers[i] = None
+                    continue
+                if worker.conn.poll():
+                    try:
+                        worker.conn.recv()
+                        worker.task = None
+                        continue
+                    except EOFError:
+                        pass  # the worker died; handled below
+                elif worker.process.is_alive() and (worker.deadline is None or time.time() < worker.deadline):
+                    continue
+                # The worker died or timed out in the middle of a chunk.
+                worker.kill()
+                k, indices = worker.task
+                if len(indices) > 1:
+                    # retry one at a time, to find the source responsible
+                    pending[0:0] = [(k, [n]) for n in indices]
+                else:
+                    markCrashed(outputDir, manifest["exposures"][k], indices[0])
+                    journal.append([(k, indices[0], CRASHED)])
+                    crashed += 1
+                    print("source %d of exposure %d crashed or timed out; skipping it" % (indices[0], k),
+                          file=sys.stderr)
+                workers[i] = Worker(config, manifest, outputDir)
+            workers = [worker for worker in workers if worker is not None]
+            time.sleep(0.01)
+    except KeyboardInterrupt:
+        for worker in workers:
+            if worker is not None:  # stopped, but not yet removed from the list
+                worker.kill()
+        print("interrupted; rerun with the same output directory to resume", file=sys.stderr)
+        raise
+    finally:
+        journal.close()
+    counts = {}
+    for status in Journal(os.path.join(outputDir, "journal")).read().values():
+        counts[status] = counts.get(status, 0) + 1
+    return {
+        "seconds": time.time() - t0,
+        "processes": nWorkers,
+        "skipped": skipped,
+        "crashed": crashed,
+        "done": counts.get(DONE, 0),
+        "failed": counts.get(FAILED, 0),
+        "total": sum(entry["sources"] for entry in manifest["exposures"]),
+    }
+
+def main():
+    parser = optparse.OptionParser(usage=__doc__)
+    parser.add_option("-j", "--processes", type=int, default=0,
+                      help="number of worker processes (default: one per CPU)")
+    parser.add_option("--chunk", type=int, default=16,
+                      help="number of sources handed to a worker at a time")
+    parser.add_option("--timeout", type=float, default=60.0,
+                      help="seconds allowed per source before its worker is killed (0 for no limit)")
+    parser.add_option("--config", default=None,
+                      help="SourceMeasurementConfig override file for the multiShapelet algorithms")
+    options, args = parser.parse_args()
+    if not args:
+        parser.error("no output directory given")
+    outputDir = args[0]
+    savedConfig = os.path.join(outputDir, "config.py")
+    if os.path.exists(savedConfig):
+        if options.config is not None:
+            parser.error("cannot change the configuration of an existing run")
+        config = makeConfig(savedConfig)
+    else:
+        config = makeConfig(options.config)
+    outputDir, manifest = prepare(options, args, config)
+    summary = run(options, config, outputDir, manifest)
+    json.dump(summary, sys.stdout, indent=1, sort_keys=True)
+    print()
+
+if __name__ == "__main__":
+    main()
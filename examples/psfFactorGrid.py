@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+"""
+Validation benchmark for the interpolated PSF factor (the psfFactorGrid control fields
+of FitProfileControl and FitComboControl).
+
+We build a synthetic exposure with a spatially-varying PSF and a population of exponential
+and de Vaucouleur galaxies, and measure it twice: once with the per-source PSF factor
+fits (the reference) and once with the PSF factor interpolated from a grid.  We report
+the measurement time of each and the differences between their PSF factors.
+"""
+
+import time
+import optparse
+import numpy
+
+import lsst.afw.geom as geom
+import lsst.afw.image
+import lsst.afw.math
+import lsst.afw.table
+import lsst.afw.detection
+import lsst.meas.algorithms
+import lsst.meas.extensions.multiShapelet as ms
+
+PROFILES = ("multishapelet.exp", "multishapelet.dev", "multishapelet.combo")
+
+def makePsf(width, height, size=25, sigma=1.5, gradient=0.5):
+    """Return a double-Gaussian PCA PSF whose wings get stronger across the image."""
+    basis = lsst.afw.math.KernelList()
+    for s in (sigma, 2.0 * sigma):
+        basis.append(lsst.afw.math.AnalyticKernel(size, size, lsst.afw.math.GaussianFunction2D(s, s, 0.0)))
+    kernel = lsst.afw.math.LinearCombinationKernel(basis, lsst.afw.math.PolynomialFunction2D(1))
+    kernel.setSpatialParameters([[1.0, 0.0, 0.0], [0.1, gradient / width, gradient / height]])
+    return lsst.afw.detection.createPsf("PCA", kernel)
+
+def makeExposure(width, height, nGalaxies, noise, seed=5):
+    numpy.random.seed(seed)
+    exposure = lsst.afw.image.ExposureF(width, height)
+    psf = makePsf(width, height)
+    exposure.setPsf(psf)
+    image = lsst.afw.image.ImageD(exposure.getMaskedImage().getBBox(lsst.afw.image.PARENT))
+    psfCtrl = ms.FitPsfControl()
+    margin = 30
+    for n in range(nGalaxies):
+        center = geom.Point2D(numpy.random.uniform(margin, width - margin),
+                              numpy.random.uniform(margin, height - margin))
+        psfModel = ms.FitPsfAlgorithm.apply(psfCtrl, psf, center)
+        ctrl = (ms.FitExponentialConfig() if n % 2 else ms.FitDeVaucouleurConfig()).makeControl()
+        parameters = numpy.array([numpy.random.uniform(-0.5, 0.5), numpy.random.uniform(-0.5, 0.5),
+                                  numpy.log(numpy.random.uniform(1.0, 5.0))])
+        model = ms.FitProfileModel(ctrl, numpy.random.uniform(500.0, 5000.0), parameters)
+        model.asMultiShapelet(center).convolve(psfModel.asMultiShapelet()).evaluate().addToImage(image)
+    mi = exposure.getMaskedImage()
+    mi.getImage().getArray()[:,:] = image.getArray() + numpy.random.randn(height, width) * noise
+    mi.getVariance().getArray()[:,:] = noise**2
+    return exposure
+
+def measure(exposure, useGrid):
+    schema = lsst.afw.table.SourceTable.makeMinimalSchema()
+    detectionTask = lsst.meas.algorithms.SourceDetectionTask(schema=schema)
+    config = lsst.meas.algorithms.SourceMeasurementConfig()
+    config.algorithms.names |= ms.algorithms
+    for name in PROFILES:
+        config.algorithms[name].psfFactorGrid = useGrid
+    measureTask = lsst.meas.algorithms.SourceMeasurementTask(schema=schema, config=config)
+    table = lsst.afw.table.SourceTable.make(schema)
+    sources = detectionTask.makeSourceCatalog(table, exposure).sources
+    t0 = time.time()
+    measureTask.run(exposure, sources)
+    elapsed = time.time() - t0
+    results = {}
+    for name in PROFILES:
+        key = schema.find(name + ".psffactor").key
+        flagKey = schema.find(name + ".flags.psffactor").key
+        results[name] = (numpy.array([record.get(key) for record in sources]),
+                         numpy.array([record.get(flagKey) for record in sources]))
+    return elapsed, len(sources), results
+
+def main():
+    parser = optparse.OptionParser(usage=__doc__)
+    parser.add_option("--width", type=int, default=1024, help="width of the synthetic exposure")
+    parser.add_option("--height", type=int, default=1024, help="height of the synthetic exposure")
+    parser.add_option("--galaxies", type=int, default=200, help="number of galaxies to simulate")
+    parser.add_option("--noise", type=float, default=5.0, help="per-pixel noise sigma")
+    options, args = parser.parse_args()
+    exposure = makeExposure(options.width, options.height, options.galaxies, options.noise)
+    refTime, nSources, reference = measure(exposure, False)
+    gridTime, nGridSources, grid = measure(exposure, True)
+    assert nSources == nGridSources
+    print "%d sources: per-source %.2fs, grid %.2fs (%.2fx faster)" % (
+        nSources, refTime, gridTime, refTime / gridTime)
+    for name in PROFILES:
+        refValues, refFlags = reference[name]
+        gridValues, gridFlags = grid[name]
+        good = numpy.logical_and(numpy.logical_not(refFlags), numpy.logical_not(gridFlags))
+        diff = (gridValues[good] - refValues[good]) / refValues[good]
+        print "%s: %d compared, relative PSF factor difference max=%g rms=%g" % (
+            name, good.sum(), numpy.abs(diff).max(), (diff**2).mean()**0.5)
+
+if __name__ == "__main__":
+    main()
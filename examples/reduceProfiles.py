@@ -0,0 +1,246 @@
+#!/usr/bin/env python
+"""
+Fit multi-Gaussian profile approximations with fewer components than the Tractor profiles in
+data/tractor.p, and report the speed/accuracy trade-off.
+
+The cost of fitting a profile with MultiGaussianObjective is proportional to the number of
+profile components times the number of PSF components, so dropping from the 8 Tractor
+components to 3 or 4 makes the nonlinear fit several times faster.
+
+Each reduced profile is fit to the corresponding Tractor profile (which has unit half-light
+radius) by minimizing the error metric
+
+    E = sqrt( integral[ (m(r) - t(r))^2 (2 pi r)^2 dr ] / integral[ t(r)^2 (2 pi r)^2 dr ] )
+
+over 0 <= r <= RMAX, where m is the reduced profile and t the Tractor profile.  This is the
+relative L2 error in the flux per unit radius, so it doesn't let the steep centers of the
+profiles dominate the fit at the expense of the half-light radius.  The Gaussian
+fluxes are solved for linearly at each step, and the log-radii are fit with Levenberg-Marquardt.
+Only numpy is needed for the fits; we also report the error relative to the exact Sersic profile
+(with the same metric) and the half-light radius of each approximation.
+
+The results are written to data/reduced.mgp, with names like "tractor-exponential-4", in the
+binary profile format described in MultiGaussianRegistry.h; the registry reads that file the
+first time a profile that isn't built in is looked up.  Set FitProfileControl.profile to one of
+those names to use it.  If the LSST stack is set up, --timing will also time
+FitProfileAlgorithm.apply on a simulated galaxy with each profile.
+"""
+from __future__ import print_function
+
+import os
+import time
+import struct
+import optparse
+import numpy
+
+try:
+    import cPickle as pickle
+except ImportError:
+    import pickle
+
+RMAX = {"tractor-exponential": 4.0, "tractor-devaucouleur": 8.0}
+
+# kappa = gammaincinv(2n, 0.5), so the exact profiles have unit half-light radius
+SERSIC_INDEX = {"tractor-exponential": 1.0, "tractor-devaucouleur": 4.0}
+SERSIC_KAPPA = {"tractor-exponential": 1.678346990016661, "tractor-devaucouleur": 7.669249442500805}
+
+COMPONENT_COUNTS = (3, 4, 6)
+
+# must match MultiGaussianRegistry.cc
+PROFILE_FILE_MAGIC = b"MSPROFIL"
+PROFILE_FILE_VERSION = 1
+
+def evaluateMixture(r, flux, sigma):
+    """Evaluate a circular Gaussian mixture at the radii r."""
+    return (numpy.exp(-0.5 * numpy.divide.outer(r, sigma)**2) * flux / (2.0 * numpy.pi * sigma**2)).sum(axis=1)
+
+def computeHalfLightRadius(flux, sigma):
+    """Return the radius that encloses half of the flux of a circular Gaussian mixture."""
+    def enclosed(r):
+        return (flux * (1.0 - numpy.exp(-0.5 * (r / sigma)**2))).sum()
+    target = 0.5 * flux.sum()
+    lower, upper = 0.0, 10.0 * sigma.max()
+    for i in range(100):
+        middle = 0.5 * (lower + upper)
+        if enclosed(middle) < target:
+            lower = middle
+        else:
+            upper = middle
+    return 0.5 * (lower + upper)
+
+class ProfileFitter(object):
+    """Fit a K-component Gaussian mixture to a target radial profile under the error metric E."""
+
+    def __init__(self, target, rMax, nPoints=4000):
+        self.r = numpy.linspace(0.0, rMax, nPoints + 1)[1:]
+        dr = self.r[1] - self.r[0]
+        self.weights = 2.0 * numpy.pi * self.r * dr**0.5
+        self.target = target(self.r)
+        self.targetNorm = (self.weights * self.target).dot(self.weights * self.target)**0.5
+        # keep the radii within a range the grid can resolve
+        self.minLogSigma = numpy.log(0.5 * dr)
+        self.maxLogSigma = numpy.log(rMax)
+
+    def solveFluxes(self, logSigma):
+        """Return the best-fit fluxes and the weighted residuals for the given log-radii."""
+        sigma = numpy.exp(logSigma)
+        basis = numpy.exp(-0.5 * numpy.divide.outer(self.r, sigma)**2) / (2.0 * numpy.pi * sigma**2)
+        a = basis * self.weights[:,numpy.newaxis]
+        b = self.target * self.weights
+        flux = numpy.linalg.lstsq(a, b, rcond=None)[0]
+        return flux, a.dot(flux) - b
+
+    def computeError(self, flux, sigma):
+        residuals = self.weights * (evaluateMixture(self.r, flux, sigma) - self.target)
+        return residuals.dot(residuals)**0.5 / self.targetNorm
+
+    def fit(self, logSigma, maxIter=200, eps=1E-6):
+        """Levenberg-Marquardt fit of the log-radii, with fluxes solved for linearly."""
+        logSigma = numpy.array(logSigma, dtype=float)
+        flux, residuals = self.solveFluxes(logSigma)
+        chisq = residuals.dot(residuals)
+        damping = 1E-3
+        for iteration in range(maxIter):
+            jacobian = numpy.zeros((residuals.size, logSigma.size), dtype=float)
+            for k in range(logSigma.size):
+                step = logSigma.copy()
+                step[k] += eps
+                jacobian[:,k] = (self.solveFluxes(step)[1] - residuals) / eps
+            h = jacobian.T.dot(jacobian)
+            g = jacobian.T.dot(residuals)
+            improved = False
+            while damping < 1E10:
+                step = numpy.linalg.lstsq(h + damping * numpy.diag(numpy.diag(h)), g, rcond=None)[0]
+                trial = numpy.clip(logSigma - step, self.minLogSigma, self.maxLogSigma)
+                trialFlux, trialResiduals = self.solveFluxes(trial)
+                trialChiSq = trialResiduals.dot(trialResiduals)
+                if trialChiSq < chisq:
+                    improved = chisq - trialChiSq > 1E-12 * chisq
+                    logSigma, flux, residuals, chisq = trial, trialFlux, trialResiduals, trialChiSq
+                    damping *= 0.3
+                    break
+                damping *= 10.0
+            if not improved:
+                break
+        order = numpy.argsort(logSigma)
+        return flux[order], numpy.exp(logSigma[order])
+
+def makeExactSersic(name):
+    n = SERSIC_INDEX[name]
+    kappa = SERSIC_KAPPA[name]
+    def profile(r):
+        return numpy.exp(-kappa * (r**(1.0 / n) - 1.0))
+    return profile
+
+def reduceProfile(name, flux, sigma, nComponents):
+    """Return (flux, sigma) of an nComponents-Gaussian approximation to the given mixture."""
+    fitter = ProfileFitter(lambda r: evaluateMixture(r, flux, sigma), RMAX[name])
+    # start from radii spread evenly (in log) over the range of the reference components
+    logSigma = numpy.interp(numpy.linspace(0, sigma.size - 1, nComponents),
+                            numpy.arange(sigma.size), numpy.log(sigma))
+    reducedFlux, reducedSigma = fitter.fit(logSigma)
+    if (reducedFlux <= 0.0).any():
+        raise RuntimeError("Best-fit %d-component approximation to %s has non-positive fluxes"
+                           % (nComponents, name))
+    return reducedFlux, reducedSigma
+
+def reportAccuracy(name, flux, sigma, reference):
+    """Return a dict of accuracy metrics for a mixture relative to the reference and exact profiles."""
+    refFlux, refSigma = reference
+    mixtureFitter = ProfileFitter(lambda r: evaluateMixture(r, refFlux, refSigma), RMAX[name])
+    exactFitter = ProfileFitter(makeExactSersic(name), RMAX[name])
+    # the exact profile isn't normalized, so compare shapes after scaling to the best-fit amplitude
+    exact = exactFitter.target * exactFitter.weights
+    model = evaluateMixture(exactFitter.r, flux, sigma) * exactFitter.weights
+    scale = exact.dot(model) / model.dot(model)
+    return {
+        "components": flux.size,
+        "tractorError": mixtureFitter.computeError(flux, sigma),
+        "exactError": exactFitter.computeError(flux * scale, sigma),
+        "halfLightRadius": computeHalfLightRadius(flux, sigma),
+        "relativeCost": flux.size / float(refFlux.size),
+    }
+
+def writeProfileFile(filename, profiles):
+    """Write a dict of {name: (flux, radius)} to a profile file readable by MultiGaussianRegistry.
+
+    Fluxes are normalized to unit total.
+    """
+    with open(filename, "wb") as f:
+        f.write(struct.pack("<8sII", PROFILE_FILE_MAGIC, PROFILE_FILE_VERSION, len(profiles)))
+        for name in sorted(profiles):
+            flux, radius = profiles[name]
+            flux = numpy.asarray(flux, dtype=float)
+            radius = numpy.asarray(radius, dtype=float)
+            encoded = name.encode("ascii")
+            f.write(struct.pack("<II", len(encoded), flux.size))
+            f.write(encoded + b"\0" * (-len(encoded) % 8))
+            f.write((flux / flux.sum()).astype("<f8").tobytes())
+            f.write(radius.astype("<f8").tobytes())
+
+def timeProfiles(names, repeat):
+    """Time FitProfileAlgorithm.apply on a simulated galaxy for each profile name."""
+    import lsst.afw.geom as geom
+    import lsst.afw.image
+    import lsst.afw.detection
+    import lsst.meas.extensions.multiShapelet as ms
+    center = geom.Point2D(40.0, 40.0)
+    bbox = geom.Box2I(geom.Point2I(0, 0), geom.Extent2I(80, 80))
+    psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+    psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, center)
+    truth = ms.FitProfileModel(ms.FitExponentialConfig().makeControl(), 1000.0,
+                               numpy.array([0.2, -0.1, numpy.log(4.0)]))
+    image = lsst.afw.image.ImageD(bbox)
+    truth.asMultiShapelet(center).convolve(psfModel.asMultiShapelet()).evaluate().addToImage(image)
+    inputs = ms.ModelInputHandler(image, center, bbox)
+    initial = ms.MultiGaussianObjective.EllipseCore(truth.ellipse)
+    times = {}
+    for name in names:
+        ctrl = ms.FitProfileControl()
+        ctrl.profile = name
+        t0 = time.time()
+        for i in range(repeat):
+            ms.FitProfileAlgorithm.apply(ctrl, psfModel, initial, inputs)
+        times[name] = (time.time() - t0) / repeat
+    return times
+
+def main():
+    parser = optparse.OptionParser(usage=__doc__)
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.path.pardir, "data")
+    parser.add_option("--input", default=os.path.join(root, "tractor.p"),
+                      help="pickle of reference profiles")
+    parser.add_option("--output", default=os.path.join(root, "reduced.mgp"),
+                      help="profile file to write reduced profiles to")
+    parser.add_option("--timing", action="store_true", default=False,
+                      help="time FitProfileAlgorithm.apply with each profile (requires the LSST stack)")
+    parser.add_option("--repeat", type=int, default=20, help="number of fits to time for each profile")
+    options, args = parser.parse_args()
+    with open(options.input, "rb") as f:
+        try:
+            references = pickle.load(f, encoding="latin1")
+        except TypeError:
+            references = pickle.load(f)
+    results = {}
+    report = []
+    for name in sorted(references):
+        refFlux, refSigma = references[name]
+        refFlux = numpy.asarray(refFlux, dtype=float)
+        refSigma = numpy.asarray(refSigma, dtype=float)
+        report.append((name, reportAccuracy(name, refFlux, refSigma, (refFlux, refSigma))))
+        for nComponents in COMPONENT_COUNTS:
+            flux, sigma = reduceProfile(name, refFlux, refSigma, nComponents)
+            reducedName = "%s-%d" % (name, nComponents)
+            results[reducedName] = (flux, sigma)
+            report.append((reducedName, reportAccuracy(name, flux, sigma, (refFlux, refSigma))))
+    writeProfileFile(options.output, results)
+    times = timeProfiles([name for name, metrics in report], options.repeat) if options.timing else {}
+    print("%-28s %5s %12s %12s %10s %8s %10s" % ("profile", "n", "E(tractor)", "E(exact)", "r_half",
+                                                "cost", "time (ms)"))
+    for name, metrics in report:
+        print("%-28s %5d %12.3g %12.3g %10.4f %8.3f %10s" % (
+            name, metrics["components"], metrics["tractorError"], metrics["exactError"],
+            metrics["halfLightRadius"], metrics["relativeCost"],
+            ("%.2f" % (1E3 * times[name])) if name in times else "-"))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,246 @@
+#!/usr/bin/env python
+"""
+End-to-end throughput benchmark for the multiShapelet algorithms on a synthetic exposure.
+
+We build an in-memory exposure with a known double-Gaussian PSF, a population of exponential
+and de Vaucouleur galaxies and stars (some fraction of them placed close to a neighbor, so
+their footprints merge), and masked pixels (cosmic ray tracks and saturated blobs), and then:
+
+ - detect and measure it with SourceMeasurementTask, running all the multiShapelet
+   algorithms as configured for production; this is the real per-source _apply path, and
+   we report the total time and sources/second.
+
+ - replay the measurement of each source through the same static entry points _apply calls
+   (adjustInputs, apply and computePsfFactor for each algorithm), timing each stage
+   separately; we report the total and mean time of each stage, the number of failures, and
+   percentiles of the per-source latency (the sum of all stages).
+
+We also report the peak resident memory of the process.  The results are written as JSON
+(to stdout, or to --output), so they can be compared between runs.  No external data or
+butler is needed.
+"""
+from __future__ import print_function
+
+import sys
+import time
+import json
+import resource
+import optparse
+import numpy
+
+import lsst.afw.geom as geom
+import lsst.afw.geom.ellipses
+import lsst.afw.image
+import lsst.afw.table
+import lsst.afw.detection
+import lsst.pex.exceptions
+import lsst.meas.algorithms
+import lsst.meas.extensions.multiShapelet as ms
+
+PROFILES = ("multishapelet.exp", "multishapelet.dev")
+
+def makeExposure(options):
+    """Return an ExposureF with the configured PSF, sources, masked pixels and noise."""
+    rng = numpy.random.RandomState(options.seed)
+    width, height = options.width, options.height
+    exposure = lsst.afw.image.ExposureF(width, height)
+    psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, options.psf_sigma,
+                                       2.0 * options.psf_sigma, 0.1)
+    exposure.setPsf(psf)
+    image = lsst.afw.image.ImageD(exposure.getMaskedImage().getBBox(lsst.afw.image.PARENT))
+    psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, geom.Point2D(0.5 * width, 0.5 * height))
+    psfShapelets = psfModel.asMultiShapelet()
+    margin = 30
+    centers = []
+    for n in range(options.galaxies + options.stars):
+        if centers and rng.uniform() < options.crowding:
+            # put this source close enough to an existing one that their footprints merge
+            neighbor = centers[rng.randint(len(centers))]
+            offset = rng.uniform(3.0, 10.0)
+            angle = rng.uniform(0.0, 2.0 * numpy.pi)
+            x = numpy.clip(neighbor.getX() + offset * numpy.cos(angle), margin, width - margin)
+            y = numpy.clip(neighbor.getY() + offset * numpy.sin(angle), margin, height - margin)
+        else:
+            x = rng.uniform(margin, width - margin)
+            y = rng.uniform(margin, height - margin)
+        center = geom.Point2D(x, y)
+        centers.append(center)
+        if n < options.galaxies:
+            ctrl = (ms.FitExponentialConfig() if n % 2 else ms.FitDeVaucouleurConfig()).makeControl()
+            parameters = numpy.array([rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5),
+                                      numpy.log(rng.uniform(1.0, 5.0))])
+        else:
+            # a point source is just a very small galaxy
+            ctrl = ms.FitExponentialConfig().makeControl()
+            parameters = numpy.array([0.0, 0.0, numpy.log(1E-3)])
+        model = ms.FitProfileModel(ctrl, rng.uniform(500.0, 5000.0), parameters)
+        model.asMultiShapelet(center).convolve(psfShapelets).evaluate().addToImage(image)
+    mi = exposure.getMaskedImage()
+    mi.getImage().getArray()[:,:] = image.getArray() + rng.randn(height, width) * options.noise
+    mi.getVariance().getArray()[:,:] = options.noise**2
+    mask = mi.getMask()
+    maskArray = mask.getArray()
+    crBit = mask.getPlaneBitMask("CR")
+    satBit = mask.getPlaneBitMask("SAT")
+    nMasked = int(options.mask_fraction * width * height)
+    while nMasked > 0:
+        x0, y0 = rng.randint(width), rng.randint(height)
+        if rng.uniform() < 0.5:
+            # a cosmic ray track
+            length = rng.randint(5, 30)
+            angle = rng.uniform(0.0, numpy.pi)
+            xs = numpy.clip((x0 + numpy.arange(length) * numpy.cos(angle)).astype(int), 0, width - 1)
+            ys = numpy.clip((y0 + numpy.arange(length) * numpy.sin(angle)).astype(int), 0, height - 1)
+            maskArray[ys, xs] |= crBit
+            nMasked -= length
+        else:
+            # a saturated blob
+            r = rng.randint(2, 6)
+            maskArray[max(y0 - r, 0):y0 + r + 1, max(x0 - r, 0):x0 + r + 1] |= satBit
+            nMasked -= (2 * r + 1)**2
+    return exposure
+
+def makeConfig():
+    config = lsst.meas.algorithms.SourceMeasurementConfig()
+    config.algorithms.names |= ms.algorithms
+    return config
+
+def measure(exposure, config):
+    """Detect and measure the exposure with SourceMeasurementTask; return (sources, seconds)."""
+    schema = lsst.afw.table.SourceTable.makeMinimalSchema()
+    detectionTask = lsst.meas.algorithms.SourceDetectionTask(schema=schema)
+    measureTask = lsst.meas.algorithms.SourceMeasurementTask(schema=schema, config=config)
+    table = lsst.afw.table.SourceTable.make(schema)
+    sources = detectionTask.makeSourceCatalog(table, exposure).sources
+    t0 = time.time()
+    measureTask.run(exposure, sources)
+    return sources, time.time() - t0
+
+class StageTimer(object):
+    """Accumulate the time spent in each stage, for all sources and for the current one."""
+
+    def __init__(self):
+        self.totals = {}
+        self.counts = {}
+        self.failures = {}
+        self.current = 0.0
+
+    def __call__(self, stage, func, *args):
+        t0 = time.time()
+        try:
+            return func(*args)
+        except lsst.pex.exceptions.Exception:
+            self.failures[stage] = self.failures.get(stage, 0) + 1
+            raise
+        finally:
+            elapsed = time.time() - t0
+            self.totals[stage] = self.totals.get(stage, 0.0) + elapsed
+            self.counts[stage] = self.counts.get(stage, 0) + 1
+            self.current += elapsed
+
+    def getStages(self):
+        return dict((stage, {"seconds": self.totals[stage],
+                             "meanMilliseconds": 1E3 * self.totals[stage] / self.counts[stage],
+                             "calls": self.counts[stage],
+                             "failures": self.failures.get(stage, 0)})
+                    for stage in self.totals)
+
+def replay(exposure, sources, config):
+    """Measure each source through the static entry points used by _apply, timing each stage.
+
+    Returns the StageTimer and an array of per-source latencies (seconds).
+    """
+    psf = exposure.getPsf()
+    mi = exposure.getMaskedImage()
+    psfCtrl = config.algorithms["multishapelet.psf"].makeControl()
+    profileCtrls = [config.algorithms[name].makeControl() for name in PROFILES]
+    comboCtrl = config.algorithms["multishapelet.combo"].makeControl()
+    timer = StageTimer()
+    latencies = []
+    for source in sources:
+        timer.current = 0.0
+        center = source.getCentroid()
+        try:
+            psfModel = timer("psf", ms.FitPsfAlgorithm.apply, psfCtrl, psf, center)
+            if psfModel.hasFailed():
+                continue
+            components = ms.FitProfileModelList()
+            psfComponents = ms.FitProfileModelList()
+            for name, ctrl in zip(PROFILES, profileCtrls):
+                # adjustInputs modifies the shape in place, as in _apply
+                shape = geom.ellipses.Quadrupole(psfModel.ellipse if source.getShapeFlag()
+                                                 else source.getShape())
+                inputs = timer(name + ".inputs", ms.FitProfileAlgorithm.adjustInputs,
+                               ctrl, psfModel, shape, source.getFootprint(), mi, center)
+                model = timer(name + ".fit", ms.FitProfileAlgorithm.apply, ctrl, psfModel,
+                              ms.MultiGaussianObjective.EllipseCore(shape), inputs)
+                psfFactor = timer(name + ".psfFactor", ms.FitProfileAlgorithm.computePsfFactor,
+                                  ctrl, psfModel, psf, center)
+                components.append(model)
+                psfComponents.append(psfFactor)
+            if any(model.fluxFlag for model in components):
+                continue
+            inputs = timer("multishapelet.combo.inputs", ms.FitComboAlgorithm.adjustInputs,
+                           comboCtrl, psfModel, components, source.getFootprint(), mi, center)
+            timer("multishapelet.combo.fit", ms.FitComboAlgorithm.apply, comboCtrl, psfModel,
+                  components, inputs)
+            timer("multishapelet.combo.psfFactor", ms.FitComboAlgorithm.computePsfFactor,
+                  comboCtrl, psfModel, psfComponents, psf, center)
+        except lsst.pex.exceptions.Exception:
+            pass # recorded by the timer; _apply would set the failure flags and move on
+        finally:
+            latencies.append(timer.current)
+    return timer, numpy.array(latencies)
+
+def main():
+    parser = optparse.OptionParser(usage=__doc__)
+    parser.add_option("--width", type=int, default=2048, help="width of the synthetic exposure")
+    parser.add_option("--height", type=int, default=2048, help="height of the synthetic exposure")
+    parser.add_option("--galaxies", type=int, default=300, help="number of galaxies to simulate")
+    parser.add_option("--stars", type=int, default=100, help="number of stars to simulate")
+    parser.add_option("--crowding", type=float, default=0.2,
+                      help="fraction of sources placed next to a previous source")
+    parser.add_option("--mask-fraction", type=float, default=0.002,
+                      help="approximate fraction of pixels to mask as cosmic rays or saturated")
+    parser.add_option("--noise", type=float, default=5.0, help="per-pixel noise sigma")
+    parser.add_option("--psf-sigma", type=float, default=1.5, help="sigma of the inner PSF Gaussian")
+    parser.add_option("--seed", type=int, default=5, help="random number seed")
+    parser.add_option("--output", default=None, help="file to write JSON results to (default stdout)")
+    options, args = parser.parse_args()
+    t0 = time.time()
+    exposure = makeExposure(options)
+    setupTime = time.time() - t0
+    config = makeConfig()
+    sources, taskTime = measure(exposure, config)
+    timer, latencies = replay(exposure, sources, config)
+    nSources = len(sources)
+    stageTime = latencies.sum()
+    results = {
+        "options": vars(options),
+        "sources": nSources,
+        "setupSeconds": setupTime,
+        "task": {
+            "seconds": taskTime,
+            "sourcesPerSecond": nSources / taskTime if taskTime > 0 else None,
+        },
+        "stages": timer.getStages(),
+        "replay": {
+            "seconds": stageTime,
+            "sourcesPerSecond": nSources / stageTime if stageTime > 0 else None,
+        },
+        "latencyMilliseconds": dict(
+            ("p%d" % p, 1E3 * numpy.percentile(latencies, p)) for p in (50, 90, 99)
+        ) if nSources else {},
+        "peakMemoryMegabytes": resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024.0,
+    }
+    if nSources:
+        results["latencyMilliseconds"]["max"] = 1E3 * latencies.max()
+    if options.output is None:
+        json.dump(results, sys.stdout, indent=1, sort_keys=True)
+        print()
+    else:
+        with open(options.output, "w") as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+
+if __name__ == "__main__":
+    main()
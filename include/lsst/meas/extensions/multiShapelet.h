@@ -23,15 +23,28 @@
 #ifndef MULTISHAPELET_multiShapelet_h_INCLUDED
 #define MULTISHAPELET_multiShapelet_h_INCLUDED
 
+#include "lsst/meas/extensions/multiShapelet/BatchRunner.h"
+#include "lsst/meas/extensions/multiShapelet/BoxGridCache.h"
 #include "lsst/meas/extensions/multiShapelet/GaussianModelBuilder.h"
 #include "lsst/meas/extensions/multiShapelet/HybridOptimizer.h"
 #include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussian.h"
+#include "lsst/meas/extensions/multiShapelet/BuiltinProfiles.h"
+#include "lsst/meas/extensions/multiShapelet/MixtureKernel.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianRegistry.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
+#include "lsst/meas/extensions/multiShapelet/ShapeletMatrixBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+#include "lsst/meas/extensions/multiShapelet/StageTimer.h"
 
 #include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGrid.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGridCache.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfBatch.h"
+#include "lsst/meas/extensions/multiShapelet/PsfModelObjective.h"
 #include "lsst/meas/extensions/multiShapelet/FitProfile.h"
+#include "lsst/meas/extensions/multiShapelet/FitProfileBatch.h"
+#include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
 #include "lsst/meas/extensions/multiShapelet/FitCombo.h"
 
 #endif // !MULTISHAPELET_multiShapelet_h_INCLUDED
@@ -0,0 +1,87 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_BatchRunner_h_INCLUDED
+#define MULTISHAPELET_BatchRunner_h_INCLUDED
+
+#include <vector>
+
+#include "boost/function.hpp"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Run independent, indexed tasks on a set of threads.
+ *
+ *  This is the thread pool behind the batch entry points (e.g. FitPsfBatch).  Tasks are
+ *  handed out in index order, or in order of decreasing predicted cost, as threads become
+ *  free.  Tasks should catch their own exceptions; if one escapes anyway, the remaining tasks
+ *  are still run, and a pex::exceptions::RuntimeError with the first message is thrown once
+ *  all threads have finished.
+ *
+ *  Tasks must not call into Python; callers from Python can (and should) release the GIL.
+ *
+ *  ndarray's reference counts aren't atomic, so tasks must not copy or take views of arrays
+ *  that other tasks can reach (such as the columns of a shared results struct); they should
+ *  index into them through raw pointers instead.
+ */
+class BatchRunner {
+public:
+
+    typedef boost::function<void (int)> Task;
+
+    /**
+     *  @brief Call task(n) for every n in [0, size).
+     *
+     *  @param[in] size       Number of tasks.
+     *  @param[in] task       Function to call with each index.
+     *  @param[in] nThreads   Number of threads to use; <= 0 uses the number of hardware threads.
+     *                        If 1 (or size <= 1), tasks are run in the calling thread.
+     */
+    static void run(int size, Task const & task, int nThreads=0);
+
+    /**
+     *  @brief Call task(n) for every n in [0, costs.size()), most expensive first.
+     *
+     *  Starting the most expensive tasks first (longest-processing-time-first scheduling) keeps
+     *  a few large tasks from being left to run alone at the end of a batch, while the other
+     *  threads sit idle.
+     *
+     *  @param[in]  costs      Predicted cost of each task (not NaN); only their order matters.
+     *  @param[in]  task       Function to call with each index.
+     *  @param[in]  nThreads   Number of threads to use; <= 0 uses the number of hardware threads.
+     *  @param[out] times      If not null, resized and set to the wall-clock time (in seconds)
+     *                         spent in each task, for comparison with the predicted costs.
+     */
+    static void run(
+        std::vector<double> const & costs, Task const & task, int nThreads=0,
+        std::vector<double> * times=0
+    );
+
+    /// @brief Return the number of threads run() would use for the given nThreads argument.
+    static int computeThreadCount(int size, int nThreads=0);
+
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_BatchRunner_h_INCLUDED
@@ -0,0 +1,105 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_BoxGridCache_h_INCLUDED
+#define MULTISHAPELET_BoxGridCache_h_INCLUDED
+
+#include "lsst/meas/extensions/multiShapelet/ShapeletMatrixBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Per-thread caches of ShapeletMatrixBuilders for complete pixel boxes.
+ *
+ *  PSF images all have the same dimensions, so the ModelInputHandlers built from them have the
+ *  same pixel grid up to a sub-pixel offset of the center.  Instead of reconstructing builders
+ *  (and their workspaces) for every source, we keep them for each box size, with coordinates
+ *  relative to the first pixel of the box, and shift the ellipse instead.  The centered
+ *  coordinates held by each ModelInputHandler depend on that offset, so they are not cached.
+ *
+ *  Caches are per-thread so no locking is needed to look up or insert entries.
+ */
+class BoxGridCache {
+public:
+
+    /**
+     *  @brief Return a ShapeletMatrixBuilder for the pixels of a ModelInputHandler.
+     *
+     *  When the inputs are a complete box, the cached builder for the box dimensions and order is
+     *  returned, and the ellipse (relative to the center of the inputs on input) is moved to the
+     *  builder's coordinate system.  Otherwise, a new builder is constructed from the input
+     *  coordinates and the ellipse is unchanged.
+     */
+    static PTR(ShapeletMatrixBuilder) getBuilder(
+        ModelInputHandler const & inputs,
+        int order,
+        afw::geom::ellipses::Ellipse & ellipse
+    );
+
+    /**
+     *  @brief Evaluate a weighted shapelet basis on the pixels of a ModelInputHandler.
+     *
+     *  Each row of the matrix is multiplied by the corresponding element of inputs.getWeights(),
+     *  if it is not empty.  When the inputs are a complete box (see
+     *  ModelInputHandler::getBoxDimensions), this uses a cached ShapeletMatrixBuilder for the box
+     *  dimensions and order; otherwise, a new one is constructed from the input coordinates.
+     *
+     *  @param[in]  inputs     Inputs that define the pixel grid.
+     *  @param[in]  order      Shapelet order of the basis.
+     *  @param[in]  ellipse    Basis ellipse, relative to the center of the inputs.
+     *  @param[out] matrix     Matrix with shape (inputs.getSize(), shapelet::computeSize(order)),
+     *                         or fewer rows to fill only the pixels starting at begin.
+     *  @param[in]  begin      Index of the pixel corresponding to the first row of the matrix.
+     */
+    static void fillMatrix(
+        ModelInputHandler const & inputs,
+        int order,
+        afw::geom::ellipses::Ellipse const & ellipse,
+        ndarray::Array<double,2,-1> const & matrix,
+        int begin = 0
+    );
+
+    /**
+     *  @brief Add a weighted shapelet function evaluated on the pixels of a ModelInputHandler to a vector.
+     *
+     *  This is the matrix-free counterpart of fillMatrix (see ShapeletMatrixBuilder::addModel).
+     *
+     *  @param[in]     inputs        Inputs that define the pixel grid.
+     *  @param[in]     order         Shapelet order of the function.
+     *  @param[in]     ellipse       Basis ellipse, relative to the center of the inputs.
+     *  @param[in]     coefficients  Shapelet coefficients.
+     *  @param[in,out] output        Vector with inputs.getSize() elements to add the model to.
+     */
+    static void addModel(
+        ModelInputHandler const & inputs,
+        int order,
+        afw::geom::ellipses::Ellipse const & ellipse,
+        ndarray::Array<double const,1,1> const & coefficients,
+        ndarray::Array<double,1,1> const & output
+    );
+
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_BoxGridCache_h_INCLUDED
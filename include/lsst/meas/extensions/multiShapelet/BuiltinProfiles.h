@@ -0,0 +1,64 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_BuiltinProfiles_h_INCLUDED
+#define MULTISHAPELET_BuiltinProfiles_h_INCLUDED
+
+#include "lsst/meas/extensions/multiShapelet/MultiGaussian.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Static tables for the Tractor exponential profile (from Dustin Lang and David Hogg).
+ *
+ *  The fluxes are normalized to unit total flux, and the radii are relative to the half-light radius
+ *  of the exact profile.  These are the same values as data/tractor.p, compiled into the library so
+ *  MultiGaussianRegistry can find them without loading any data files.
+ */
+struct TractorExponentialProfile {
+    static int const SIZE = 8;
+    static char const * const NAME;
+    static double const FLUX[SIZE];
+    static double const RADIUS[SIZE];
+};
+
+/// @brief Static tables for the Tractor de Vaucouleur profile; see TractorExponentialProfile.
+struct TractorDeVaucouleurProfile {
+    static int const SIZE = 8;
+    static char const * const NAME;
+    static double const FLUX[SIZE];
+    static double const RADIUS[SIZE];
+};
+
+/// @brief Create a MultiGaussian from one of the static profile tables.
+template <typename Profile>
+MultiGaussian makeMultiGaussian() {
+    MultiGaussian result;
+    for (int n = 0; n < Profile::SIZE; ++n) {
+        result.add(GaussianComponent(Profile::FLUX[n], Profile::RADIUS[n]));
+    }
+    return result;
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_BuiltinProfiles_h_INCLUDED
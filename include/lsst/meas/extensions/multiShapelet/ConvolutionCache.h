@@ -0,0 +1,88 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_ConvolutionCache_h_INCLUDED
+#define MULTISHAPELET_ConvolutionCache_h_INCLUDED
+
+#include "lsst/shapelet/MultiShapeletFunction.h"
+#include "lsst/meas/extensions/multiShapelet/FitProfile.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Per-thread cache of normalized profile-PSF convolutions.
+ *
+ *  The linear flux stages of FitProfile and FitCombo convolve the same profile model with the
+ *  same PSF model more than once per source (FitCombo repeats the convolutions done by its
+ *  component FitProfile algorithms, and the PSF factor fits repeat them again at the same point).
+ *  Each convolution involves a MultiGaussianRegistry lookup and several allocations, so we keep
+ *  the most recent results, keyed exactly on the profile name, model ellipse, and PSF model.
+ *
+ *  Because the results are normalized to unit flux, the model flux is not part of the key.
+ *
+ *  The key compares the ellipse parameters and PSF coefficients exactly, with no tolerance.
+ *  The repeated convolutions we want to catch come from the very same model objects (or copies
+ *  of them), so they match bit-for-bit, while rounding the key could return the convolution of
+ *  a slightly different model.  Models from different sources essentially never match, so we
+ *  don't expect hits across sources.
+ *
+ *  Hit and miss counts are kept per thread (so get() never contends for a lock) and summed
+ *  over all threads, including those that have exited, when they are read.
+ */
+class ConvolutionCache {
+public:
+
+    /// @brief Maximum number of convolutions kept per thread.
+    static int const MAX_SIZE = 32;
+
+    /**
+     *  @brief Return model.asMultiShapelet().convolve(psfModel.asMultiShapelet()), normalized to unit flux.
+     *
+     *  The result is centered at the origin, and is shared with the cache; it must not be modified.
+     */
+    static CONST_PTR(shapelet::MultiShapeletFunction) get(
+        FitProfileModel const & model,
+        FitPsfModel const & psfModel
+    );
+
+    /// @brief Number of get() calls that found an existing convolution, summed over threads.
+    static long getHitCount();
+
+    /// @brief Number of get() calls that had to compute a new convolution, summed over threads.
+    static long getMissCount();
+
+    /// @brief Reset the hit and miss counts to zero.
+    static void resetCounts();
+
+    /**
+     *  @brief Remove all entries from the calling thread's cache.
+     *
+     *  Caches belonging to other threads are not affected; each BatchRunner worker thread starts
+     *  with an empty cache, which is discarded when the thread exits.
+     */
+    static void clear();
+
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_ConvolutionCache_h_INCLUDED
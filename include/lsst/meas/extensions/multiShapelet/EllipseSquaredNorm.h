@@ -163,6 +163,16 @@ public:
         bool computeJacobian=true
     );
 
+    /**
+     *  @brief Update the ellipse from its quadrupole moments, avoiding any ellipse conversions.
+     *
+     *  The returned matrix is the derivative of the internal representation wrt (Ixx, Iyy, Ixy).
+     */
+    afw::geom::ellipses::BaseCore::Jacobian update(
+        afw::geom::ellipses::Quadrupole const & ellipse,
+        bool computeJacobian=true
+    );
+
     // @brief Construct the squared norm functor with a unit circle.
     explicit EllipseSquaredNorm() : _r11(1.0), _r12(0.0), _r22(1.0) {}
 
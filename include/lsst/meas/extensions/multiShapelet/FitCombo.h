@@ -42,6 +42,23 @@ public:
     LSST_CONTROL_FIELD(growFootprint, int, "Number of pixels to grow the footprint by.");
     LSST_CONTROL_FIELD(radiusInputFactor, double,
                        "Number of half-light radii used to determine the pixels to fit");
+    LSST_CONTROL_FIELD(psfFactorGrid, bool,
+                       "If true, compute the PSF factor once per exposure on a grid of points and"
+                       " interpolate it to each source position, instead of fitting the PSF image"
+                       " at every source.");
+    LSST_CONTROL_FIELD(psfFactorGridNx, int,
+                       "Number of PSF factor grid points in x (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(psfFactorGridNy, int,
+                       "Number of PSF factor grid points in y (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(psfFactorGridOrder, int,
+                       "Maximum total order of the Chebyshev polynomials used to interpolate the"
+                       " PSF factor grid (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(psfShapeletOrder, int,
+                       "Maximum order of the PSF model shapelet expansions used in the linear flux fit;"
+                       " negative to use the full order of the PSF model.");
+    LSST_CONTROL_FIELD(psfShapeletTolerance, double,
+                       "If positive, use the smallest PSF shapelet order (up to psfShapeletOrder) for which"
+                       " the estimated relative error from the neglected PSF terms is below this value.");
 
     PTR(FitComboControl) clone() const {
         return boost::static_pointer_cast<FitComboControl>(_clone());
@@ -56,7 +73,9 @@ public:
     FitComboControl() :
         algorithms::AlgorithmControl("multishapelet.combo", 2.6),
         componentNames(), psfName("multishapelet.psf"),
-        usePixelWeights(false), badMaskPlanes(), growFootprint(5), radiusInputFactor(4.0)
+        usePixelWeights(false), badMaskPlanes(), growFootprint(5), radiusInputFactor(4.0),
+        psfFactorGrid(false), psfFactorGridNx(5), psfFactorGridNy(5), psfFactorGridOrder(2),
+        psfShapeletOrder(-1), psfShapeletTolerance(0.0)
     {
         componentNames.push_back("multishapelet.exp");
         componentNames.push_back("multishapelet.dev");
@@ -84,6 +103,8 @@ struct FitComboModel {
     double flux; ///< total flux of model, integrated to infinity (includes PSF factor, if enabled)
     double fluxErr; ///< uncertainty on flux
     double chisq; ///< reduced chi^2
+    double psfTruncationError; ///< estimated relative flux error from truncating the PSF model
+                               ///  (see FitPsfModel::computeTruncationError)
 
     explicit FitComboModel(FitComboControl const & ctrl);
 
@@ -106,11 +127,17 @@ public:
     typedef FitComboControl Control;
     typedef FitComboModel Model;
 
-    /// @brief Construct an algorithm instance and register its fields with a Schema.
+    /**
+     *  @brief Construct an algorithm instance and register its fields with a Schema.
+     *
+     *  If the library was built with MULTISHAPELET_ENABLE_TIMERS and metadata is not null, the
+     *  time spent in each stage of the measurement is recorded there (see StageTimes).
+     */
     FitComboAlgorithm(
         FitComboControl const & ctrl,
         afw::table::Schema & schema,
-        algorithms::AlgorithmMap const & others
+        algorithms::AlgorithmMap const & others,
+        PTR(daf::base::PropertyList) const & metadata = PTR(daf::base::PropertyList)()
     );
 
     /// @brief Return the control object
@@ -133,6 +160,12 @@ public:
         afw::geom::Point2D const & center
     );
 
+    /**
+     *  @brief Fit a non-negative linear combination of the PSF-convolved component profiles.
+     *
+     *  The component ellipses are held fixed at the values in the given FitProfileModels; only
+     *  their amplitudes are fit.  Any number of components may be combined.
+     */
     static FitComboModel apply(
         FitComboControl const & ctrl,
         FitPsfModel const & psfModel,
@@ -140,6 +173,40 @@ public:
         ModelInputHandler const & inputs
     );
 
+    /**
+     *  @brief Solve a small non-negative least squares problem given its normal equations.
+     *
+     *  Returns the x >= 0 that minimizes x^T F x - 2 x^T b, using an active-set method.
+     *
+     *  @param[in]  fisher   Normal matrix F (symmetric, positive semidefinite).
+     *  @param[in]  rhs      Right-hand side b.
+     */
+    static ndarray::Array<double,1,1> solveNonNegative(
+        ndarray::Array<double const,2,2> const & fisher,
+        ndarray::Array<double const,1,1> const & rhs
+    );
+
+    /**
+     *  @brief Fit the combination to an image of the PSF, to compute the PSF factor (aperture correction).
+     *
+     *  This is the per-source reference computation for the PSF factor; when ctrl.psfFactorGrid
+     *  is true, it is only evaluated at grid points.
+     *
+     *  @param[in]     ctrl           Details of the model to fit.
+     *  @param[in]     psfModel       Localized double-shapelet PSF model.
+     *  @param[in]     psfComponents  Results of fitting each component profile to the PSF
+     *                                (see FitProfileAlgorithm::computePsfFactor).
+     *  @param[in]     psf            PSF object.
+     *  @param[in]     center         Point at which to evaluate the PSF.
+     */
+    static FitComboModel computePsfFactor(
+        FitComboControl const & ctrl,
+        FitPsfModel const & psfModel,
+        std::vector<FitProfileModel> const & psfComponents,
+        afw::detection::Psf const & psf,
+        afw::geom::Point2D const & center
+    );
+
 private:
 
     template <typename PixelT>
@@ -149,14 +216,28 @@ private:
         afw::geom::Point2D const & center
     ) const;
 
+    double _interpolatePsfFactor(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox,
+        afw::geom::Point2D const & center
+    ) const;
+
+    CONST_PTR(SpatialInterpolator) _makePsfFactorGrid(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox
+    ) const;
+
     LSST_MEAS_ALGORITHM_PRIVATE_INTERFACE(FitComboAlgorithm);
 
     afw::table::KeyTuple< afw::table::Flux > _fluxKeys;
     algorithms::ScaledFlux::KeyTuple _fluxCorrectionKeys;
     afw::table::Key< afw::table::Array<float> > _componentsKey;
     afw::table::Key< float > _chisqKey;
+    afw::table::Key< float > _psfTruncationKey; // invalid unless PSF truncation is enabled
     std::vector<CONST_PTR(FitProfileControl)> _componentCtrl;
     CONST_PTR(FitPsfControl) _psfCtrl;
+    mutable SpatialGridCache<SpatialInterpolator> _psfFactorGrid; // [psfFactor]
+    PTR(StageTimes) _stageTimes; // null unless timers are enabled
 };
 
 inline PTR(FitComboAlgorithm) FitComboControl::makeAlgorithm(
@@ -54,6 +54,33 @@ public:
     LSST_CONTROL_FIELD(growFootprint, int, "Number of pixels to grow the footprint by.");
     LSST_CONTROL_FIELD(radiusInputFactor, double,
                        "Number of half-light radii used to determine the pixels to fit");
+    LSST_CONTROL_FIELD(psfFactorGrid, bool,
+                       "If true, compute the PSF factor once per exposure on a grid of points and"
+                       " interpolate it to each source position, instead of fitting the PSF image"
+                       " at every source.");
+    LSST_CONTROL_FIELD(psfFactorGridNx, int,
+                       "Number of PSF factor grid points in x (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(psfFactorGridNy, int,
+                       "Number of PSF factor grid points in y (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(psfFactorGridOrder, int,
+                       "Maximum total order of the Chebyshev polynomials used to interpolate the"
+                       " PSF factor grid (used only if psfFactorGrid is true).");
+    LSST_CONTROL_FIELD(analyticPsfFactor, bool,
+                       "If true, compute the PSF factor by fitting the profile directly to the FitPsfModel"
+                       " using closed-form inner products, instead of fitting an image of the PSF.");
+    LSST_CONTROL_FIELD(psfShapeletOrder, int,
+                       "Maximum order of the PSF model shapelet expansions used in the linear flux fit;"
+                       " negative to use the full order of the PSF model.");
+    LSST_CONTROL_FIELD(psfShapeletTolerance, double,
+                       "If positive, use the smallest PSF shapelet order (up to psfShapeletOrder) for which"
+                       " the estimated relative error from the neglected PSF terms is below this value.");
+    LSST_CONTROL_FIELD(componentTolerance, double,
+                       "If positive, merge or drop convolved profile components in the nonlinear fit when"
+                       " that changes the model by less than this fraction of its L2 norm.");
+    LSST_CONTROL_FIELD(maxComponents, int,
+                       "If positive, merge the profile components convolved with the PSF components in the"
+                       " nonlinear fit (preserving flux and second moments) until at most this many remain"
+                       " (or the change reaches componentTolerance, if that is positive).");
 
     PTR(FitProfileControl) clone() const {
         return boost::static_pointer_cast<FitProfileControl>(_clone());
@@ -73,7 +100,10 @@ public:
         minRadius(0.0001), minAxisRatio(0.0001),
         deconvolveShape(true), minInitialRadius(0.5),
         usePixelWeights(false), badMaskPlanes(), maxBadPixelFraction(0.1),
-        growFootprint(5), radiusInputFactor(4.0)
+        growFootprint(5), radiusInputFactor(4.0),
+        psfFactorGrid(false), psfFactorGridNx(5), psfFactorGridNy(5), psfFactorGridOrder(2),
+        analyticPsfFactor(false), psfShapeletOrder(-1), psfShapeletTolerance(0.0),
+        componentTolerance(0.0), maxComponents(0)
     {
         badMaskPlanes.push_back("BAD");
         badMaskPlanes.push_back("SAT");
@@ -105,6 +135,10 @@ struct FitProfileModel {
     double fluxErr; ///< uncertainty on flux
     afw::geom::ellipses::Quadrupole ellipse; ///< half-light radius ellipse
     double chisq; ///< reduced chi^2
+    double psfTruncationError; ///< estimated relative flux error from truncating the PSF model
+                               ///  in the linear fit (see FitPsfModel::computeTruncationError)
+    int builderCount; ///< number of convolved components in the nonlinear fit's model at the end of the fit
+    int evaluationCount; ///< total number of per-pixel component evaluations in the nonlinear fit
     bool fluxFlag; ///< set to true if the flux should not be trusted
     bool flagMaxIter; ///< set to true if the optimizer hit the maximum number of iterations
     bool flagTinyStep; ///< set to true if the optimizer step size got too small to make progress
@@ -151,11 +185,17 @@ public:
     typedef FitProfileControl Control;
     typedef FitProfileModel Model;
 
-    /// @brief Construct an algorithm instance and register its fields with a Schema.
+    /**
+     *  @brief Construct an algorithm instance and register its fields with a Schema.
+     *
+     *  If the library was built with MULTISHAPELET_ENABLE_TIMERS and metadata is not null, the
+     *  time spent in each stage of the measurement is recorded there (see StageTimes).
+     */
     FitProfileAlgorithm(
         FitProfileControl const & ctrl,
         afw::table::Schema & schema,
-        algorithms::AlgorithmMap const & others
+        algorithms::AlgorithmMap const & others,
+        PTR(daf::base::PropertyList) const & metadata = PTR(daf::base::PropertyList)()
     );
 
     /// @brief Return the control object
@@ -221,6 +261,22 @@ public:
         FitProfileModel & model
     );
 
+    /**
+     *  @brief Predict the relative cost of apply(), without fitting.
+     *
+     *  The nonlinear fit evaluates every profile component convolved with every PSF Gaussian
+     *  (or at most ctrl.maxComponents of them) on every pixel, at each iteration, so we predict
+     *  a cost proportional to the number of pixels times the number of convolved components.
+     *  The result is in arbitrary units; it is meant for ordering work (see FitProfileBatch)
+     *  and can be calibrated against the times FitProfileBatch measures.
+     *
+     *  @param[in]     ctrl           Details of the model to fit.
+     *  @param[in]     psfModel       Localized double-shapelet PSF model.
+     *  @param[in]     pixelCount     Number of pixels to be fit (ModelInputHandler::getSize(),
+     *                                i.e. after growing and merging the footprint).
+     */
+    static double predictCost(FitProfileControl const & ctrl, FitPsfModel const & psfModel, int pixelCount);
+
     /**
      *  @brief Fit the model, using an existing ModelInputHandler as the data.
      *
@@ -237,6 +293,42 @@ public:
         ModelInputHandler const & inputs
     );
 
+    /**
+     *  @brief Fit the model to an image of the PSF, to compute the PSF factor (aperture correction).
+     *
+     *  This renders the PSF at the given point and fits it using apply(), starting from the PSF
+     *  model ellipse scaled by ctrl.minInitialRadius, or calls computeAnalyticPsfFactor() if
+     *  ctrl.analyticPsfFactor is true.  It is the per-source reference computation for the PSF
+     *  factor; when ctrl.psfFactorGrid is true, it is only evaluated at grid points.
+     *
+     *  @param[in]     ctrl           Details of the model to fit.
+     *  @param[in]     psfModel       Localized double-shapelet PSF model.
+     *  @param[in]     psf            PSF object.
+     *  @param[in]     center         Point at which to evaluate the PSF.
+     */
+    static FitProfileModel computePsfFactor(
+        FitProfileControl const & ctrl,
+        FitPsfModel const & psfModel,
+        afw::detection::Psf const & psf,
+        afw::geom::Point2D const & center
+    );
+
+    /**
+     *  @brief Fit the model directly to a FitPsfModel, to compute the PSF factor without pixels.
+     *
+     *  The ellipse is fit using a PsfModelObjective (the profile convolved with the Gaussian terms
+     *  of the PSF model), and the amplitude is then fit using the full shapelet PSF model, as in
+     *  fitShapeletTerms().  All integrals are computed in closed form, so the cost does not depend
+     *  on the size of the PSF image.  The returned model's chisq is NaN.
+     *
+     *  @param[in]     ctrl           Details of the model to fit.
+     *  @param[in]     psfModel       Localized double-shapelet PSF model, used as the data.
+     */
+    static FitProfileModel computeAnalyticPsfFactor(
+        FitProfileControl const & ctrl,
+        FitPsfModel const & psfModel
+    );
+
 private:
 
     template <typename PixelT>
@@ -246,6 +338,17 @@ private:
         afw::geom::Point2D const & center
     ) const;
 
+    FitProfileModel _interpolatePsfFactor(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox,
+        afw::geom::Point2D const & center
+    ) const;
+
+    CONST_PTR(SpatialInterpolator) _makePsfFactorGrid(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox
+    ) const;
+
     LSST_MEAS_ALGORITHM_PRIVATE_INTERFACE(FitProfileAlgorithm);
 
     afw::table::KeyTuple< afw::table::Flux > _fluxKeys;
@@ -258,7 +361,12 @@ private:
     afw::table::Key< afw::table::Flag > _flagMinRadiusKey;
     afw::table::Key< afw::table::Flag > _flagMinAxisRatioKey;
     afw::table::Key< afw::table::Flag > _flagLargeAreaKey;
+    afw::table::Key< float > _psfTruncationKey; // invalid unless PSF truncation is enabled
+    afw::table::Key< int > _builderCountKey; // invalid unless component pruning is enabled
+    afw::table::Key< int > _evaluationCountKey; // invalid unless component pruning is enabled
     CONST_PTR(FitPsfControl) _psfCtrl;
+    mutable SpatialGridCache<SpatialInterpolator> _psfFactorGrid; // [psfFactor, e1, e2, ln(r)]
+    PTR(StageTimes) _stageTimes; // null unless timers are enabled
 };
 
 inline PTR(FitProfileAlgorithm) FitProfileControl::makeAlgorithm(
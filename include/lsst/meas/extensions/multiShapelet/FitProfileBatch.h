@@ -0,0 +1,116 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#ifndef MULTISHAPELET_FitProfileBatch_h_INCLUDED
+#define MULTISHAPELET_FitProfileBatch_h_INCLUDED
+
+#include <vector>
+
+#include "lsst/meas/extensions/multiShapelet/FitProfile.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfBatch.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Columnar results of a batch of galaxy profile fits (see FitProfileBatch).
+ *
+ *  Row n of each array corresponds to the nth input.  Rows for which the PSF model had failed
+ *  or the fit threw an exception have FAILED_PSF or FAILED_EXCEPTION set and NaN values.
+ */
+struct FitProfileBatchResults {
+
+    enum FlagBit {
+        FLUX_FLAG = 0x01,            ///< FitProfileModel::fluxFlag
+        FAILED_MAXITER = 0x02,       ///< FitProfileModel::flagMaxIter
+        FAILED_TINYSTEP = 0x04,      ///< FitProfileModel::flagTinyStep
+        FAILED_MINRADIUS = 0x08,     ///< FitProfileModel::flagMinRadius
+        FAILED_MINAXISRATIO = 0x10,  ///< FitProfileModel::flagMinAxisRatio
+        FAILED_LARGEAREA = 0x20,     ///< FitProfileModel::flagLargeArea
+        FAILED_PSF = 0x40,           ///< the PSF model had failed, so no fit was attempted
+        FAILED_EXCEPTION = 0x80      ///< the fit threw an exception
+    };
+
+    ndarray::Array<double,2,2> ellipse;   ///< (Ixx, Iyy, Ixy) of the best-fit ellipse
+    ndarray::Array<double,1,1> flux;      ///< flux of the best-fit model
+    ndarray::Array<double,1,1> fluxErr;   ///< uncertainty on the flux
+    ndarray::Array<double,1,1> chisq;     ///< reduced chi^2
+    ndarray::Array<int,1,1> flags;        ///< bitwise OR of FlagBit values
+    ndarray::Array<double,1,1> predictedCost; ///< FitProfileAlgorithm::predictCost (arbitrary units)
+    ndarray::Array<double,1,1> time;      ///< wall-clock time spent on each fit, in seconds
+
+    /// @brief Return the number of rows.
+    int getSize() const { return chisq.getSize<0>(); }
+
+    /// @brief Set the nth row from a FitProfileModel; safe to call concurrently for distinct rows
+    ///        (see BatchRunner).
+    void setModel(int n, FitProfileModel const & model);
+
+    /// @brief Set the nth row to NaN with the given flags; safe to call concurrently for distinct rows
+    ///        (see BatchRunner).
+    void setFailed(int n, int flagBits=FAILED_EXCEPTION);
+
+    /// @brief Allocate arrays for the given number of rows.
+    explicit FitProfileBatchResults(int size);
+};
+
+/**
+ *  @brief Fit galaxy profiles to many sources in parallel.
+ *
+ *  Each fit is exactly FitProfileAlgorithm::apply(ctrl, psfModel, ellipse, inputs).  The cost
+ *  of a fit varies by orders of magnitude with the number of pixels (after growing and merging
+ *  the footprint) and the number of profile components, so the fits are distributed over a
+ *  pool of threads in order of decreasing FitProfileAlgorithm::predictCost; a large galaxy
+ *  started last would otherwise leave the other threads idle.  The predicted cost and the
+ *  measured time of each fit are returned with the results, so the predictor can be checked.
+ *  When called from Python, the GIL is released for the whole batch, so other Python threads
+ *  must not use the arguments until it returns.
+ */
+class FitProfileBatch {
+public:
+
+    /**
+     *  @brief Fit a list of prepared inputs.
+     *
+     *  @param[in] ctrl       Details of the model to fit.
+     *  @param[in] psfCtrl    Details of the PSF model (used to reassemble the PSF models).
+     *  @param[in] psfModels  PSF models at each source, e.g. from FitPsfBatch.
+     *  @param[in] ellipses   Initial (Ixx, Iyy, Ixy) for each source, e.g. adaptive moments
+     *                        as modified by FitProfileAlgorithm::adjustInputs.
+     *  @param[in] inputs     Inputs that determine the data to be fit, one per fit, as
+     *                        returned by FitProfileAlgorithm::adjustInputs.
+     *  @param[in] nThreads   Number of threads; <= 0 uses the number of hardware threads.
+     */
+    static FitProfileBatchResults apply(
+        FitProfileControl const & ctrl,
+        FitPsfControl const & psfCtrl,
+        FitPsfBatchResults const & psfModels,
+        ndarray::Array<double const,2,2> const & ellipses,
+        std::vector<ModelInputHandler> const & inputs,
+        int nThreads=0
+    );
+
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_FitProfileBatch_h_INCLUDED
@@ -31,11 +31,15 @@
 #include "lsst/meas/extensions/multiShapelet/MultiGaussian.h"
 #include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
 #include "lsst/meas/extensions/multiShapelet/HybridOptimizer.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+#include "lsst/meas/extensions/multiShapelet/StageTimer.h"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
 class FitPsfAlgorithm;
 
+class FitPsfGrid;
+
 class MultiGaussianObjective;
 
 class FitPsfControl : public algorithms::AlgorithmControl {
@@ -52,6 +56,23 @@ public:
                        " when shapelets coefficients are fit and ellipses are held fixed."
     );
     LSST_CONTROL_FIELD(initialRadius, double, "Initial radius of inner component in pixels");
+    LSST_CONTROL_FIELD(useGrid, bool,
+                       "If true, fit the PSF once per exposure on a grid of points and interpolate the"
+                       " model to each source position, instead of fitting the PSF at every source.");
+    LSST_CONTROL_FIELD(gridNx, int, "Number of grid points in x (used only if useGrid is true).");
+    LSST_CONTROL_FIELD(gridNy, int, "Number of grid points in y (used only if useGrid is true).");
+    LSST_CONTROL_FIELD(gridOrder, int,
+                       "Maximum total order of the Chebyshev polynomials used to interpolate"
+                       " the grid (used only if useGrid is true).");
+    LSST_CONTROL_FIELD(cacheDir, std::string,
+                       "Directory for persistent PSF grid cache files, keyed by exposure, PSF, and"
+                       " configuration; empty to disable the cache (used only if useGrid is true).");
+    LSST_CONTROL_FIELD(cacheMetadataKeys, std::vector<std::string>,
+                       "Exposure metadata entries included in the PSF grid cache key, in addition to"
+                       " the bounding box and PSF; missing entries are ignored.");
+    LSST_CONTROL_FIELD(useNormalEquations, bool,
+                       "If true, solve for the shapelet coefficients by accumulating the normal equations"
+                       " over blocks of pixels, instead of building the full design matrix.");
 
     PTR(FitPsfControl) clone() const { return boost::static_pointer_cast<FitPsfControl>(_clone()); }
 
@@ -66,7 +87,9 @@ public:
     FitPsfControl() :
         algorithms::AlgorithmControl("multishapelet.psf", 2.0),
         innerOrder(2), outerOrder(2), minRadius(0.1), minAxisRatio(0.1),
-        radiusRatio(2.0), peakRatio(0.1), initialRadius(1.5)
+        radiusRatio(2.0), peakRatio(0.1), initialRadius(1.5),
+        useGrid(false), gridNx(7), gridNy(7), gridOrder(4), cacheDir(), cacheMetadataKeys(),
+        useNormalEquations(false)
     {}
 
 private:
@@ -118,6 +141,20 @@ struct FitPsfModel {
         ndarray::Array<double const,1,1> const & parameters
     );
 
+    /**
+     *  @brief Construct a model from ellipse parameters and shapelet coefficients.
+     *
+     *  The 3-element parameter vector is [e1, e2, ln(r)], as defined by
+     *  MultiGaussianObjective::EllipseCore.  This is used by FitPsfGrid to assemble
+     *  interpolated models; the coefficients are copied.
+     */
+    FitPsfModel(
+        FitPsfControl const & ctrl,
+        ndarray::Array<double const,1,1> const & parameters,
+        ndarray::Array<double const,1,1> const & inner,
+        ndarray::Array<double const,1,1> const & outer
+    );
+
     /// @brief Construct by extracting saved values from a Record.
     FitPsfModel(FitPsfControl const & ctrl, afw::table::BaseRecord const & source);
 
@@ -138,6 +175,43 @@ struct FitPsfModel {
         afw::geom::Point2D const & center = afw::geom::Point2D()
     ) const;
 
+    /// @brief Return the larger of the inner and outer shapelet orders.
+    int getOrder() const;
+
+    /**
+     *  @brief Return a copy with the inner and outer expansions truncated to at most the given order.
+     *
+     *  Expansions with order already less than or equal to the given order are unchanged.
+     */
+    FitPsfModel truncate(int order) const;
+
+    /**
+     *  @brief Estimate the error made by truncating the model to the given order.
+     *
+     *  This is the L2 norm of the neglected terms divided by the L2 norm of the full model, computed
+     *  in closed form.  Because the linear flux fits scale the PSF-convolved profile, it is an
+     *  approximate bound on the relative flux error due to the truncation.
+     */
+    double computeTruncationError(int order) const;
+
+    /**
+     *  @brief Choose the order to truncate the model to.
+     *
+     *  @param[in] maxOrder   Maximum order to use; if negative, getOrder() is used.
+     *  @param[in] tolerance  If positive, return the smallest order <= maxOrder for which
+     *                        computeTruncationError() is less than or equal to the tolerance.
+     *                        Otherwise maxOrder is returned (clipped to getOrder()).
+     *
+     *  The errors for successive orders are computed in a single pass, so this is no more expensive
+     *  than one call to computeTruncationError() for the returned order.
+     */
+    int selectTruncationOrder(int maxOrder, double tolerance) const;
+
+#ifndef SWIG
+    /// @brief Choose the order to truncate the model to, and set error to computeTruncationError(order).
+    int selectTruncationOrder(int maxOrder, double tolerance, double & error) const;
+#endif
+
 };
 
 class FitPsfAlgorithm : public algorithms::Algorithm {
@@ -146,8 +220,17 @@ public:
     typedef FitPsfControl Control;
     typedef FitPsfModel Model;
 
-    /// @brief Construct an algorithm instance and register its fields with a Schema.
-    FitPsfAlgorithm(FitPsfControl const & ctrl, afw::table::Schema & schema);
+    /**
+     *  @brief Construct an algorithm instance and register its fields with a Schema.
+     *
+     *  If the library was built with MULTISHAPELET_ENABLE_TIMERS and metadata is not null, the
+     *  time spent in each stage of the measurement is recorded there (see StageTimes).
+     */
+    FitPsfAlgorithm(
+        FitPsfControl const & ctrl,
+        afw::table::Schema & schema,
+        PTR(daf::base::PropertyList) const & metadata = PTR(daf::base::PropertyList)()
+    );
 
     /// @brief Return the control object
     FitPsfControl const & getControl() const {
@@ -237,6 +320,14 @@ private:
         afw::geom::Point2D const & center
     ) const;
 
+    void _save(afw::table::BaseRecord & record, FitPsfModel const & model) const;
+
+    CONST_PTR(FitPsfGrid) _makeGrid(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox,
+        CONST_PTR(daf::base::PropertySet) const & metadata
+    ) const;
+
     LSST_MEAS_ALGORITHM_PRIVATE_INTERFACE(FitPsfAlgorithm);
 
     afw::table::Key< afw::table::Array<float> > _innerKey;
@@ -249,6 +340,8 @@ private:
     afw::table::Key< afw::table::Flag > _flagTinyStepKey;
     afw::table::Key< afw::table::Flag > _flagMinRadiusKey;
     afw::table::Key< afw::table::Flag > _flagMinAxisRatioKey;
+    mutable SpatialGridCache<FitPsfGrid> _grid;
+    PTR(StageTimes) _stageTimes; // null unless timers are enabled
 };
 
 inline PTR(FitPsfAlgorithm) FitPsfControl::makeAlgorithm(
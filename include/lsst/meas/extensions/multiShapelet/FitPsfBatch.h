@@ -0,0 +1,122 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_FitPsfBatch_h_INCLUDED
+#define MULTISHAPELET_FitPsfBatch_h_INCLUDED
+
+#include <vector>
+
+#include "lsst/afw/image/Exposure.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Columnar results of a batch of PSF fits (see FitPsfBatch).
+ *
+ *  Row n of each array corresponds to the nth input.  Rows for which the fit threw an
+ *  exception have the FAILED_EXCEPTION flag set and NaN values.
+ */
+struct FitPsfBatchResults {
+
+    enum FlagBit {
+        FAILED_MAXITER = 0x01,       ///< FitPsfModel::failedMaxIter
+        FAILED_TINYSTEP = 0x02,      ///< FitPsfModel::failedTinyStep
+        FAILED_MINRADIUS = 0x04,     ///< FitPsfModel::failedMinRadius
+        FAILED_MINAXISRATIO = 0x08,  ///< FitPsfModel::failedMinAxisRatio
+        FAILED_EXCEPTION = 0x10      ///< the fit threw an exception
+    };
+
+    ndarray::Array<double,2,2> ellipse; ///< (Ixx, Iyy, Ixy) of the inner expansion ellipse
+    ndarray::Array<double,2,2> inner;   ///< shapelet coefficients of inner expansion
+    ndarray::Array<double,2,2> outer;   ///< shapelet coefficients of outer expansion
+    ndarray::Array<double,1,1> chisq;   ///< reduced chi^2
+    ndarray::Array<int,1,1> flags;      ///< bitwise OR of FlagBit values
+
+    /// @brief Return the number of rows.
+    int getSize() const { return chisq.getSize<0>(); }
+
+    /// @brief Reassemble the nth row as a FitPsfModel.
+    FitPsfModel getModel(FitPsfControl const & ctrl, int n) const;
+
+    /// @brief Set the nth row from a FitPsfModel; safe to call concurrently for distinct rows
+    ///        (see BatchRunner).
+    void setModel(int n, FitPsfModel const & model);
+
+    /// @brief Set the nth row to NaN with FAILED_EXCEPTION; safe to call concurrently for distinct rows
+    ///        (see BatchRunner).
+    void setFailed(int n);
+
+    /// @brief Allocate arrays for the given number of rows.
+    FitPsfBatchResults(FitPsfControl const & ctrl, int size);
+};
+
+/**
+ *  @brief Fit many PSF or star images in parallel.
+ *
+ *  Each fit is exactly FitPsfAlgorithm::apply(ctrl, inputs); the fits are distributed over a
+ *  pool of threads with BatchRunner.  When called from Python, the GIL is released for the
+ *  whole batch, so other Python threads must not use the arguments until it returns.
+ */
+class FitPsfBatch {
+public:
+
+    /**
+     *  @brief Fit a list of prepared inputs.
+     *
+     *  @param[in] ctrl       Details of the model to fit.
+     *  @param[in] inputs     Inputs that determine the data to be fit, one per fit.
+     *  @param[in] nThreads   Number of threads; <= 0 uses the number of hardware threads.
+     */
+    static FitPsfBatchResults apply(
+        FitPsfControl const & ctrl,
+        std::vector<ModelInputHandler> const & inputs,
+        int nThreads=0
+    );
+
+    /**
+     *  @brief Fit stars in an exposure.
+     *
+     *  Each star is fit on a box with the dimensions of the exposure's PSF kernel, centered on
+     *  the pixel containing the given center.  Pixels with any of the given mask bits set are
+     *  ignored.  Inputs are constructed in the calling thread before the fits are dispatched.
+     *
+     *  @param[in] ctrl          Details of the model to fit.
+     *  @param[in] exposure      Exposure containing the stars; must have a PSF.
+     *  @param[in] centers       Star centers, in the exposure's parent coordinates.
+     *  @param[in] badPixelMask  Bitmask of mask planes that indicate pixels to ignore.
+     *  @param[in] nThreads      Number of threads; <= 0 uses the number of hardware threads.
+     */
+    template <typename PixelT>
+    static FitPsfBatchResults apply(
+        FitPsfControl const & ctrl,
+        afw::image::Exposure<PixelT> const & exposure,
+        std::vector<afw::geom::Point2D> const & centers,
+        afw::image::MaskPixel badPixelMask=0x0,
+        int nThreads=0
+    );
+
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_FitPsfBatch_h_INCLUDED
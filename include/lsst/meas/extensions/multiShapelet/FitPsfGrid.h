@@ -0,0 +1,154 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_FitPsfGrid_h_INCLUDED
+#define MULTISHAPELET_FitPsfGrid_h_INCLUDED
+
+#include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Summary of the differences between interpolated and directly-fit PSF models.
+ *
+ *  Ellipse differences are computed in the (e1, e2, ln r) parametrization used by
+ *  MultiGaussianObjective; coefficient differences are divided by the zeroth-order
+ *  coefficient of the directly-fit inner expansion.
+ */
+struct FitPsfGridResidual {
+    int count;               ///< number of points at which direct fits succeeded and were compared
+    double maxEllipse;       ///< maximum absolute difference in an ellipse parameter
+    double rmsEllipse;       ///< RMS difference in the ellipse parameters
+    double maxCoefficient;   ///< maximum absolute relative difference in a shapelet coefficient
+    double rmsCoefficient;   ///< RMS relative difference in the shapelet coefficients
+
+    FitPsfGridResidual() :
+        count(0), maxEllipse(0.0), rmsEllipse(0.0), maxCoefficient(0.0), rmsCoefficient(0.0) {}
+};
+
+/**
+ *  @brief A FitPsfModel fit on a grid of points and interpolated to arbitrary positions.
+ *
+ *  The ellipse parameters and the inner and outer shapelet coefficients of models fit
+ *  with FitPsfAlgorithm::apply at the grid points are each interpolated with 2-d
+ *  Chebyshev polynomials (see SpatialInterpolator).  Grid points at which the fit
+ *  failed are not used.
+ *
+ *  Interpolated models have a NaN chi^2, and none of their failure flags are set.
+ */
+class FitPsfGrid {
+public:
+
+    /**
+     *  @brief Fit the PSF at a grid of points and construct the interpolator.
+     *
+     *  @param[in] ctrl     Control object; the grid is defined by the gridNx, gridNy, and
+     *                      gridOrder fields.
+     *  @param[in] psf      PSF to fit.
+     *  @param[in] bbox     Region over which models will be interpolated.
+     */
+    FitPsfGrid(FitPsfControl const & ctrl, afw::detection::Psf const & psf, afw::geom::Box2D const & bbox);
+
+    /**
+     *  @brief Construct the interpolator from models previously fit at a set of points.
+     *
+     *  This is used to restore a grid from a FitPsfGridCache without refitting.
+     *
+     *  @param[in] ctrl          Control object used to fit the models.
+     *  @param[in] bbox          Region over which models will be interpolated.
+     *  @param[in] points        Points at which the models were successfully fit.
+     *  @param[in] values        Model vectors with shape (points.size(), getValueSize(ctrl)).
+     *  @param[in] failureCount  Number of grid points at which the fit failed.
+     */
+    FitPsfGrid(
+        FitPsfControl const & ctrl,
+        afw::geom::Box2D const & bbox,
+        std::vector<afw::geom::Point2D> const & points,
+        ndarray::Array<double const,2,2> const & values,
+        int failureCount
+    );
+
+    /// @brief Return the interpolated model at the given point.
+    FitPsfModel evaluate(afw::geom::Point2D const & point) const;
+
+    /**
+     *  @brief Write the interpolated model vector at the given point to an array.
+     *
+     *  The vector has getValueSize(getControl()) elements, laid out like the rows of getValues().
+     */
+    void evaluate(afw::geom::Point2D const & point, ndarray::Array<double,1,1> const & vector) const {
+        _interpolator.evaluate(point, vector);
+    }
+
+    /// @brief Return the region over which models are interpolated.
+    afw::geom::Box2D const & getBBox() const { return _interpolator.getBBox(); }
+
+    /// @brief Return the number of grid points at which the direct fit failed (and was not used).
+    int getFailureCount() const { return _failureCount; }
+
+    /// @brief Return the control object used to construct the grid.
+    FitPsfControl const & getControl() const { return _ctrl; }
+
+    /// @brief Return the points at which models were successfully fit.
+    std::vector<afw::geom::Point2D> const & getPoints() const { return _points; }
+
+    /**
+     *  @brief Return the models fit at getPoints(), with shape (points, getValueSize(ctrl)).
+     *
+     *  Each row is [e1, e2, ln(r), inner..., outer...], with the ellipse parameters as
+     *  defined by MultiGaussianObjective::EllipseCore.
+     */
+    ndarray::Array<double const,2,2> getValues() const { return _values; }
+
+    /// @brief Return the number of elements in each row of getValues().
+    static int getValueSize(FitPsfControl const & ctrl) {
+        return 3 + shapelet::computeSize(ctrl.innerOrder) + shapelet::computeSize(ctrl.outerOrder);
+    }
+
+    /**
+     *  @brief Compare interpolated models to direct fits at a set of test points.
+     *
+     *  The test points are a regular nx by ny grid over the bounding box, offset by a quarter
+     *  of the grid spacing so they generally do not coincide with the fit points.
+     */
+    FitPsfGridResidual computeResidual(afw::detection::Psf const & psf, int nx=5, int ny=5) const;
+
+private:
+
+    static ndarray::Array<double,2,2> _fitGrid(
+        FitPsfControl const & ctrl, afw::detection::Psf const & psf, afw::geom::Box2D const & bbox,
+        std::vector<afw::geom::Point2D> & points, int & failureCount
+    );
+
+    static void _writeVector(FitPsfModel const & model, ndarray::Array<double,1,1> const & vector);
+
+    FitPsfControl _ctrl;
+    int _failureCount;
+    std::vector<afw::geom::Point2D> _points;
+    ndarray::Array<double const,2,2> _values;
+    SpatialInterpolator _interpolator;
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_FitPsfGrid_h_INCLUDED
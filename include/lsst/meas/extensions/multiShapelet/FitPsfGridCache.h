@@ -0,0 +1,127 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_FitPsfGridCache_h_INCLUDED
+#define MULTISHAPELET_FitPsfGridCache_h_INCLUDED
+
+#include <string>
+
+#include "boost/cstdint.hpp"
+
+#include "lsst/daf/base/PropertySet.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGrid.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief A persistent, on-disk cache of FitPsfGrid objects.
+ *
+ *  Each grid is saved to its own small binary file in the cache directory, containing the
+ *  models fit at the grid points (see FitPsfGrid::getValues), so a grid can be restored by
+ *  memory-mapping the file and re-fitting only the (cheap) interpolating polynomials.
+ *
+ *  Files are keyed by three 64-bit hashes:
+ *   - the exposure: its bounding box and the metadata entries named by
+ *     FitPsfControl::cacheMetadataKeys;
+ *   - the PSF: images of the PSF evaluated at the center and corners of the bounding box;
+ *   - the FitPsfControl fields that affect the fit.
+ *  Computing a key thus renders five PSF images, however many grid points there are.
+ *  The file name is derived from the key, and the key, the file format version, the array
+ *  sizes, the bounding box, and a checksum of the data are all stored in the file and checked
+ *  on load.  Any mismatch or I/O problem is treated as a cache miss, so the worst outcome of
+ *  a stale or corrupt file is that the grid is refit (and the file rewritten).
+ *
+ *  Files are written in native byte order; a file written on a machine with different byte
+ *  order will fail validation and be refit.
+ */
+class FitPsfGridCache {
+public:
+
+    /// @brief Identifies a cached grid.
+    struct Key {
+        boost::uint64_t exposure; ///< hash of the exposure bounding box and selected metadata
+        boost::uint64_t psf;      ///< hash of the PSF images at the center and corners
+        boost::uint64_t control;  ///< hash of the FitPsfControl fields that affect the fit
+
+        bool operator==(Key const & other) const {
+            return exposure == other.exposure && psf == other.psf && control == other.control;
+        }
+        bool operator!=(Key const & other) const { return !(*this == other); }
+
+        Key() : exposure(0), psf(0), control(0) {}
+    };
+
+    /**
+     *  @brief Compute the key for a grid.
+     *
+     *  @param[in] ctrl      Control object that would be used to fit the grid.
+     *  @param[in] psf       PSF to be fit.
+     *  @param[in] bbox      Region over which models will be interpolated.
+     *  @param[in] metadata  Exposure metadata; only the entries named by ctrl.cacheMetadataKeys
+     *                       are used.  May be null, in which case only the bounding box and
+     *                       PSF identify the exposure.
+     */
+    static Key makeKey(
+        FitPsfControl const & ctrl,
+        afw::detection::Psf const & psf,
+        afw::geom::Box2D const & bbox,
+        CONST_PTR(daf::base::PropertySet) const & metadata
+    );
+
+    /// @brief Return a hash of the FitPsfControl fields that affect the fit.
+    static boost::uint64_t hashControl(FitPsfControl const & ctrl);
+
+    /// @brief Return the name of the file (within getDirectory()) used to hold the given key.
+    std::string getFileName(Key const & key) const;
+
+    /// @brief Return the cache directory.
+    std::string const & getDirectory() const { return _directory; }
+
+    /**
+     *  @brief Load a grid from the cache.
+     *
+     *  Returns an empty pointer if there is no file for the key, or if the file cannot be
+     *  read or does not match the key, control object, and bounding box.
+     */
+    CONST_PTR(FitPsfGrid) read(
+        Key const & key,
+        FitPsfControl const & ctrl,
+        afw::geom::Box2D const & bbox
+    ) const;
+
+    /**
+     *  @brief Save a grid to the cache.
+     *
+     *  The file is written to a temporary name and then renamed, so concurrent readers
+     *  never see a partially-written file.  Throws pex::exceptions::IoError on failure.
+     */
+    void write(Key const & key, FitPsfGrid const & grid) const;
+
+    explicit FitPsfGridCache(std::string const & directory);
+
+private:
+    std::string _directory;
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_FitPsfGridCache_h_INCLUDED
@@ -50,6 +50,15 @@ public:
 
     void update(afw::geom::ellipses::BaseCore const & ellipse);
 
+    /**
+     *  @brief Update the model from the moments of the (unscaled, unconvolved) ellipse.
+     *
+     *  The jacobian argument is the derivative of the moments with respect to the parameters
+     *  we'll compute derivatives with respect to.  This lets several builders that share an
+     *  ellipse convert it to moments once, instead of each doing the conversion in update().
+     */
+    void update(afw::geom::ellipses::Quadrupole const & ellipse, Eigen::Matrix3d const & jacobian);
+
     ndarray::Array<double const,1,1> getModel() const { return _model; }
 
     void computeDerivative(
@@ -63,7 +72,7 @@ private:
     
     double _flux;
     double _psfAmplitude;
-    afw::geom::LinearTransform _scaling;
+    double _radius;
     afw::geom::ellipses::Quadrupole _psfEllipse;
     EllipseSquaredNorm _esn;
     Eigen::Matrix3d _esnJacobian;
@@ -0,0 +1,80 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_MixtureKernel_h_INCLUDED
+#define MULTISHAPELET_MixtureKernel_h_INCLUDED
+
+#include "ndarray.h"
+#include "lsst/base.h"
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/meas/extensions/multiShapelet/MultiGaussian.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Fused evaluation of a multi-Gaussian profile convolved with a multi-Gaussian PSF.
+ *
+ *  Instead of making one pass over the pixels for each convolved component (as separate
+ *  GaussianModelBuilders would), a MixtureKernel evaluates all of them in a single pass.
+ *  Implementations are templated on the number of profile components, so the compiler can unroll
+ *  the inner loop and keep the per-component constants in registers; make() returns an empty pointer
+ *  when there is no implementation for the profile's component count, in which case callers should
+ *  fall back to GaussianModelBuilder.
+ */
+class MixtureKernel {
+public:
+
+    /// @brief Return a kernel specialized for the size of the given profile, or an empty pointer.
+    static PTR(MixtureKernel) make(
+        ndarray::Array<double const,1,1> const & x,
+        ndarray::Array<double const,1,1> const & y,
+        MultiGaussian const & multiGaussian,
+        MultiGaussian const & psfMultiGaussian,
+        afw::geom::ellipses::Quadrupole const & psfEllipse
+    );
+
+    /**
+     *  @brief Update the per-component constants from the moments of the (unscaled, unconvolved)
+     *         ellipse and their derivatives with respect to the parameters.
+     */
+    virtual void update(
+        afw::geom::ellipses::Quadrupole const & ellipse,
+        Eigen::Matrix3d const & jacobian
+    ) = 0;
+
+    /// @brief Evaluate the model at every pixel, overwriting the given array.
+    virtual void computeModel(ndarray::Array<double,1,1> const & model) const = 0;
+
+    /**
+     *  @brief Add the derivative of the model with respect to the parameters to the given array.
+     *
+     *  This reuses the per-component values saved by computeModel(), which must have been called
+     *  since the last call to update().
+     */
+    virtual void computeDerivative(ndarray::Array<double,2,-2> const & derivative) const = 0;
+
+    virtual ~MixtureKernel() {}
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_MixtureKernel_h_INCLUDED
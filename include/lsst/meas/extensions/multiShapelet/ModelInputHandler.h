@@ -52,6 +52,23 @@ public:
     /// @brief Return the footprint actually used to flatten the inputs.
     PTR(afw::detection::Footprint) getFootprint() const { return _footprint; }
 
+    /**
+     *  @brief If the pixels are a complete box in row-major order, return its dimensions;
+     *         otherwise return (0, 0).
+     *
+     *  This is true for inputs constructed from an Image and a box that lies entirely
+     *  within it, such as PSF images; it allows BoxGridCache to be used.
+     */
+    afw::geom::Extent2I getBoxDimensions() const { return _boxDimensions; }
+
+    /**
+     *  @brief Position of the center relative to the first pixel of the box (see getBoxDimensions()).
+     *
+     *  BoxGridCache keys builders on the box dimensions alone; the centered coordinates returned
+     *  by getX() and getY() depend on the sub-pixel center and are always computed per input.
+     */
+    afw::geom::Point2D getBoxCenter() const { return _boxCenter; }
+
     template <typename PixelT>
     ModelInputHandler(afw::image::Image<PixelT> const & image, afw::geom::Point2D const & center, 
                       afw::geom::Box2I const & region);
@@ -95,6 +112,8 @@ private:
     ndarray::Array<double,1,1> _data;
     ndarray::Array<double,1,1> _weights;
     PTR(afw::detection::Footprint) _footprint;
+    afw::geom::Extent2I _boxDimensions;
+    afw::geom::Point2D _boxCenter;
 };
 
 }}}} // namespace lsst::meas::extensions::multiShapelet
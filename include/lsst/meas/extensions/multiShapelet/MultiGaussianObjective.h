@@ -27,12 +27,16 @@
 #include "lsst/meas/extensions/multiShapelet/HybridOptimizer.h"
 #include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
 #include "lsst/meas/extensions/multiShapelet/GaussianModelBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/MixtureKernel.h"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
 class MultiGaussianObjective : public Objective {
 public:
 
+    /// Change in any ellipse parameter that triggers a new pruning pass, when pruning is enabled.
+    static double const PRUNE_PARAMETER_CHANGE;
+
     typedef afw::geom::ellipses::Separable<afw::geom::ellipses::ConformalShear,
                                            afw::geom::ellipses::LogTraceRadius> EllipseCore;
 
@@ -58,13 +62,49 @@ public:
 
     ModelInputHandler const & getInputs() const { return _inputs; }
 
+    /// Number of (convolved) Gaussian components in the full model.
+    int getComponentCount() const { return _components.size(); }
+
+    /**
+     *  @brief Number of ellipse squared norms computed for each pixel by each call to computeFunction.
+     *
+     *  This is the number of convolved components (after pruning, if enabled) for a convolved
+     *  profile, and one for an unconvolved profile (whose components all share a single squared norm).
+     */
+    int getBuilderCount() const {
+        return _sharedNorm ? 1 : (_kernel ? int(_components.size()) : int(_builders.size()));
+    }
+
+    /// Relative L2 error of the pruned model at the ellipse used in the last pruning pass.
+    double getPruningError() const { return _pruningError; }
+
+    /// Total number of squared norms computed per pixel in all calls to computeFunction so far.
+    int getEvaluationCount() const { return _evaluationCount; }
+
     static EllipseCore readParameters(ndarray::Array<double const,1,1> const & parameters);
 
+    /**
+     *  @brief Compute the moments of an ellipse and their derivatives with respect to the
+     *         ellipse parameters, in closed form.
+     *
+     *  This is equivalent to Quadrupole::dAssign, but avoids the generic ellipse conversions.
+     */
+    static afw::geom::ellipses::Quadrupole computeQuadrupole(
+        EllipseCore const & ellipse,
+        Eigen::Matrix3d & jacobian
+    );
+
     static void writeParameters(EllipseCore const & ellipse, ndarray::Array<double,1,1> const & parameters);
 
     static std::pair<bool,bool> 
     constrainEllipse(EllipseCore & ellipse, double minRadius, double minAxisRatio);
 
+    /**
+     *  @brief Construct an objective for an unconvolved profile.
+     *
+     *  Because all the components have the same ellipse up to a scaling, the ellipse squared norm
+     *  is computed only once for all of them, and the mixture is evaluated from that.
+     */
     MultiGaussianObjective(
         ModelInputHandler const & inputs,
         MultiGaussian const & multiGaussian,
@@ -72,26 +112,75 @@ public:
         double minAxisRatio=1E-8
     );
 
+    /**
+     *  @brief Construct an objective for a profile convolved with a multi-Gaussian PSF.
+     *
+     *  If componentTolerance is positive, the profile components convolved with each PSF component
+     *  are merged (preserving flux and second moments) or dropped when that changes the model by
+     *  less than componentTolerance times its L2 norm (summed over all such changes).  If every
+     *  group would be dropped, the one that contributes the most is kept.
+     *
+     *  If maxBuilders is positive, groups of convolved components (from any PSF component) are then
+     *  merged the same way, cheapest first, until at most maxBuilders Gaussians remain or (if
+     *  componentTolerance is also positive) the next merge would exceed the tolerance.
+     *
+     *  The pruning is done on the first call to computeFunction, and repeated whenever any of the
+     *  ellipse parameters changes by more than PRUNE_PARAMETER_CHANGE since the last pruning.
+     */
     MultiGaussianObjective(
         ModelInputHandler const & inputs,
         MultiGaussian const & multiGaussian,
         MultiGaussian const & psfMultiGaussian,
         afw::geom::ellipses::Quadrupole const & psfEllipse,
         double minRadius=1E-8,
-        double minAxisRatio=1E-8
+        double minAxisRatio=1E-8,
+        double componentTolerance=0.0,
+        int maxBuilders=0
     );
 
 private:
 
     typedef std::vector<GaussianModelBuilder> BuilderList;
 
+    // A single profile component convolved with a single PSF component.
+    struct Component {
+        double flux;   // product of the profile and PSF component fluxes
+        double radius; // radius of the profile component relative to the ellipse
+        int psfIndex;  // index of the PSF component
+        afw::geom::ellipses::Quadrupole psfEllipse;
+    };
+
+    typedef std::vector<Component> ComponentList;
+
+    void pruneBuilders();
+
+    void computeSharedModel(ndarray::EigenView<double,1,1> & model);
+
+    void computeSharedDerivative(ndarray::Array<double,2,-2> const & derivative);
+
+    bool _sharedNorm;
     double _minRadius;
     double _minAxisRatio;
+    double _componentTolerance;
+    int _maxBuilders;
+    double _pruningError;
+    int _evaluationCount;
     double _amplitude;
     double _modelSquaredNorm;
     EllipseCore _ellipse;
+    EllipseCore _pruneEllipse;
     ModelInputHandler _inputs;
+    ComponentList _components;
     BuilderList _builders;
+    PTR(MixtureKernel) _kernel;
+    // Workspace for unconvolved profiles, which don't use builders (see computeSharedModel).
+    EllipseSquaredNorm _esn;
+    Eigen::Matrix3d _esnJacobian;
+    Eigen::RowVector3d _dNorm;
+    Eigen::VectorXd _rx;
+    Eigen::VectorXd _ry;
+    Eigen::VectorXd _sharedModel;
+    Eigen::VectorXd _sharedModelDerivative;
     ndarray::Array<double,1,1> _model;
 };
 
@@ -37,7 +37,21 @@ namespace lsst { namespace meas { namespace extensions { namespace multiShapelet
  *  Lookups are linear in the number of elements, but the most-recently used item is always
  *  checked first.
  *
- *  This is populated at import time in the Python module.
+ *  All operations are thread-safe.  References returned by lookup() stay valid, but replacing
+ *  a profile with insert() while another thread is using it is not safe.
+ *
+ *  The profiles in BuiltinProfiles.h are always present.  Others are read from profile files
+ *  (see addFile), which aren't opened until a lookup fails to find a name in the registry.  The
+ *  file data/reduced.mgp in the directory given by $MEAS_EXTENSIONS_MULTISHAPELET_DIR, which
+ *  holds the reduced profiles written by examples/reduceProfiles.py, is always searched first.
+ *
+ *  A profile file is a binary file (in little-endian byte order) that starts with the 8 characters "MSPROFIL",
+ *  a uint32 format version (currently 1) and a uint32 profile count.  Each profile then has a
+ *  uint32 name length, a uint32 component count, the name (not null-terminated) padded with
+ *  zeros to a multiple of 8 bytes, and the component fluxes and radii as arrays of doubles.
+ *  Fluxes are used as-is, so they should be normalized when written.  The writeProfileFile
+ *  function in examples/reduceProfiles.py writes this format.  Files are mapped and read in
+ *  place, so they can only be used on little-endian platforms.
  */
 class MultiGaussianRegistry {
 public:
@@ -45,6 +59,15 @@ public:
     /// @brief Retrieve the MultiGaussian with the given name or throw NotFoundError.
     static MultiGaussian const & lookup(std::string const & name);
 
+    /**
+     *  @brief Add a profile file to be searched when a name is not found in the registry.
+     *
+     *  The file is not opened until it is needed, and is memory-mapped rather than read.  Files
+     *  are searched in the order they were added, and the first profile with a name is used.
+     *  Profiles inserted directly always take precedence over those in files.
+     */
+    static void addFile(std::string const & filename);
+
     /// @brief Insert a new MultiGaussian (replaces if name is already present).
     static void insert(std::string const & name, MultiGaussian const & multiGaussian);
 
@@ -0,0 +1,126 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_PsfModelObjective_h_INCLUDED
+#define MULTISHAPELET_PsfModelObjective_h_INCLUDED
+
+#include <vector>
+
+#include "Eigen/StdVector"
+
+#include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief An Objective that fits a PSF-convolved multi-Gaussian profile to an analytic PSF model.
+ *
+ *  This is the pixel-free counterpart of a MultiGaussianObjective fit to an image of the PSF:
+ *  the model is the profile convolved with the Gaussian terms of a FitPsfModel, and the data is
+ *  the full FitPsfModel.  The squared norm of the residual is computed in closed form from inner
+ *  products of Gaussians and Gauss-Hermite functions, so there is no image and no pixel loop, and
+ *  the cost does not depend on the size of the PSF image.
+ *
+ *  The function vector has a single element: the L2 norm of the residual, after the amplitude has
+ *  been set to its best-fit value for the current ellipse.  Its derivative is computed analytically
+ *  from the derivatives of the inner products with respect to the ellipse moments, at the same
+ *  time as the function.  As with MultiGaussianObjective, computeDerivative must be called with
+ *  the parameters most recently passed to computeFunction.
+ */
+class PsfModelObjective : public Objective {
+public:
+
+    typedef MultiGaussianObjective::EllipseCore EllipseCore;
+
+    virtual StepResult tryStep(
+        ndarray::Array<double const,1,1> const & oldParameters, 
+        ndarray::Array<double,1,1> const & newParameters
+    );
+
+    virtual void computeFunction(
+        ndarray::Array<double const,1,1> const & parameters, 
+        ndarray::Array<double,1,1> const & function
+    );
+
+    virtual void computeDerivative(
+        ndarray::Array<double const,1,1> const & parameters, 
+        ndarray::Array<double const,1,1> const & function,
+        ndarray::Array<double,2,-2> const & derivative
+    );
+
+    double getAmplitude() const { return _amplitude; }
+
+    /**
+     *  @brief Return the inner product (the integral of the product) of two multi-shapelet functions.
+     *
+     *  This is computed exactly, as the convolution of one function with the reflection of the
+     *  other, evaluated at the origin.
+     */
+    static double computeInnerProduct(
+        shapelet::MultiShapeletFunction const & a,
+        shapelet::MultiShapeletFunction const & b
+    );
+
+    PsfModelObjective(
+        MultiGaussian const & multiGaussian,
+        FitPsfModel const & psfModel,
+        double minRadius=1E-8,
+        double minAxisRatio=1E-8
+    );
+
+private:
+
+    // A Gaussian term of the unit-amplitude model: flux * N(0, radius^2 Q + psfMoments),
+    // where Q is the moments matrix of the ellipse being fit.
+    struct ModelTerm {
+        double flux;
+        double radius2;
+        Eigen::Matrix2d psfMoments;
+    };
+
+    // A Gauss-Hermite expansion in the PSF model.  The coefficients are divided by the
+    // normalization of the Hermite polynomials, sqrt(2^(x+y) x! y!).
+    struct PsfTerm {
+        int order;
+        Eigen::Matrix2d gridTransform;
+        Eigen::VectorXd coefficients;
+    };
+
+    double _computeGaussianProduct(
+        Eigen::Matrix2d const & moments, Eigen::Matrix2d & gradient
+    ) const;
+
+    double _minRadius;
+    double _minAxisRatio;
+    double _amplitude;
+    double _psfSquaredNorm;
+    EllipseCore _ellipse;
+    Eigen::RowVector3d _gradient;  // derivative of the residual norm, set by computeFunction
+    std::vector< ModelTerm, Eigen::aligned_allocator<ModelTerm> > _modelTerms;
+    std::vector< PsfTerm, Eigen::aligned_allocator<PsfTerm> > _psfTerms;
+    std::vector< std::pair<int,int> > _indices;  // (x order, y order) of each packed shapelet index
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_PsfModelObjective_h_INCLUDED
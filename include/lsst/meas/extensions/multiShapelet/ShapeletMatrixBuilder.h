@@ -0,0 +1,181 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_ShapeletMatrixBuilder_h_INCLUDED
+#define MULTISHAPELET_ShapeletMatrixBuilder_h_INCLUDED
+
+#include <vector>
+
+#include "Eigen/Core"
+#include "ndarray/eigen.h"
+
+#include "lsst/afw/geom/ellipses.h"
+#include "lsst/shapelet.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Evaluates a weighted Gauss-Hermite shapelet basis on a set of pixels.
+ *
+ *  This produces the same matrix as shapelet::MatrixBuilder with the HERMITE basis (the
+ *  columns are ordered as in shapelet::PackedIndex), but multiplies each row by an optional
+ *  per-pixel weight in the same pass.  Pixels are processed in blocks of BLOCK_SIZE: for each
+ *  block, the 1-d Hermite recurrences and the Gaussian factor are computed once into small
+ *  workspace arrays that stay in cache, and then every column segment is written exactly once,
+ *  with vectorized array expressions.
+ *
+ *  addModel() uses the same blocks to evaluate a single shapelet function, summing over the
+ *  basis within each block so the full matrix is never formed.
+ *
+ *  The builder itself holds no workspace, so a single builder may be used from several threads;
+ *  a Workspace, on the other hand, belongs to one thread.
+ */
+class ShapeletMatrixBuilder {
+public:
+
+    /// @brief Number of pixels processed together.
+    static int const BLOCK_SIZE = 128;
+
+#ifndef SWIG
+    /**
+     *  @brief Scratch arrays for evaluating the basis with a single ellipse, one block at a time.
+     *
+     *  operator() and addModel() construct one internally for each call.  Callers that visit
+     *  the same pixels in blocks with several ellipses (see FitComboAlgorithm::apply) can
+     *  construct one per ellipse up front and reuse it for every block.
+     */
+    class Workspace {
+    public:
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+        /// @brief Construct a workspace for the given ellipse and shapelet order.
+        Workspace(afw::geom::ellipses::Ellipse const & ellipse, int order);
+
+        /// @brief Shapelet order the workspace was constructed for.
+        int getOrder() const { return _hu.cols() - 1; }
+
+    private:
+
+        friend class ShapeletMatrixBuilder;
+
+        // After fill(), the weighted basis function with (x order, y order) = (i, j) at block
+        // pixel k is _g[k] * _hu(k, i) * _hv(k, j).
+        void fill(double const * x, double const * y, double const * weights, int n);
+
+        afw::geom::AffineTransform _gt;
+        double _norm;
+        Eigen::ArrayXd _u;
+        Eigen::ArrayXd _v;
+        Eigen::ArrayXd _g;
+        Eigen::ArrayXd _sum;
+        Eigen::ArrayXXd _hu;
+        Eigen::ArrayXXd _hv;
+    };
+#endif
+
+    /**
+     *  @brief Construct a builder for the given pixel positions.
+     *
+     *  The coordinate arrays are not copied, and must not be modified while the builder is in use.
+     */
+    ShapeletMatrixBuilder(
+        ndarray::Array<double const,1,1> const & x,
+        ndarray::Array<double const,1,1> const & y,
+        int order
+    );
+
+    /// @brief Shapelet order of the basis.
+    int getOrder() const { return _order; }
+
+    /// @brief Number of pixels (rows of the matrix).
+    int getDataSize() const { return _x.getSize<0>(); }
+
+    /// @brief Number of basis functions (columns of the matrix).
+    int getBasisSize() const { return _indices.size(); }
+
+    /**
+     *  @brief Fill a matrix with the basis evaluated on the pixels.
+     *
+     *  @param[out] output    Matrix with getBasisSize() columns; row i corresponds to pixel
+     *                        (begin + i).  Usually has getDataSize() rows, but a subset of the
+     *                        rows may be filled to process the pixels in chunks.
+     *  @param[in]  ellipse   Ellipse that defines the basis.
+     *  @param[in]  weights   Per-pixel weights to multiply each row by; may be empty.  Must have
+     *                        getDataSize() elements regardless of the number of output rows.
+     *  @param[in]  begin     Index of the pixel corresponding to the first row of the output.
+     */
+    void operator()(
+        ndarray::Array<double,2,-1> const & output,
+        afw::geom::ellipses::Ellipse const & ellipse,
+        ndarray::Array<double const,1,1> const & weights = ndarray::Array<double const,1,1>(),
+        int begin = 0
+    ) const;
+
+    /**
+     *  @brief Add a weighted shapelet function to a vector, without building the basis matrix.
+     *
+     *  This is equivalent to adding the product of the matrix produced by operator() and the
+     *  coefficient vector, but requires only O(getDataSize()) memory.
+     *
+     *  @param[in,out] output        Vector to add the model to; element i corresponds to pixel
+     *                               (begin + i).  Usually has getDataSize() elements.
+     *  @param[in]     ellipse       Ellipse that defines the basis.
+     *  @param[in]     coefficients  Shapelet coefficients, with getBasisSize() elements.
+     *  @param[in]     weights       Per-pixel weights to multiply the model by; may be empty.  Must
+     *                               have getDataSize() elements regardless of the size of the output.
+     *  @param[in]     begin         Index of the pixel corresponding to the first output element.
+     */
+    void addModel(
+        ndarray::Array<double,1,1> const & output,
+        afw::geom::ellipses::Ellipse const & ellipse,
+        ndarray::Array<double const,1,1> const & coefficients,
+        ndarray::Array<double const,1,1> const & weights = ndarray::Array<double const,1,1>(),
+        int begin = 0
+    ) const;
+
+#ifndef SWIG
+    /**
+     *  @brief Add a weighted shapelet function to a vector, using an existing workspace.
+     *
+     *  This is identical to the other addModel overload, with the ellipse taken from the
+     *  workspace, which must have been constructed with the same order as the builder.
+     */
+    void addModel(
+        ndarray::Array<double,1,1> const & output,
+        Workspace & workspace,
+        ndarray::Array<double const,1,1> const & coefficients,
+        ndarray::Array<double const,1,1> const & weights = ndarray::Array<double const,1,1>(),
+        int begin = 0
+    ) const;
+#endif
+
+private:
+    int _order;
+    ndarray::Array<double const,1,1> _x;
+    ndarray::Array<double const,1,1> _y;
+    std::vector< std::pair<int,int> > _indices; // (x order, y order) for each column
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_ShapeletMatrixBuilder_h_INCLUDED
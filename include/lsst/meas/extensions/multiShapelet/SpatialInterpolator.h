@@ -0,0 +1,172 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_SpatialInterpolator_h_INCLUDED
+#define MULTISHAPELET_SpatialInterpolator_h_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include "boost/function.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/thread/mutex.hpp"
+#include "ndarray/eigen.h"
+
+#include "lsst/base.h"
+#include "lsst/pex/exceptions.h"
+#include "lsst/afw/geom/Box.h"
+#include "lsst/afw/detection/Psf.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief A vector-valued function of position, approximated by 2-d Chebyshev polynomials.
+ *
+ *  Each element of the vector is fit independently (but with the same basis) to values
+ *  sampled at a set of points, using least squares.  The basis includes all products
+ *  @f$T_i(x)T_j(y)@f$ with @f$i+j \le@f$ order, where x and y are scaled to [-1,1]
+ *  over the bounding box.
+ *
+ *  This is used to evaluate quantities that vary smoothly over an exposure (such as
+ *  PSF model parameters) at source positions, after computing them directly at a
+ *  much smaller number of points.
+ */
+class SpatialInterpolator {
+public:
+
+    /**
+     *  @brief Fit the interpolating polynomials to a set of samples.
+     *
+     *  @param[in] bbox     Region over which the interpolator will be evaluated.
+     *  @param[in] order    Maximum total order of the Chebyshev polynomials.
+     *  @param[in] points   Positions of the samples.
+     *  @param[in] values   Sampled values, with shape (points.size(), valueSize).
+     */
+    SpatialInterpolator(
+        afw::geom::Box2D const & bbox,
+        int order,
+        std::vector<afw::geom::Point2D> const & points,
+        ndarray::Array<double const,2,2> const & values
+    );
+
+    /// @brief Return the region over which the interpolator is valid.
+    afw::geom::Box2D const & getBBox() const { return _bbox; }
+
+    /// @brief Return the maximum total order of the Chebyshev polynomials.
+    int getOrder() const { return _order; }
+
+    /// @brief Return the number of polynomial terms per value.
+    int getTermSize() const { return _coefficients.rows(); }
+
+    /// @brief Return the number of elements in the interpolated vector.
+    int getValueSize() const { return _coefficients.cols(); }
+
+    /// @brief Evaluate the interpolated vector at a point, writing it to the given array.
+    void evaluate(afw::geom::Point2D const & point, ndarray::Array<double,1,1> const & output) const;
+
+    /// @brief Evaluate the interpolated vector at a point.
+    ndarray::Array<double,1,1> evaluate(afw::geom::Point2D const & point) const;
+
+    /// @brief Return the number of terms in a basis with the given maximum order.
+    static int computeTermSize(int order) { return (order + 1) * (order + 2) / 2; }
+
+    /**
+     *  @brief Return a grid of points suitable for sampling a function to be interpolated.
+     *
+     *  Points are placed at the Chebyshev nodes (of the first kind) in each dimension,
+     *  which keeps the interpolation error well-behaved near the edges of the box.
+     */
+    static std::vector<afw::geom::Point2D> makeGrid(afw::geom::Box2D const & bbox, int nx, int ny);
+
+private:
+
+    void _fillBasis(afw::geom::Point2D const & point, Eigen::VectorXd & basis) const;
+
+    afw::geom::Box2D _bbox;
+    int _order;
+    Eigen::MatrixXd _coefficients;
+};
+
+/**
+ *  @brief Holds a per-exposure interpolation grid, rebuilt when the PSF or bounding box changes.
+ *
+ *  This is used by the algorithms that compute something on a grid once per exposure and
+ *  interpolate it to each source.  We hold a pointer to the PSF the grid was built from, so a
+ *  new PSF can never be allocated at the same address and mistaken for the old one.  A failure
+ *  to build the grid is remembered just like a grid, so it is not retried for every source on
+ *  the same exposure.
+ *
+ *  The lock is only held while checking and (if necessary) building the grid; T's const
+ *  member functions must be safe to call concurrently.
+ */
+template <typename T>
+class SpatialGridCache : private boost::noncopyable {
+public:
+
+    typedef boost::function<CONST_PTR(T)()> Factory;
+
+    SpatialGridCache() {}
+
+    /**
+     *  @brief Return the grid for the given PSF and bounding box, calling factory() to build it if needed.
+     *
+     *  @throw pex::exceptions::RuntimeError if the grid for this PSF and bounding box could not be
+     *         built, either now or on a previous call.
+     */
+    CONST_PTR(T) get(
+        CONST_PTR(afw::detection::Psf) const & psf,
+        afw::geom::Box2D const & bbox,
+        Factory const & factory
+    ) {
+        boost::mutex::scoped_lock lock(_mutex);
+        if (!_psf || psf != _psf || bbox != _bbox) {
+            _grid.reset();
+            _failure.clear();
+            _psf = psf;
+            _bbox = bbox;
+            try {
+                _grid = factory();
+            } catch (pex::exceptions::Exception & err) {
+                _grid.reset();
+                _failure = err.what();
+            }
+        }
+        if (!_grid) {
+            throw LSST_EXCEPT(
+                pex::exceptions::RuntimeError,
+                "Could not build interpolation grid for this exposure: " + _failure
+            );
+        }
+        return _grid;
+    }
+
+private:
+    boost::mutex _mutex;                     // guards all other data members
+    CONST_PTR(afw::detection::Psf) _psf;     // PSF used to build _grid (also keeps it alive)
+    afw::geom::Box2D _bbox;                  // bounding box used to build _grid
+    CONST_PTR(T) _grid;                      // null if the grid could not be built
+    std::string _failure;                    // why the grid could not be built
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#endif // !MULTISHAPELET_SpatialInterpolator_h_INCLUDED
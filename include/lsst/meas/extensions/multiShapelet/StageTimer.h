@@ -0,0 +1,168 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+#ifndef MULTISHAPELET_StageTimer_h_INCLUDED
+#define MULTISHAPELET_StageTimer_h_INCLUDED
+
+#include <string>
+
+#include "boost/noncopyable.hpp"
+#include "boost/thread/mutex.hpp"
+
+#include "lsst/base.h"
+#include "lsst/daf/base/PropertyList.h"
+
+/**
+ *  Set to 1 (e.g. with "scons timers=1") to time the stages of each measurement; when 0, the
+ *  MULTISHAPELET_TIMER macros expand to nothing.  Class layouts don't depend on this, so code built
+ *  with and without it can be mixed.
+ */
+#ifndef MULTISHAPELET_ENABLE_TIMERS
+#define MULTISHAPELET_ENABLE_TIMERS 0
+#endif
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+/**
+ *  @brief Wall-clock time spent in each stage of an algorithm's measurements, summed over all
+ *         sources and threads.
+ *
+ *  Totals are accumulated in memory, and only written to the algorithm's metadata when
+ *  writeAllMetadata() is called or the StageTimes is destroyed (along with its algorithm), as
+ *  <PREFIX>_<STAGE>_SECONDS and <PREFIX>_<STAGE>_COUNT, where the prefix is the algorithm name
+ *  in upper case with '.' replaced by '_', followed by "_TIMER" (e.g.
+ *  MULTISHAPELET_EXP_TIMER_OPTIMIZER_RUN_SECONDS).  In Python, use getStageTimes(), which calls
+ *  writeAllMetadata() first, to read them.
+ *
+ *  Stages don't nest: time spent in a stage that starts while another is running in the same
+ *  thread goes to the one that was already running.  For instance, the optimizer used to fit
+ *  the PSF factor is counted as PSF_FACTOR_FIT, not OPTIMIZER_RUN.  APPLY is the total time
+ *  spent measuring each source, including any time not assigned to one of the other stages.
+ */
+class StageTimes : private boost::noncopyable {
+public:
+
+    enum Stage {
+        INPUTS = 0,        ///< Preparing the pixels to fit (adjustInputs, or rendering the PSF to fit).
+        OPTIMIZER_SETUP,   ///< Constructing the objective and optimizer.
+        OPTIMIZER_RUN,     ///< HybridOptimizer::run.
+        SHAPELET_TERMS,    ///< Linear fits with the full shapelet PSF (fitShapeletTerms, FitCombo).
+        PSF_FACTOR_RENDER, ///< Rendering the PSF image for the PSF factor fit.
+        PSF_FACTOR_FIT,    ///< Fitting the PSF factor (or interpolating it from a grid).
+        APPLY,             ///< Total time spent measuring each source.
+        N_STAGES
+    };
+
+    /// @brief Return the name of a stage, as used in the metadata keys.
+    static char const * getStageName(Stage stage);
+
+    /// @brief Add time to a stage (thread-safe).
+    void add(Stage stage, double seconds);
+
+    double getSeconds(Stage stage) const;
+
+    int getCount(Stage stage) const;
+
+    /// @brief Write the totals to the metadata (thread-safe).
+    void writeMetadata() const;
+
+    /// @brief Write the totals of every existing StageTimes to its metadata (thread-safe).
+    static void writeAllMetadata();
+
+    /// @brief Return true if the library was built with MULTISHAPELET_ENABLE_TIMERS.
+    static bool isEnabled();
+
+    /// @brief Return the current value of the steady clock used by the timers, in seconds.
+    static double getTime();
+
+    StageTimes(std::string const & algorithmName, PTR(daf::base::PropertyList) const & metadata);
+
+    /// @brief Write the totals to the metadata one last time.
+    ~StageTimes();
+
+private:
+    std::string _prefix;
+    PTR(daf::base::PropertyList) _metadata;
+    double _seconds[N_STAGES];
+    int _counts[N_STAGES];
+    mutable boost::mutex _mutex;
+};
+
+/**
+ *  @brief Time a stage until stop() is called or the timer goes out of scope.
+ *
+ *  Times are added to the StageTimes of the ApplyTimer active in the current thread; if there is
+ *  none (or another stage is already being timed in this thread), the timer does nothing.
+ *
+ *  This should only be used via the MULTISHAPELET_TIMER macros, so it's compiled out when
+ *  MULTISHAPELET_ENABLE_TIMERS is 0.
+ */
+class StageTimer : private boost::noncopyable {
+public:
+
+    explicit StageTimer(StageTimes::Stage stage);
+
+    void stop();
+
+    ~StageTimer() { stop(); }
+
+private:
+    StageTimes::Stage _stage;
+    StageTimes * _times;
+    double _start;
+};
+
+/**
+ *  @brief Set the StageTimes used by StageTimers in the current thread, and time the APPLY stage.
+ *
+ *  A null pointer disables the stage timers in its scope.
+ */
+class ApplyTimer : private boost::noncopyable {
+public:
+
+    explicit ApplyTimer(StageTimes * times);
+
+    ~ApplyTimer();
+
+private:
+    StageTimes * _times;
+    StageTimes * _previous;
+    double _start;
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
+
+#if MULTISHAPELET_ENABLE_TIMERS
+#define MULTISHAPELET_APPLY_TIMER(TIMES) \
+    ::lsst::meas::extensions::multiShapelet::ApplyTimer multiShapeletApplyTimer(TIMES)
+#define MULTISHAPELET_TIMER(NAME, STAGE) \
+    ::lsst::meas::extensions::multiShapelet::StageTimer NAME(   \
+        ::lsst::meas::extensions::multiShapelet::StageTimes::STAGE \
+    )
+#define MULTISHAPELET_TIMER_STOP(NAME) NAME.stop()
+#else
+#define MULTISHAPELET_APPLY_TIMER(TIMES)
+#define MULTISHAPELET_TIMER(NAME, STAGE)
+#define MULTISHAPELET_TIMER_STOP(NAME)
+#endif
+
+#endif // !MULTISHAPELET_StageTimer_h_INCLUDED
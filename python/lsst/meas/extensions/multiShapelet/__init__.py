@@ -27,18 +27,29 @@ lsst.meas.algorithms.AlgorithmRegistry.register("multishapelet.exp", FitProfileC
 lsst.meas.algorithms.AlgorithmRegistry.register("multishapelet.dev", FitProfileControl, FitDeVaucouleurConfig)
 lsst.meas.algorithms.AlgorithmRegistry.register("multishapelet.combo", FitComboControl)
 
-def loadProfiles():
-    import os
-    import cPickle
-    root = os.environ["MEAS_EXTENSIONS_MULTISHAPELET_DIR"]
-    for filename in ("tractor.p",):
-        with open(os.path.join(root, "data", filename), "r") as f:
-            d = cPickle.load(f)
-            for k, v in d.iteritems():
-                flux, radius = v
-                MultiGaussianRegistry.insert(k, flux, radius, True)
-loadProfiles()
+def getStageTimes(metadata, algorithmName):
+    """Return the stage timings recorded for an algorithm as a dict of {stage: (seconds, count)}.
+
+    The metadata is the PropertyList the algorithms were constructed with (e.g. the algMetadata
+    attribute of SourceMeasurementTask); stage names are lower-case versions of the
+    StageTimes.Stage enum names (e.g. "optimizer_run").  Timings are only recorded if the
+    library was built with MULTISHAPELET_ENABLE_TIMERS ("scons timers=1"); otherwise the
+    dict is empty.
+
+    The algorithms accumulate their timings in memory, so this first writes the current totals
+    of all existing algorithms to their metadata (see StageTimes.writeAllMetadata).
+    """
+    StageTimes.writeAllMetadata()
+    prefix = algorithmName.upper().replace(".", "_") + "_TIMER_"
+    result = {}
+    for name in metadata.names():
+        if not name.startswith(prefix) or not name.endswith("_SECONDS"):
+            continue
+        stage = name[len(prefix):-len("_SECONDS")]
+        countName = prefix + stage + "_COUNT"
+        count = metadata.get(countName) if metadata.exists(countName) else 0
+        result[stage.lower()] = (metadata.get(name), count)
+    return result
 
 # cleanup namespace
-del loadProfiles
 del lsst
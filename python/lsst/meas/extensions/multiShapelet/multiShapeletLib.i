@@ -38,6 +38,32 @@ Measurement algorithms using galaxy models built from multi-scale shapelets.
 %include "std_pair.i"
 
 %lsst_exceptions()
+
+// Release the GIL while calling FUNC, translating exceptions as %lsst_exceptions does.
+// FUNC must not touch any Python objects, and must be safe to call from several threads at once
+// (for the library's shared state, see MultiGaussianRegistry, ConvolutionCache and BoxGridCache).
+// These functions copy and take views of the arrays held by their arguments, and ndarray's
+// reference counts aren't atomic (see BatchRunner), so while one runs, other Python threads must
+// not use its arguments, or anything that shares arrays with them (ModelInputHandler copies are
+// shallow, as are the objectives and NumPy views made from them).  Control objects are only read,
+// and may be shared.
+%define %releaseGIL(FUNC)
+%exception FUNC {
+    PyThreadState * _save = PyEval_SaveThread();
+    try {
+        $action
+        PyEval_RestoreThread(_save);
+    } catch (lsst::pex::exceptions::Exception & err) {
+        PyEval_RestoreThread(_save);
+        raiseLsstException(err);
+        SWIG_fail;
+    } catch (std::exception & err) {
+        PyEval_RestoreThread(_save);
+        PyErr_SetString(PyExc_RuntimeError, err.what());
+        SWIG_fail;
+    }
+}
+%enddef
 %import "lsst/afw/geom/geomLib.i"
 %import "lsst/afw/geom/ellipses/ellipsesLib.i"
 %import "lsst/afw/detection/detectionLib.i"
@@ -51,12 +77,17 @@ Measurement algorithms using galaxy models built from multi-scale shapelets.
 %declareNumPyConverters(ndarray::Array<double,1,1>);
 %declareNumPyConverters(ndarray::Array<double,2,-1>);
 %declareNumPyConverters(ndarray::Array<double,2,-2>);
+%declareNumPyConverters(ndarray::Array<double const,2,2>);
+%declareNumPyConverters(ndarray::Array<double,2,2>);
+%declareNumPyConverters(ndarray::Array<int,1,1>);
 %declareNumPyConverters(Eigen::Matrix<double,3,Eigen::Dynamic>);
 
 %include "lsst/meas/extensions/multiShapelet/ModelInputHandler.h"
 
 %template(ModelInputHandler) lsst::meas::extensions::multiShapelet::ModelInputHandler::ModelInputHandler<float>;
 %template(ModelInputHandler) lsst::meas::extensions::multiShapelet::ModelInputHandler::ModelInputHandler<double>;
+%template(ModelInputHandlerList) std::vector<lsst::meas::extensions::multiShapelet::ModelInputHandler>;
+%template(Point2DList) std::vector<lsst::afw::geom::Point2D>;
 
 %rename(__len__) lsst::meas::extensions::multiShapelet::MultiGaussian::size;
 %rename(__getitem__) lsst::meas::extensions::multiShapelet::MultiGaussian::operator[];
@@ -71,7 +102,11 @@ def __iter__(self):
 
 %include "lsst/meas/extensions/multiShapelet/GaussianModelBuilder.h"
 
+%rename(__call__) lsst::meas::extensions::multiShapelet::ShapeletMatrixBuilder::operator();
+%include "lsst/meas/extensions/multiShapelet/ShapeletMatrixBuilder.h"
+
 %shared_ptr(lsst::meas::extensions::multiShapelet::Objective);
+%releaseGIL(lsst::meas::extensions::multiShapelet::HybridOptimizer::run);
 %include "lsst/meas/extensions/multiShapelet/HybridOptimizer.h"
 
 %include "lsst/meas/extensions/multiShapelet/MultiGaussianRegistry.h"
@@ -105,17 +140,57 @@ namespace lsst { namespace meas { namespace extensions { namespace multiShapelet
 
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitPsfControl);
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitPsfAlgorithm);
+// The overloads that take a Psf call Psf::computeImage, so threads should use separate Psfs.
+%releaseGIL(lsst::meas::extensions::multiShapelet::FitPsfAlgorithm::apply);
 %include "lsst/meas/extensions/multiShapelet/FitPsf.h"
 
+%include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+%include "lsst/meas/extensions/multiShapelet/FitPsfGrid.h"
+
+// Let SWIG know the cache key hashes are just integers; stdint.i gets their sizes right
+// for the target platform.
+%include "stdint.i"
+namespace boost {
+typedef ::uint32_t uint32_t;
+typedef ::uint64_t uint64_t;
+}
+%include "lsst/meas/extensions/multiShapelet/FitPsfGridCache.h"
+
+%releaseGIL(lsst::meas::extensions::multiShapelet::FitPsfBatch::apply);
+%include "lsst/meas/extensions/multiShapelet/FitPsfBatch.h"
+%template(apply) lsst::meas::extensions::multiShapelet::FitPsfBatch::apply<float>;
+%template(apply) lsst::meas::extensions::multiShapelet::FitPsfBatch::apply<double>;
+
+%shared_ptr(lsst::meas::extensions::multiShapelet::PsfModelObjective);
+%include "lsst/meas/extensions/multiShapelet/PsfModelObjective.h"
+
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitProfileControl);
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitProfileAlgorithm);
+%releaseGIL(lsst::meas::extensions::multiShapelet::FitProfileAlgorithm::apply);
 %include "lsst/meas/extensions/multiShapelet/FitProfile.h"
 
 %template(adjustInputs) lsst::meas::extensions::multiShapelet::FitProfileAlgorithm::adjustInputs<float>;
 %template(adjustInputs) lsst::meas::extensions::multiShapelet::FitProfileAlgorithm::adjustInputs<double>;
 
+%include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
+
+// Python only needs the static StageTimes functions (see getStageTimes).
+%ignore lsst::meas::extensions::multiShapelet::StageTimes::StageTimes;
+%ignore lsst::meas::extensions::multiShapelet::StageTimer;
+%ignore lsst::meas::extensions::multiShapelet::ApplyTimer;
+%include "lsst/meas/extensions/multiShapelet/StageTimer.h"
+
+%releaseGIL(lsst::meas::extensions::multiShapelet::FitProfileBatch::apply);
+%include "lsst/meas/extensions/multiShapelet/FitProfileBatch.h"
+
+// FitProfileModel has no default constructor.
+%ignore std::vector<lsst::meas::extensions::multiShapelet::FitProfileModel>::vector(size_type);
+%ignore std::vector<lsst::meas::extensions::multiShapelet::FitProfileModel>::resize;
+%template(FitProfileModelList) std::vector<lsst::meas::extensions::multiShapelet::FitProfileModel>;
+
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitComboControl);
 %shared_ptr(lsst::meas::extensions::multiShapelet::FitComboAlgorithm);
+%releaseGIL(lsst::meas::extensions::multiShapelet::FitComboAlgorithm::apply);
 %include "lsst/meas/extensions/multiShapelet/FitCombo.h"
 
 %template(adjustInputs) lsst::meas::extensions::multiShapelet::FitComboAlgorithm::adjustInputs<float>;
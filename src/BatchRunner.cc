@@ -0,0 +1,153 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <string>
+#include <exception>
+#include <algorithm>
+
+#include <time.h>
+
+#include "boost/thread/thread.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/bind.hpp"
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/meas/extensions/multiShapelet/BatchRunner.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+double getTime() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+class Queue {
+public:
+
+    // If order is not null, tasks are run in that order; if times is not null, it must have
+    // size elements, and is filled with the time spent in each task.
+    Queue(
+        int size, BatchRunner::Task const & task,
+        std::vector<int> const * order=0, std::vector<double> * times=0
+    ) : _next(0), _size(size), _task(task), _order(order), _times(times) {}
+
+    // Thread entry point: run tasks until there are none left.
+    void work() {
+        int n = 0;
+        while (pop(n)) {
+            double start = _times ? getTime() : 0.0;
+            try {
+                _task(n);
+            } catch (std::exception & err) {
+                fail(err.what());
+            } catch (...) {
+                fail("unknown exception in batch task");
+            }
+            if (_times) (*_times)[n] = getTime() - start;
+        }
+    }
+
+    bool hasFailed() const { return !_message.empty(); }
+
+    std::string const & getMessage() const { return _message; }
+
+private:
+
+    bool pop(int & n) {
+        boost::mutex::scoped_lock lock(_mutex);
+        if (_next >= _size) return false;
+        n = _order ? (*_order)[_next] : _next;
+        ++_next;
+        return true;
+    }
+
+    void fail(char const * message) {
+        boost::mutex::scoped_lock lock(_mutex);
+        if (_message.empty()) _message = message;
+    }
+
+    int _next;
+    int const _size;
+    BatchRunner::Task const & _task;
+    std::vector<int> const * _order;
+    std::vector<double> * _times;
+    boost::mutex _mutex;
+    std::string _message;
+};
+
+struct CompareCosts {
+    explicit CompareCosts(std::vector<double> const & costs) : _costs(costs) {}
+    bool operator()(int a, int b) const { return _costs[a] > _costs[b]; }
+    std::vector<double> const & _costs;
+};
+
+void runQueue(Queue & queue, int nThreads) {
+    if (nThreads == 1) {
+        queue.work();
+    } else {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; ++i) {
+            threads.create_thread(boost::bind(&Queue::work, &queue));
+        }
+        threads.join_all();
+    }
+    if (queue.hasFailed()) {
+        throw LSST_EXCEPT(pex::exceptions::RuntimeError, queue.getMessage());
+    }
+}
+
+} // anonymous
+
+int BatchRunner::computeThreadCount(int size, int nThreads) {
+    if (nThreads <= 0) {
+        nThreads = boost::thread::hardware_concurrency();
+    }
+    return std::max(1, std::min(nThreads, size));
+}
+
+void BatchRunner::run(int size, Task const & task, int nThreads) {
+    Queue queue(size, task);
+    runQueue(queue, computeThreadCount(size, nThreads));
+}
+
+void BatchRunner::run(
+    std::vector<double> const & costs, Task const & task, int nThreads, std::vector<double> * times
+) {
+    int const size = costs.size();
+    std::vector<int> order(size);
+    for (int n = 0; n < size; ++n) {
+        order[n] = n;
+    }
+    // stable, so ties (e.g. all costs equal) keep index order
+    std::stable_sort(order.begin(), order.end(), CompareCosts(costs));
+    if (times) {
+        times->assign(size, 0.0);
+    }
+    Queue queue(size, task, &order, times);
+    runQueue(queue, computeThreadCount(size, nThreads));
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
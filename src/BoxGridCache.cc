@@ -0,0 +1,125 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <map>
+
+#include "boost/thread/tss.hpp"
+#include "boost/make_shared.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/BoxGridCache.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// We only expect a few distinct box sizes (one per PSF model, usually); if we see more than
+// this, we assume we're not being used for PSF images and start over rather than grow forever.
+std::size_t const MAX_BOX_COUNT = 16;
+
+struct BoxEntry {
+    typedef std::map< int, PTR(ShapeletMatrixBuilder) > BuilderMap;
+
+    explicit BoxEntry(afw::geom::Extent2I const & dimensions) :
+        x(ndarray::allocate(dimensions.getX() * dimensions.getY())),
+        y(ndarray::allocate(dimensions.getX() * dimensions.getY()))
+    {
+        int n = 0;
+        for (int iy = 0; iy < dimensions.getY(); ++iy) {
+            for (int ix = 0; ix < dimensions.getX(); ++ix, ++n) {
+                x[n] = ix;
+                y[n] = iy;
+            }
+        }
+    }
+
+    ndarray::Array<double,1,1> x;
+    ndarray::Array<double,1,1> y;
+    BuilderMap builders;
+};
+
+typedef std::map< std::pair<int,int>, PTR(BoxEntry) > BoxMap;
+
+boost::thread_specific_ptr<BoxMap> boxCache;
+
+BoxEntry & getEntry(afw::geom::Extent2I const & dimensions) {
+    if (!boxCache.get()) {
+        boxCache.reset(new BoxMap());
+    }
+    std::pair<int,int> key(dimensions.getX(), dimensions.getY());
+    BoxMap::iterator i = boxCache->find(key);
+    if (i == boxCache->end()) {
+        if (boxCache->size() >= MAX_BOX_COUNT) {
+            boxCache->clear();
+        }
+        i = boxCache->insert(std::make_pair(key, boost::make_shared<BoxEntry>(dimensions))).first;
+    }
+    return *i->second;
+}
+
+} // anonymous
+
+PTR(ShapeletMatrixBuilder) BoxGridCache::getBuilder(
+    ModelInputHandler const & inputs,
+    int order,
+    afw::geom::ellipses::Ellipse & ellipse
+) {
+    afw::geom::Extent2I dimensions = inputs.getBoxDimensions();
+    if (dimensions.getX() <= 0 || dimensions.getY() <= 0) {
+        return boost::make_shared<ShapeletMatrixBuilder>(inputs.getX(), inputs.getY(), order);
+    }
+    BoxEntry & entry = getEntry(dimensions);
+    PTR(ShapeletMatrixBuilder) & builder = entry.builders[order];
+    if (!builder) {
+        builder.reset(new ShapeletMatrixBuilder(entry.x, entry.y, order));
+    }
+    // The cached coordinates are relative to the first pixel rather than the center,
+    // so we move the ellipse instead.
+    ellipse.setCenter(ellipse.getCenter() + afw::geom::Extent2D(inputs.getBoxCenter()));
+    return builder;
+}
+
+void BoxGridCache::fillMatrix(
+    ModelInputHandler const & inputs,
+    int order,
+    afw::geom::ellipses::Ellipse const & ellipse,
+    ndarray::Array<double,2,-1> const & matrix,
+    int begin
+) {
+    afw::geom::ellipses::Ellipse shifted(ellipse);
+    PTR(ShapeletMatrixBuilder) builder = getBuilder(inputs, order, shifted);
+    (*builder)(matrix, shifted, inputs.getWeights(), begin);
+}
+
+void BoxGridCache::addModel(
+    ModelInputHandler const & inputs,
+    int order,
+    afw::geom::ellipses::Ellipse const & ellipse,
+    ndarray::Array<double const,1,1> const & coefficients,
+    ndarray::Array<double,1,1> const & output
+) {
+    afw::geom::ellipses::Ellipse shifted(ellipse);
+    PTR(ShapeletMatrixBuilder) builder = getBuilder(inputs, order, shifted);
+    builder->addModel(output, shifted, coefficients, inputs.getWeights());
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
@@ -0,0 +1,52 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include "lsst/meas/extensions/multiShapelet/BuiltinProfiles.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+char const * const TractorExponentialProfile::NAME = "tractor-exponential";
+
+double const TractorExponentialProfile::FLUX[TractorExponentialProfile::SIZE] = {
+    2.7808096208623658e-06, 8.9283464622427614e-05, 0.0011174052092275237, 0.0089064866439039839,
+    0.051142881091462533, 0.20426162891924249, 0.44822886778580806, 0.28625066607611221
+};
+
+double const TractorExponentialProfile::RADIUS[TractorExponentialProfile::SIZE] = {
+    0.0070107716337076617, 0.02812975337609628, 0.071197602066361762, 0.1516635087949636,
+    0.29163741718099206, 0.52287559227793368, 0.89088446781835862, 1.4733146405299853
+};
+
+char const * const TractorDeVaucouleurProfile::NAME = "tractor-devaucouleur";
+
+double const TractorDeVaucouleurProfile::FLUX[TractorDeVaucouleurProfile::SIZE] = {
+    0.00066713382413452992, 0.0053294990155887236, 0.018022926968999015, 0.045353883599547361,
+    0.097889311825534953, 0.1847071754006718, 0.2941800821999957, 0.35384998716552807
+};
+
+double const TractorDeVaucouleurProfile::RADIUS[TractorDeVaucouleurProfile::SIZE] = {
+    0.011604070148012721, 0.022452811561138618, 0.043418724301849315, 0.084878722539868612,
+    0.16969373176402244, 0.35372150627294352, 0.79889616722074719, 2.1827455486153213
+};
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
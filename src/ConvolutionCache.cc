@@ -0,0 +1,176 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "boost/noncopyable.hpp"
+#include "boost/thread/tss.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/make_shared.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+typedef shapelet::MultiShapeletFunction MSF;
+
+struct Key {
+
+    Key(FitProfileModel const & model, FitPsfModel const & psfModel) : profile(model.profile) {
+        values.reserve(7 + psfModel.inner.getSize<0>() + psfModel.outer.getSize<0>());
+        values.push_back(model.ellipse.getIxx());
+        values.push_back(model.ellipse.getIyy());
+        values.push_back(model.ellipse.getIxy());
+        values.push_back(psfModel.ellipse.getIxx());
+        values.push_back(psfModel.ellipse.getIyy());
+        values.push_back(psfModel.ellipse.getIxy());
+        values.push_back(psfModel.radiusRatio);
+        // the inner size makes the split between inner and outer coefficients unambiguous
+        values.push_back(psfModel.inner.getSize<0>());
+        values.insert(values.end(), psfModel.inner.begin(), psfModel.inner.end());
+        values.insert(values.end(), psfModel.outer.begin(), psfModel.outer.end());
+    }
+
+    bool operator<(Key const & other) const {
+        if (profile != other.profile) return profile < other.profile;
+        return values < other.values;
+    }
+
+    std::string profile;
+    std::vector<double> values;
+};
+
+struct Cache;
+
+// Registry of the live per-thread caches, so their counts can be summed on request; counts from
+// threads that have exited are folded into retiredHits and retiredMisses.
+boost::mutex registryMutex;
+std::set<Cache*> registry;
+long retiredHits = 0;
+long retiredMisses = 0;
+
+struct Cache : private boost::noncopyable {
+    typedef std::map< Key, CONST_PTR(MSF) > Map;
+
+    Cache() : hits(0), misses(0) {
+        boost::mutex::scoped_lock lock(registryMutex);
+        registry.insert(this);
+    }
+
+    ~Cache() {
+        boost::mutex::scoped_lock lock(registryMutex);
+        registry.erase(this);
+        retiredHits += hits;
+        retiredMisses += misses;
+    }
+
+    Map map;
+    std::deque<Map::iterator> order; // insertion order, for first-in-first-out eviction
+
+    // Only the owning thread increments these, so the mutex is uncontended except while the
+    // counts are being read or reset.
+    boost::mutex countMutex;
+    long hits;
+    long misses;
+};
+
+boost::thread_specific_ptr<Cache> threadCache;
+
+Cache & getCache() {
+    if (!threadCache.get()) {
+        threadCache.reset(new Cache());
+    }
+    return *threadCache;
+}
+
+} // anonymous
+
+CONST_PTR(shapelet::MultiShapeletFunction) ConvolutionCache::get(
+    FitProfileModel const & model,
+    FitPsfModel const & psfModel
+) {
+    Cache & cache = getCache();
+    Key key(model, psfModel);
+    Cache::Map::iterator i = cache.map.find(key);
+    if (i != cache.map.end()) {
+        boost::mutex::scoped_lock lock(cache.countMutex);
+        ++cache.hits;
+        return i->second;
+    }
+    PTR(MSF) result = boost::make_shared<MSF>(
+        model.asMultiShapelet().convolve(psfModel.asMultiShapelet())
+    );
+    result->normalize();
+    if (cache.order.size() >= std::size_t(MAX_SIZE)) {
+        cache.map.erase(cache.order.front());
+        cache.order.pop_front();
+    }
+    cache.order.push_back(cache.map.insert(std::make_pair(key, result)).first);
+    boost::mutex::scoped_lock lock(cache.countMutex);
+    ++cache.misses;
+    return result;
+}
+
+long ConvolutionCache::getHitCount() {
+    boost::mutex::scoped_lock lock(registryMutex);
+    long result = retiredHits;
+    for (std::set<Cache*>::const_iterator i = registry.begin(); i != registry.end(); ++i) {
+        boost::mutex::scoped_lock countLock((**i).countMutex);
+        result += (**i).hits;
+    }
+    return result;
+}
+
+long ConvolutionCache::getMissCount() {
+    boost::mutex::scoped_lock lock(registryMutex);
+    long result = retiredMisses;
+    for (std::set<Cache*>::const_iterator i = registry.begin(); i != registry.end(); ++i) {
+        boost::mutex::scoped_lock countLock((**i).countMutex);
+        result += (**i).misses;
+    }
+    return result;
+}
+
+void ConvolutionCache::resetCounts() {
+    boost::mutex::scoped_lock lock(registryMutex);
+    retiredHits = 0;
+    retiredMisses = 0;
+    for (std::set<Cache*>::const_iterator i = registry.begin(); i != registry.end(); ++i) {
+        boost::mutex::scoped_lock countLock((**i).countMutex);
+        (**i).hits = 0;
+        (**i).misses = 0;
+    }
+}
+
+void ConvolutionCache::clear() {
+    Cache & cache = getCache();
+    cache.order.clear();
+    cache.map.clear();
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
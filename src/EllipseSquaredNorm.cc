@@ -30,12 +30,18 @@ afw::geom::ellipses::BaseCore::Jacobian EllipseSquaredNorm::update(
     bool computeJacobian
 ) {
     afw::geom::ellipses::Quadrupole q;
-    afw::geom::ellipses::BaseCore::Jacobian dQdE = afw::geom::ellipses::BaseCore::Jacobian::Zero();
     if (computeJacobian) {
-        dQdE = q.dAssign(ellipse);
-    } else {
-        q = ellipse;
+        afw::geom::ellipses::BaseCore::Jacobian dQdE = q.dAssign(ellipse);
+        return update(q, true) * dQdE;
     }
+    q = ellipse;
+    return update(q, false);
+}
+
+afw::geom::ellipses::BaseCore::Jacobian EllipseSquaredNorm::update(
+    afw::geom::ellipses::Quadrupole const & q,
+    bool computeJacobian
+) {
     // extract moments into variables just for readability
     double qxx = q.getIxx();
     double qxy = q.getIxy();
@@ -51,17 +57,14 @@ afw::geom::ellipses::BaseCore::Jacobian EllipseSquaredNorm::update(
     afw::geom::ellipses::BaseCore::Jacobian result;
     if (computeJacobian) {
         double s = l11 * l22; s *= s; // == det(Q)
-        afw::geom::ellipses::BaseCore::Jacobian dRdQ;
-        dRdQ << 
+        result << 
                           -0.5*_r11/qxx,             0.0,           0.0,
             -0.5*_r12*(1.0/qxx + qyy/s),  0.5*_r22*qxy/s,   -_r22*qyy/s,
                          0.5*_r12*qxy/s, -0.5*_r22*qxx/s,    _r22*qxy/s;
-        result = dRdQ * dQdE;
     } else {
         result.setConstant(std::numeric_limits<double>::quiet_NaN());
     }
     return result;
 }
 
-
 }}}} // namespace lsst::meas::extensions::multiShapelet
@@ -21,16 +21,45 @@
  * see <http://www.lsstcorp.org/LegalNotices/>.
  */
 
+#include <algorithm>
+
+#include "Eigen/Cholesky"
+#include "boost/bind.hpp"
+#include "boost/scoped_ptr.hpp"
+
 #include "lsst/utils/ieee.h"
 #include "lsst/meas/extensions/multiShapelet/FitCombo.h"
-#include "lsst/shapelet/MatrixBuilder.h"
-#include "lsst/afw/math/LeastSquares.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+#include "lsst/meas/extensions/multiShapelet/BoxGridCache.h"
+#include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
 #include "lsst/afw/detection/FootprintArray.h"
 #include "lsst/afw/detection/FootprintArray.cc"
 
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
+namespace {
+
+// One shapelet term of a PSF-convolved component, ready to be evaluated on a block of pixels.
+struct Term {
+
+    Term(ModelInputHandler const & inputs, int component_, shapelet::ShapeletFunction const & function) :
+        component(component_),
+        ellipse(function.getEllipse()),
+        coefficients(function.getCoefficients()),
+        builder(BoxGridCache::getBuilder(inputs, function.getOrder(), ellipse)),
+        workspace(boost::make_shared<ShapeletMatrixBuilder::Workspace>(ellipse, function.getOrder()))
+    {}
+
+    int component;
+    afw::geom::ellipses::Ellipse ellipse; // in the builder's coordinate system
+    ndarray::Array<double const,1,1> coefficients;
+    PTR(ShapeletMatrixBuilder) builder;
+    PTR(ShapeletMatrixBuilder::Workspace) workspace; // reused for every block of pixels
+};
+
+} // anonymous
+
 //------------ FitComboControl ----------------------------------------------------------------------------
 
 PTR(algorithms::AlgorithmControl) FitComboControl::_clone() const {
@@ -42,7 +71,7 @@ PTR(algorithms::Algorithm) FitComboControl::_makeAlgorithm(
     PTR(daf::base::PropertyList) const & metadata,
     algorithms::AlgorithmMap const & others
 ) const {
-    return boost::make_shared<FitComboAlgorithm>(*this, boost::ref(schema), others);
+    return boost::make_shared<FitComboAlgorithm>(*this, boost::ref(schema), others, metadata);
 }
 
 //------------ FitComboModel ------------------------------------------------------------------------------
@@ -50,12 +79,12 @@ PTR(algorithms::Algorithm) FitComboControl::_makeAlgorithm(
 FitComboModel::FitComboModel(FitComboControl const & ctrl) :
     components(ndarray::allocate(ctrl.componentNames.size())),
     flux(std::numeric_limits<double>::quiet_NaN()), fluxErr(std::numeric_limits<double>::quiet_NaN()),
-    chisq(std::numeric_limits<double>::quiet_NaN())
+    chisq(std::numeric_limits<double>::quiet_NaN()), psfTruncationError(0.0)
 {}
 
 FitComboModel::FitComboModel(FitComboModel const & other) :
     components(ndarray::copy(other.components)), flux(other.flux), fluxErr(other.fluxErr),
-    chisq(other.chisq)
+    chisq(other.chisq), psfTruncationError(other.psfTruncationError)
 {}
 
 FitComboModel & FitComboModel::operator=(FitComboModel const & other) {
@@ -64,6 +93,7 @@ FitComboModel & FitComboModel::operator=(FitComboModel const & other) {
         flux = other.flux;
         fluxErr = other.fluxErr;
         chisq = other.chisq;
+        psfTruncationError = other.psfTruncationError;
     }
     return *this;
 }
@@ -73,7 +103,8 @@ FitComboModel & FitComboModel::operator=(FitComboModel const & other) {
 FitComboAlgorithm::FitComboAlgorithm(
     FitComboControl const & ctrl,
     afw::table::Schema & schema,
-    algorithms::AlgorithmMap const & others
+    algorithms::AlgorithmMap const & others,
+    PTR(daf::base::PropertyList) const & metadata
 ) :
     algorithms::Algorithm(ctrl),
     _fluxKeys(
@@ -132,6 +163,17 @@ FitComboAlgorithm::FitComboAlgorithm(
             );
         }
     }
+    if (ctrl.psfShapeletOrder >= 0 || ctrl.psfShapeletTolerance > 0.0) {
+        _psfTruncationKey = schema.addField<float>(
+            ctrl.name + ".psftruncation",
+            "estimated relative flux error from PSF shapelet terms neglected in the linear fit"
+        );
+    }
+#if MULTISHAPELET_ENABLE_TIMERS
+    if (metadata) {
+        _stageTimes = boost::make_shared<StageTimes>(ctrl.name, metadata);
+    }
+#endif
 }
 
 template <typename PixelT>
@@ -160,72 +202,157 @@ ModelInputHandler FitComboAlgorithm::adjustInputs(
     }
 }
 
+ndarray::Array<double,1,1> FitComboAlgorithm::solveNonNegative(
+    ndarray::Array<double const,2,2> const & fisher,
+    ndarray::Array<double const,1,1> const & rhs
+) {
+    // Lawson and Hanson's active-set algorithm, written in terms of the normal equations.
+    int const size = rhs.getSize<0>();
+    if (fisher.getSize<0>() != size || fisher.getSize<1>() != size) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Normal matrix has shape (%d, %d); expected (%d, %d)")
+             % fisher.getSize<0>() % fisher.getSize<1>() % size % size).str()
+        );
+    }
+    Eigen::MatrixXd const f = fisher.asEigen();
+    Eigen::VectorXd const b = rhs.asEigen();
+    double const tolerance = 1E-12 * std::max(f.diagonal().maxCoeff(), 0.0);
+    Eigen::VectorXd x = Eigen::VectorXd::Zero(size);
+    std::vector<bool> passive(size, false);
+    for (int outer = 0; outer < 3 * size; ++outer) {
+        Eigen::VectorXd gradient = b - f * x;
+        int best = -1;
+        for (int k = 0; k < size; ++k) {
+            if (!passive[k] && gradient[k] > tolerance && (best < 0 || gradient[k] > gradient[best])) {
+                best = k;
+            }
+        }
+        if (best < 0) break;
+        passive[best] = true;
+        while (true) {
+            std::vector<int> indices;
+            for (int k = 0; k < size; ++k) {
+                if (passive[k]) indices.push_back(k);
+            }
+            int const n = indices.size();
+            Eigen::MatrixXd fp(n, n);
+            Eigen::VectorXd bp(n);
+            for (int i = 0; i < n; ++i) {
+                bp[i] = b[indices[i]];
+                for (int j = 0; j < n; ++j) {
+                    fp(i, j) = f(indices[i], indices[j]);
+                }
+            }
+            Eigen::VectorXd zp = fp.ldlt().solve(bp);
+            if ((zp.array() > 0.0).all()) {
+                x.setZero();
+                for (int i = 0; i < n; ++i) x[indices[i]] = zp[i];
+                break;
+            }
+            // Move toward the unconstrained solution until the first variable hits zero,
+            // then drop every variable that is at zero from the passive set.
+            double alpha = 1.0;
+            for (int i = 0; i < n; ++i) {
+                if (zp[i] <= 0.0) {
+                    double const step = x[indices[i]] - zp[i];
+                    alpha = std::min(alpha, (step > 0.0) ? x[indices[i]] / step : 0.0);
+                }
+            }
+            for (int i = 0; i < n; ++i) {
+                x[indices[i]] += alpha * (zp[i] - x[indices[i]]);
+                if (x[indices[i]] <= 0.0) {
+                    x[indices[i]] = 0.0;
+                    passive[indices[i]] = false;
+                }
+            }
+            if (std::find(passive.begin(), passive.end(), true) == passive.end()) break;
+        }
+    }
+    ndarray::Array<double,1,1> result = ndarray::allocate(size);
+    result.asEigen() = x;
+    return result;
+}
+
 FitComboModel FitComboAlgorithm::apply(
     FitComboControl const & ctrl,
     FitPsfModel const & psfModel,
     std::vector<FitProfileModel> const & components,
     ModelInputHandler const & inputs
 ) {
-    if (components.size() != 2u) {
+    MULTISHAPELET_TIMER(timer, SHAPELET_TERMS);
+    typedef shapelet::MultiShapeletFunction MSF;
+    int const nComponents = components.size();
+    if (nComponents == 0 || nComponents != int(ctrl.componentNames.size())) {
         throw LSST_EXCEPT(
-            pex::exceptions::LogicError, "Only 2-component combo model is current implemented"
+            pex::exceptions::LengthError,
+            (boost::format("Got %d component models for %d component names")
+             % nComponents % ctrl.componentNames.size()).str()
         );
     }
     FitComboModel model(ctrl);
-    typedef shapelet::MultiShapeletFunction MSF;
-    ndarray::Array<double,2,2> matrixT = ndarray::allocate(components.size(), inputs.getSize());
-    ndarray::Array<double,2,-2> matrix(matrixT.transpose());
-    matrixT.deep() = 0.0;
-    for (int n = 0; n < matrixT.getSize<0>(); ++n) {
-        MSF msf = components[n].asMultiShapelet(afw::geom::Point2D())
-            .convolve(psfModel.asMultiShapelet());
-        msf.normalize();
+    int const psfOrder = psfModel.selectTruncationOrder(
+        ctrl.psfShapeletOrder, ctrl.psfShapeletTolerance, model.psfTruncationError
+    );
+    boost::scoped_ptr<FitPsfModel> truncatedPsfModel;
+    if (psfOrder < psfModel.getOrder()) {
+        truncatedPsfModel.reset(new FitPsfModel(psfModel.truncate(psfOrder)));
+    }
+    FitPsfModel const & linearPsfModel = truncatedPsfModel ? *truncatedPsfModel : psfModel;
+    // Gather every shapelet term of every PSF-convolved component, so the template for each
+    // component can be built in a single pass over the pixels.
+    std::vector<Term> terms;
+    for (int n = 0; n < nComponents; ++n) {
+        CONST_PTR(MSF) msf = ConvolutionCache::get(components[n], linearPsfModel);
         for (
-            MSF::ComponentList::const_iterator i = msf.getComponents().begin();
-            i != msf.getComponents().end();
+            MSF::ComponentList::const_iterator i = msf->getComponents().begin();
+            i != msf->getComponents().end();
             ++i
         ) {
-            shapelet::MatrixBuilder<double> builder(inputs.getX(), inputs.getY(), i->getOrder());
-            ndarray::Array<double,2,-2> m = builder(i->getEllipse());
-            matrixT[n].asEigen() = m.asEigen() * i->getCoefficients().asEigen();
+            terms.push_back(Term(inputs, n, *i));
         }
-        if (!inputs.getWeights().isEmpty()) {
-            matrixT[n].asEigen<Eigen::ArrayXpr>() *= inputs.getWeights().asEigen<Eigen::ArrayXpr>();
+    }
+    int const size = inputs.getSize();
+    ndarray::Array<double,2,2> matrixT = ndarray::allocate(nComponents, size);
+    ndarray::Array<double,2,-2> matrix(matrixT.transpose());
+    matrixT.deep() = 0.0;
+    for (int begin = 0; begin < size; begin += ShapeletMatrixBuilder::BLOCK_SIZE) {
+        int const end = std::min(begin + int(ShapeletMatrixBuilder::BLOCK_SIZE), size);
+        for (std::vector<Term>::const_iterator t = terms.begin(); t != terms.end(); ++t) {
+            t->builder->addModel(
+                matrixT[t->component][ndarray::view(begin, end)], *t->workspace, t->coefficients,
+                inputs.getWeights(), begin
+            );
         }
     }
-    // We should really do constrained linear least squares to get the errors right, but this
-    // produces the same result for the fluxes, and we don't have a constrained solver handy.
-    afw::math::LeastSquares lstsq = afw::math::LeastSquares::fromDesignMatrix(matrix, inputs.getData());
-    if (lstsq.getSolution()[0] < 0.0) {
-        if (lstsq.getSolution()[1] < 0.0) {
-            throw LSST_EXCEPT(pex::exceptions::RuntimeError, "measured negative flux");
+    ndarray::Array<double,2,2> fisher = ndarray::allocate(nComponents, nComponents);
+    ndarray::Array<double,1,1> rhs = ndarray::allocate(nComponents);
+    fisher.asEigen() = matrix.asEigen().transpose() * matrix.asEigen();
+    rhs.asEigen() = matrix.asEigen().transpose() * inputs.getData().asEigen();
+    ndarray::Array<double,1,1> solution = solveNonNegative(fisher, rhs);
+    model.flux = solution.asEigen().sum();
+    if (!(model.flux > 0.0)) {
+        throw LSST_EXCEPT(pex::exceptions::RuntimeError, "measured negative flux");
+    }
+    for (int n = 0; n < nComponents; ++n) {
+        model.components[n] = solution[n] / model.flux;
+    }
+    // The flux is the sum of the component amplitudes, so its variance is the sum of all elements
+    // of the covariance matrix restricted to the components that aren't held at zero.
+    std::vector<int> active;
+    for (int n = 0; n < nComponents; ++n) {
+        if (solution[n] > 0.0) active.push_back(n);
+    }
+    Eigen::MatrixXd activeFisher(active.size(), active.size());
+    for (std::size_t i = 0; i < active.size(); ++i) {
+        for (std::size_t j = 0; j < active.size(); ++j) {
+            activeFisher(i, j) = fisher[active[i]][active[j]];
         }
-        model.components[0] = 0.0;
-        model.components[1] = 1.0;
-        model.flux = components[1].flux;
-        model.fluxErr = components[1].fluxErr;
-    } else if (lstsq.getSolution()[1] < 0.0) {
-        model.components[0] = 1.0;
-        model.components[1] = 0.0;
-        model.flux = components[0].flux;
-        model.fluxErr = components[0].fluxErr;
-    } else {
-        model.flux = lstsq.getSolution().asEigen().sum();
-        model.components.deep() = lstsq.getSolution();
-        model.components.asEigen() /= model.flux;
-#if 0 // don't know why this doesn't work; numbers are way too big
-        model.fluxErr = std::sqrt(
-            lstsq.getSolution().asEigen().dot(
-                lstsq.getCovariance().asEigen() * lstsq.getSolution().asEigen()
-            )
-        );
-#else // this is incorrect, but a good-enough workaround for now: weighted average in quadrature
-        model.fluxErr = std::sqrt(components[0].fluxErr * components[0].fluxErr * model.components[0]
-                                  + components[1].fluxErr * components[1].fluxErr * model.components[1]);
-#endif
     }
+    Eigen::VectorXd ones = Eigen::VectorXd::Ones(active.size());
+    model.fluxErr = std::sqrt(ones.dot(activeFisher.ldlt().solve(ones)));
     model.chisq =
-        (matrix.asEigen() * lstsq.getSolution().asEigen() - inputs.getData().asEigen()).squaredNorm()
+        (matrix.asEigen() * solution.asEigen() - inputs.getData().asEigen()).squaredNorm()
         / (matrix.getSize<0>() - matrix.getSize<1>());
     return model;
 }
@@ -236,6 +363,7 @@ void FitComboAlgorithm::_apply(
     afw::image::Exposure<PixelT> const & exposure,
     afw::geom::Point2D const & center
 ) const {
+    MULTISHAPELET_APPLY_TIMER(_stageTimes.get());
     source.set(_fluxKeys.flag, true);
     if (!exposure.hasPsf()) {
         throw LSST_EXCEPT(
@@ -252,8 +380,10 @@ void FitComboAlgorithm::_apply(
         }
         assert(lsst::utils::isfinite(components.back().ellipse.getArea()));
     }
+    MULTISHAPELET_TIMER(inputsTimer, INPUTS);
     ModelInputHandler inputs = adjustInputs(
         getControl(), psfModel, components, *source.getFootprint(), exposure.getMaskedImage(), center);
+    MULTISHAPELET_TIMER_STOP(inputsTimer);
     FitComboModel model = apply(getControl(), psfModel, components, inputs);
 
     source.set(_componentsKey, model.components);
@@ -261,10 +391,22 @@ void FitComboAlgorithm::_apply(
     source.set(_fluxKeys.err, model.fluxErr);
     source.set(_fluxKeys.flag, false);
     source.set(_chisqKey, model.chisq);
+    if (_psfTruncationKey.isValid()) {
+        source.set(_psfTruncationKey, model.psfTruncationError);
+    }
 
     source.set(_fluxCorrectionKeys.psfFactorFlag, true);
-    PTR(afw::image::Image<afw::math::Kernel::Pixel>) psfImage = exposure.getPsf()->computeImage(center);
-    ModelInputHandler psfInputs(*psfImage, center, psfImage->getBBox());
+    if (getControl().psfFactorGrid) {
+        source.set(
+            _fluxCorrectionKeys.psfFactor,
+            _interpolatePsfFactor(
+                exposure.getPsf(), afw::geom::Box2D(exposure.getMaskedImage().getBBox(afw::image::PARENT)),
+                center
+            )
+        );
+        source.set(_fluxCorrectionKeys.psfFactorFlag, false);
+        return;
+    }
     std::vector<FitProfileModel> psfComponents;
     for (std::size_t n = 0; n < _componentCtrl.size(); ++n) {
         psfComponents.push_back(FitProfileModel(*_componentCtrl[n], source, true));
@@ -273,12 +415,76 @@ void FitComboAlgorithm::_apply(
         }
         assert(lsst::utils::isfinite(psfComponents.back().ellipse.getArea()));
     }
-    FitComboModel psfProfileModel = apply(getControl(), psfModel, psfComponents, psfInputs);
+    FitComboModel psfProfileModel = computePsfFactor(
+        getControl(), psfModel, psfComponents, *exposure.getPsf(), center
+    );
     source.set(_fluxCorrectionKeys.psfFactor, psfProfileModel.flux);
     source.set(_fluxCorrectionKeys.psfFactorFlag, false);
     
 }
 
+FitComboModel FitComboAlgorithm::computePsfFactor(
+    FitComboControl const & ctrl,
+    FitPsfModel const & psfModel,
+    std::vector<FitProfileModel> const & psfComponents,
+    afw::detection::Psf const & psf,
+    afw::geom::Point2D const & center
+) {
+    MULTISHAPELET_TIMER(renderTimer, PSF_FACTOR_RENDER);
+    PTR(afw::image::Image<afw::math::Kernel::Pixel>) psfImage = psf.computeImage(center);
+    MULTISHAPELET_TIMER_STOP(renderTimer);
+    MULTISHAPELET_TIMER(fitTimer, PSF_FACTOR_FIT);
+    ModelInputHandler psfInputs(*psfImage, center, psfImage->getBBox());
+    return apply(ctrl, psfModel, psfComponents, psfInputs);
+}
+
+double FitComboAlgorithm::_interpolatePsfFactor(
+    CONST_PTR(afw::detection::Psf) const & psf,
+    afw::geom::Box2D const & bbox,
+    afw::geom::Point2D const & center
+) const {
+    // Building the grid runs computePsfFactor at each grid point, which times its own stages,
+    // so we only start timing the interpolation once we have the grid.
+    CONST_PTR(SpatialInterpolator) grid = _psfFactorGrid.get(
+        psf, bbox, boost::bind(&FitComboAlgorithm::_makePsfFactorGrid, this, psf, bbox)
+    );
+    MULTISHAPELET_TIMER(timer, PSF_FACTOR_FIT);
+    return grid->evaluate(center)[0];
+}
+
+CONST_PTR(SpatialInterpolator) FitComboAlgorithm::_makePsfFactorGrid(
+    CONST_PTR(afw::detection::Psf) const & psf,
+    afw::geom::Box2D const & bbox
+) const {
+    FitComboControl const & ctrl = getControl();
+    std::vector<afw::geom::Point2D> gridPoints
+        = SpatialInterpolator::makeGrid(bbox, ctrl.psfFactorGridNx, ctrl.psfFactorGridNy);
+    std::vector<afw::geom::Point2D> goodPoints;
+    std::vector<double> goodValues;
+    for (std::size_t n = 0; n < gridPoints.size(); ++n) {
+        try {
+            FitPsfModel psfModel = FitPsfAlgorithm::apply(*_psfCtrl, *psf, gridPoints[n]);
+            if (psfModel.hasFailed()) continue;
+            std::vector<FitProfileModel> psfComponents;
+            for (std::size_t k = 0; k < _componentCtrl.size(); ++k) {
+                psfComponents.push_back(
+                    FitProfileAlgorithm::computePsfFactor(*_componentCtrl[k], psfModel, *psf, gridPoints[n])
+                );
+                if (psfComponents.back().fluxFlag) break;
+            }
+            if (psfComponents.empty() || psfComponents.back().fluxFlag) continue;
+            FitComboModel psfComboModel = computePsfFactor(
+                ctrl, psfModel, psfComponents, *psf, gridPoints[n]
+            );
+            goodPoints.push_back(gridPoints[n]);
+            goodValues.push_back(psfComboModel.flux);
+        } catch (pex::exceptions::Exception &) {}
+    }
+    ndarray::Array<double,2,2> values = ndarray::allocate(goodPoints.size(), 1);
+    std::copy(goodValues.begin(), goodValues.end(), values.getData());
+    return boost::make_shared<SpatialInterpolator>(bbox, ctrl.psfFactorGridOrder, goodPoints, values);
+}
+
 
 LSST_MEAS_ALGORITHM_PRIVATE_IMPLEMENTATION(FitComboAlgorithm);
 
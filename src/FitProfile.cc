@@ -21,17 +21,36 @@
  * see <http://www.lsstcorp.org/LegalNotices/>.
  */
 
+#include <algorithm>
+
+#include "boost/bind.hpp"
+
 #include "lsst/utils/ieee.h"
 #include "lsst/meas/extensions/multiShapelet/FitProfile.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianRegistry.h"
-#include "lsst/shapelet/MatrixBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+#include "lsst/meas/extensions/multiShapelet/PsfModelObjective.h"
+#include "lsst/meas/extensions/multiShapelet/BoxGridCache.h"
+#include "lsst/meas/extensions/multiShapelet/ConvolutionCache.h"
 #include "lsst/afw/math/LeastSquares.h"
 #include "lsst/afw/detection/FootprintArray.h"
 #include "lsst/afw/detection/FootprintArray.cc"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
+namespace {
+
+HybridOptimizerControl makeOptimizerControl() {
+    HybridOptimizerControl optCtrl; // TODO: nest this in FitProfileControl
+    optCtrl.tau = 1E-2;
+    optCtrl.useCholesky = true;
+    optCtrl.gTol = 1E-4;
+    return optCtrl;
+}
+
+} // anonymous
+
 //------------ FitProfileControl ----------------------------------------------------------------------------
 
 PTR(algorithms::AlgorithmControl) FitProfileControl::_clone() const {
@@ -43,7 +62,7 @@ PTR(algorithms::Algorithm) FitProfileControl::_makeAlgorithm(
     PTR(daf::base::PropertyList) const & metadata,
     algorithms::AlgorithmMap const & others
 ) const {
-    return boost::make_shared<FitProfileAlgorithm>(*this, boost::ref(schema), others);
+    return boost::make_shared<FitProfileAlgorithm>(*this, boost::ref(schema), others, metadata);
 }
 
 //------------ FitProfileModel ------------------------------------------------------------------------------
@@ -55,7 +74,8 @@ FitProfileModel::FitProfileModel(
 ) :
     profile(ctrl.profile), flux(amplitude), fluxErr(0.0),
     ellipse(MultiGaussianObjective::EllipseCore(parameters[0], parameters[1], parameters[2])),
-    chisq(std::numeric_limits<double>::quiet_NaN()), fluxFlag(false),
+    chisq(std::numeric_limits<double>::quiet_NaN()), psfTruncationError(0.0),
+    builderCount(0), evaluationCount(0), fluxFlag(false),
     flagMaxIter(false), flagTinyStep(false), flagMinRadius(false), flagMinAxisRatio(false),
     flagLargeArea(false)
 {}
@@ -65,7 +85,8 @@ FitProfileModel::FitProfileModel(
     bool loadPsfFactorModel
 ) :
     profile(ctrl.profile), flux(1.0), fluxErr(0.0), ellipse(),
-    chisq(std::numeric_limits<double>::quiet_NaN()), fluxFlag(false),
+    chisq(std::numeric_limits<double>::quiet_NaN()), psfTruncationError(0.0),
+    builderCount(0), evaluationCount(0), fluxFlag(false),
     flagMaxIter(false), flagTinyStep(false), flagMinRadius(false), flagMinAxisRatio(false),
     flagLargeArea(false)
 {
@@ -90,6 +111,9 @@ FitProfileModel::FitProfileModel(
 FitProfileModel::FitProfileModel(FitProfileModel const & other) :
     profile(other.profile), flux(other.flux), fluxErr(other.fluxErr), ellipse(other.ellipse),
     chisq(other.chisq),
+    psfTruncationError(other.psfTruncationError),
+    builderCount(other.builderCount),
+    evaluationCount(other.evaluationCount),
     fluxFlag(other.fluxFlag),
     flagMaxIter(other.flagMaxIter),
     flagTinyStep(other.flagTinyStep),
@@ -110,6 +134,9 @@ FitProfileModel & FitProfileModel::operator=(FitProfileModel const & other) {
         flagTinyStep = other.flagTinyStep;
         flagMinRadius = other.flagMinRadius;
         flagMinAxisRatio = other.flagMinAxisRatio;
+        psfTruncationError = other.psfTruncationError;
+        builderCount = other.builderCount;
+        evaluationCount = other.evaluationCount;
         flagLargeArea = other.flagLargeArea;
     }
     return *this;
@@ -133,7 +160,8 @@ shapelet::MultiShapeletFunction FitProfileModel::asMultiShapelet(
 FitProfileAlgorithm::FitProfileAlgorithm(
     FitProfileControl const & ctrl,
     afw::table::Schema & schema,
-    algorithms::AlgorithmMap const & others
+    algorithms::AlgorithmMap const & others,
+    PTR(daf::base::PropertyList) const & metadata
 ) :
     algorithms::Algorithm(ctrl),
     _fluxKeys(
@@ -200,6 +228,27 @@ FitProfileAlgorithm::FitProfileAlgorithm(
             (boost::format("Algorithm with name '%s' is not FitPsf.") % ctrl.psfName).str()
         );
     }
+    if (ctrl.psfShapeletOrder >= 0 || ctrl.psfShapeletTolerance > 0.0) {
+        _psfTruncationKey = schema.addField<float>(
+            ctrl.name + ".psftruncation",
+            "estimated relative flux error from PSF shapelet terms neglected in the linear fit"
+        );
+    }
+    if (ctrl.componentTolerance > 0.0 || ctrl.maxComponents > 0) {
+        _builderCountKey = schema.addField<int>(
+            ctrl.name + ".builders",
+            "number of convolved components left in the nonlinear fit's model after pruning"
+        );
+        _evaluationCountKey = schema.addField<int>(
+            ctrl.name + ".evaluations",
+            "total number of per-pixel component evaluations in the nonlinear fit"
+        );
+    }
+#if MULTISHAPELET_ENABLE_TIMERS
+    if (metadata) {
+        _stageTimes = boost::make_shared<StageTimes>(ctrl.name, metadata);
+    }
+#endif
 }
 
 PTR(MultiGaussianObjective) FitProfileAlgorithm::makeObjective(
@@ -209,7 +258,7 @@ PTR(MultiGaussianObjective) FitProfileAlgorithm::makeObjective(
 ) {
     return boost::make_shared<MultiGaussianObjective>(
         inputs, ctrl.getMultiGaussian(), psfModel.getMultiGaussian(), psfModel.ellipse,
-        ctrl.minRadius, ctrl.minAxisRatio
+        ctrl.minRadius, ctrl.minAxisRatio, ctrl.componentTolerance, ctrl.maxComponents
     );
 }
 
@@ -222,11 +271,7 @@ HybridOptimizer FitProfileAlgorithm::makeOptimizer(
     PTR(Objective) obj = makeObjective(ctrl, psfModel, inputs);
     ndarray::Array<double,1,1> initial = ndarray::allocate(obj->getParameterSize());
     ellipse.writeParameters(initial.getData());
-    HybridOptimizerControl optCtrl; // TODO: nest this in FitProfileControl
-    optCtrl.tau = 1E-2;
-    optCtrl.useCholesky = true;
-    optCtrl.gTol = 1E-4;
-    return HybridOptimizer(obj, initial, optCtrl);
+    return HybridOptimizer(obj, initial, makeOptimizerControl());
 }
 
 template <typename PixelT>
@@ -284,18 +329,22 @@ void FitProfileAlgorithm::fitShapeletTerms(
     ModelInputHandler const & inputs,
     FitProfileModel & model
 ) {
+    MULTISHAPELET_TIMER(timer, SHAPELET_TERMS);
     typedef shapelet::MultiShapeletFunction MSF; 
-    MSF msf = model.asMultiShapelet().convolve(psfModel.asMultiShapelet());
-    msf.normalize();
+    int const psfOrder = psfModel.selectTruncationOrder(
+        ctrl.psfShapeletOrder, ctrl.psfShapeletTolerance, model.psfTruncationError
+    );
+    CONST_PTR(MSF) msf = (psfOrder < psfModel.getOrder())
+        ? ConvolutionCache::get(model, psfModel.truncate(psfOrder))
+        : ConvolutionCache::get(model, psfModel);
     ndarray::Array<double,1,1> vector = ndarray::allocate(inputs.getSize());
     vector.deep() = 0.0;
-    for (MSF::ComponentList::const_iterator i = msf.getComponents().begin(); i != msf.getComponents().end(); ++i) {
-        shapelet::MatrixBuilder<double> builder(inputs.getX(), inputs.getY(), i->getOrder());
-        ndarray::Array<double,2,-2> matrix = builder(i->getEllipse());
-        vector.asEigen() = matrix.asEigen() * i->getCoefficients().asEigen();
-    }
-    if (!inputs.getWeights().isEmpty()) {
-        vector.asEigen<Eigen::ArrayXpr>() *= inputs.getWeights().asEigen<Eigen::ArrayXpr>();
+    for (
+        MSF::ComponentList::const_iterator i = msf->getComponents().begin();
+        i != msf->getComponents().end();
+        ++i
+    ) {
+        BoxGridCache::addModel(inputs, i->getOrder(), i->getEllipse(), i->getCoefficients(), vector);
     }
     // the following is just linear least squares with one free parameter
     double variance = 1.0 / vector.asEigen().squaredNorm();
@@ -305,19 +354,37 @@ void FitProfileAlgorithm::fitShapeletTerms(
         / (inputs.getSize() - 4);
 }
 
+double FitProfileAlgorithm::predictCost(
+    FitProfileControl const & ctrl,
+    FitPsfModel const & psfModel,
+    int pixelCount
+) {
+    int components = ctrl.getMultiGaussian().size() * psfModel.getMultiGaussian().size();
+    if (ctrl.maxComponents > 0) {
+        components = std::min(components, ctrl.maxComponents);
+    }
+    // the extra component accounts for the final linear fit with the full shapelet PSF
+    return double(pixelCount) * (components + 1);
+}
+
 FitProfileModel FitProfileAlgorithm::apply(
     FitProfileControl const & ctrl,
     FitPsfModel const & psfModel,
     MultiGaussianObjective::EllipseCore const & inEllipse,
     ModelInputHandler const & inputs
 ) {
+    MULTISHAPELET_TIMER(setupTimer, OPTIMIZER_SETUP);
     HybridOptimizer opt = makeOptimizer(ctrl, psfModel, inEllipse, inputs);
-    opt.run();
-    Model model(
-        ctrl, 
-        boost::static_pointer_cast<MultiGaussianObjective const>(opt.getObjective())->getAmplitude(),
-        opt.getParameters()
-    );
+    MULTISHAPELET_TIMER_STOP(setupTimer);
+    {
+        MULTISHAPELET_TIMER(runTimer, OPTIMIZER_RUN);
+        opt.run();
+    }
+    CONST_PTR(MultiGaussianObjective) obj
+        = boost::static_pointer_cast<MultiGaussianObjective const>(opt.getObjective());
+    Model model(ctrl, obj->getAmplitude(), opt.getParameters());
+    model.builderCount = obj->getBuilderCount();
+    model.evaluationCount = obj->getEvaluationCount();
     MultiGaussianObjective::EllipseCore ellipse = MultiGaussianObjective::readParameters(opt.getParameters());
     std::pair<bool,bool> constrained 
         = MultiGaussianObjective::constrainEllipse(ellipse, ctrl.minRadius, ctrl.minAxisRatio);
@@ -338,6 +405,7 @@ void FitProfileAlgorithm::_apply(
     afw::image::Exposure<PixelT> const & exposure,
     afw::geom::Point2D const & center
 ) const {
+    MULTISHAPELET_APPLY_TIMER(_stageTimes.get());
     source.set(_fluxKeys.flag, true);
     if (!exposure.hasPsf()) {
         throw LSST_EXCEPT(
@@ -356,9 +424,11 @@ void FitProfileAlgorithm::_apply(
     if (source.getShapeFlag()) {
         shape = psfModel.ellipse;
     }
+    MULTISHAPELET_TIMER(inputsTimer, INPUTS);
     ModelInputHandler inputs = adjustInputs(
         getControl(), psfModel, shape, *source.getFootprint(), exposure.getMaskedImage(), center
     );
+    MULTISHAPELET_TIMER_STOP(inputsTimer);
     FitProfileModel model = apply(getControl(), psfModel, shape, inputs);
 
     assert(model.fluxFlag || lsst::utils::isfinite(model.ellipse.getArea()));
@@ -373,19 +443,122 @@ void FitProfileAlgorithm::_apply(
     source.set(_flagMinRadiusKey, model.flagMinRadius);
     source.set(_flagMinAxisRatioKey, model.flagMinAxisRatio);
     source.set(_flagLargeAreaKey, model.flagLargeArea);
+    if (_psfTruncationKey.isValid()) {
+        source.set(_psfTruncationKey, model.psfTruncationError);
+    }
+    if (_builderCountKey.isValid()) {
+        source.set(_builderCountKey, model.builderCount);
+        source.set(_evaluationCountKey, model.evaluationCount);
+    }
 
     source.set(_fluxCorrectionKeys.psfFactorFlag, true);
-    PTR(afw::image::Image<afw::math::Kernel::Pixel>) psfImage = exposure.getPsf()->computeImage(center);
-    ModelInputHandler psfInputs(*psfImage, center, psfImage->getBBox());
-    MultiGaussianObjective::EllipseCore psfEllipse(psfModel.ellipse);
-    psfEllipse.scale(getControl().minInitialRadius);
-    FitProfileModel psfProfileModel = apply(getControl(), psfModel, psfEllipse, psfInputs);
+    FitProfileModel psfProfileModel = (getControl().psfFactorGrid)
+        ? _interpolatePsfFactor(
+            exposure.getPsf(), afw::geom::Box2D(exposure.getMaskedImage().getBBox(afw::image::PARENT)), center
+        )
+        : computePsfFactor(getControl(), psfModel, *exposure.getPsf(), center);
     source.set(_fluxCorrectionKeys.psfFactor, psfProfileModel.flux);
-    source.set(_psfEllipseKey, model.ellipse);
+    source.set(_psfEllipseKey, psfProfileModel.ellipse);
     source.set(_fluxCorrectionKeys.psfFactorFlag, psfProfileModel.fluxFlag);
 
 }
 
+FitProfileModel FitProfileAlgorithm::computePsfFactor(
+    FitProfileControl const & ctrl,
+    FitPsfModel const & psfModel,
+    afw::detection::Psf const & psf,
+    afw::geom::Point2D const & center
+) {
+    if (ctrl.analyticPsfFactor) {
+        MULTISHAPELET_TIMER(fitTimer, PSF_FACTOR_FIT);
+        return computeAnalyticPsfFactor(ctrl, psfModel);
+    }
+    MULTISHAPELET_TIMER(renderTimer, PSF_FACTOR_RENDER);
+    PTR(afw::image::Image<afw::math::Kernel::Pixel>) psfImage = psf.computeImage(center);
+    MULTISHAPELET_TIMER_STOP(renderTimer);
+    MULTISHAPELET_TIMER(fitTimer, PSF_FACTOR_FIT);
+    ModelInputHandler psfInputs(*psfImage, center, psfImage->getBBox());
+    MultiGaussianObjective::EllipseCore psfEllipse(psfModel.ellipse);
+    psfEllipse.scale(ctrl.minInitialRadius);
+    return apply(ctrl, psfModel, psfEllipse, psfInputs);
+}
+
+FitProfileModel FitProfileAlgorithm::computeAnalyticPsfFactor(
+    FitProfileControl const & ctrl,
+    FitPsfModel const & psfModel
+) {
+    typedef shapelet::MultiShapeletFunction MSF;
+    PTR(Objective) obj = boost::make_shared<PsfModelObjective>(
+        ctrl.getMultiGaussian(), psfModel, ctrl.minRadius, ctrl.minAxisRatio
+    );
+    MultiGaussianObjective::EllipseCore psfEllipse(psfModel.ellipse);
+    psfEllipse.scale(ctrl.minInitialRadius);
+    ndarray::Array<double,1,1> initial = ndarray::allocate(obj->getParameterSize());
+    psfEllipse.writeParameters(initial.getData());
+    HybridOptimizer opt(obj, initial, makeOptimizerControl());
+    opt.run();
+    Model model(ctrl, 1.0, opt.getParameters());
+    MultiGaussianObjective::EllipseCore ellipse = MultiGaussianObjective::readParameters(opt.getParameters());
+    std::pair<bool,bool> constrained 
+        = MultiGaussianObjective::constrainEllipse(ellipse, ctrl.minRadius, ctrl.minAxisRatio);
+    model.flagMaxIter = opt.getState() & HybridOptimizer::FAILURE_MAXITER;
+    model.flagTinyStep = (opt.getState() & HybridOptimizer::FAILURE_MINSTEP)
+        || (opt.getState() & HybridOptimizer::FAILURE_MINTRUST);
+    model.flagMinRadius = constrained.first;
+    model.flagMinAxisRatio = constrained.second;
+    // Linear fit with the shapelet terms of the PSF included, as in fitShapeletTerms,
+    // with inner products of functions in place of dot products of pixel vectors.
+    MSF psf = psfModel.asMultiShapelet();
+    CONST_PTR(MSF) msf = ConvolutionCache::get(model, psfModel);
+    double variance = 1.0 / PsfModelObjective::computeInnerProduct(*msf, *msf);
+    model.flux = PsfModelObjective::computeInnerProduct(*msf, psf) * variance;
+    model.fluxErr = std::sqrt(variance);
+    model.fluxFlag = !lsst::utils::isfinite(model.flux);
+    return model;
+}
+
+FitProfileModel FitProfileAlgorithm::_interpolatePsfFactor(
+    CONST_PTR(afw::detection::Psf) const & psf,
+    afw::geom::Box2D const & bbox,
+    afw::geom::Point2D const & center
+) const {
+    // Building the grid runs computePsfFactor at each grid point, which times its own stages,
+    // so we only start timing the interpolation once we have the grid.
+    CONST_PTR(SpatialInterpolator) grid = _psfFactorGrid.get(
+        psf, bbox, boost::bind(&FitProfileAlgorithm::_makePsfFactorGrid, this, psf, bbox)
+    );
+    MULTISHAPELET_TIMER(timer, PSF_FACTOR_FIT);
+    ndarray::Array<double,1,1> vector = grid->evaluate(center);
+    return FitProfileModel(getControl(), vector[0], vector[ndarray::view(1, 4)]);
+}
+
+CONST_PTR(SpatialInterpolator) FitProfileAlgorithm::_makePsfFactorGrid(
+    CONST_PTR(afw::detection::Psf) const & psf,
+    afw::geom::Box2D const & bbox
+) const {
+    FitProfileControl const & ctrl = getControl();
+    std::vector<afw::geom::Point2D> gridPoints
+        = SpatialInterpolator::makeGrid(bbox, ctrl.psfFactorGridNx, ctrl.psfFactorGridNy);
+    std::vector<afw::geom::Point2D> goodPoints;
+    std::vector<double> goodValues;
+    for (std::size_t n = 0; n < gridPoints.size(); ++n) {
+        try {
+            FitPsfModel psfModel = FitPsfAlgorithm::apply(*_psfCtrl, *psf, gridPoints[n]);
+            if (psfModel.hasFailed()) continue;
+            FitProfileModel psfProfileModel = computePsfFactor(ctrl, psfModel, *psf, gridPoints[n]);
+            if (psfProfileModel.fluxFlag) continue;
+            goodPoints.push_back(gridPoints[n]);
+            MultiGaussianObjective::EllipseCore ellipse(psfProfileModel.ellipse);
+            goodValues.push_back(psfProfileModel.flux);
+            goodValues.resize(goodValues.size() + 3);
+            ellipse.writeParameters(&goodValues.back() - 2);
+        } catch (pex::exceptions::Exception &) {}
+    }
+    ndarray::Array<double,2,2> values = ndarray::allocate(goodPoints.size(), 4);
+    std::copy(goodValues.begin(), goodValues.end(), values.getData());
+    return boost::make_shared<SpatialInterpolator>(bbox, ctrl.psfFactorGridOrder, goodPoints, values);
+}
+
 LSST_MEAS_ALGORITHM_PRIVATE_IMPLEMENTATION(FitProfileAlgorithm);
 
 }}}} // namespace lsst::meas::extensions::multiShapelet
@@ -0,0 +1,146 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <limits>
+#include <algorithm>
+
+#include "boost/bind.hpp"
+#include "boost/format.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/FitProfileBatch.h"
+#include "lsst/meas/extensions/multiShapelet/BatchRunner.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Fits one source; psfModels[n] is null if the PSF fit failed, as in FitProfileAlgorithm::_apply.
+void fitOne(
+    FitProfileControl const & ctrl,
+    std::vector<FitPsfModel const *> const & psfModels,
+    ndarray::Array<double const,2,2> const & ellipses,
+    std::vector<ModelInputHandler> const & inputs,
+    FitProfileBatchResults & results,
+    int n
+) {
+    if (!psfModels[n]) {
+        results.setFailed(n, FitProfileBatchResults::FAILED_PSF);
+        return;
+    }
+    try {
+        // ellipses is shared by all tasks; see BatchRunner.
+        double const * row = ellipses.getData() + n * ellipses.getStride<0>();
+        afw::geom::ellipses::Quadrupole shape(row[0], row[1], row[2]);
+        results.setModel(n, FitProfileAlgorithm::apply(ctrl, *psfModels[n], shape, inputs[n]));
+    } catch (std::exception &) {
+        results.setFailed(n);
+    }
+}
+
+} // anonymous
+
+FitProfileBatchResults::FitProfileBatchResults(int size) :
+    ellipse(ndarray::allocate(size, 3)),
+    flux(ndarray::allocate(size)),
+    fluxErr(ndarray::allocate(size)),
+    chisq(ndarray::allocate(size)),
+    flags(ndarray::allocate(size)),
+    predictedCost(ndarray::allocate(size)),
+    time(ndarray::allocate(size))
+{
+    flags.deep() = 0;
+    predictedCost.deep() = 0.0;
+    time.deep() = 0.0;
+}
+
+void FitProfileBatchResults::setModel(int n, FitProfileModel const & model) {
+    double * ellipseRow = ellipse.getData() + n * ellipse.getStride<0>();
+    ellipseRow[0] = model.ellipse.getIxx();
+    ellipseRow[1] = model.ellipse.getIyy();
+    ellipseRow[2] = model.ellipse.getIxy();
+    flux.getData()[n] = model.flux;
+    fluxErr.getData()[n] = model.fluxErr;
+    chisq.getData()[n] = model.chisq;
+    flags.getData()[n] = (model.fluxFlag ? FLUX_FLAG : 0)
+        | (model.flagMaxIter ? FAILED_MAXITER : 0)
+        | (model.flagTinyStep ? FAILED_TINYSTEP : 0)
+        | (model.flagMinRadius ? FAILED_MINRADIUS : 0)
+        | (model.flagMinAxisRatio ? FAILED_MINAXISRATIO : 0)
+        | (model.flagLargeArea ? FAILED_LARGEAREA : 0);
+}
+
+void FitProfileBatchResults::setFailed(int n, int flagBits) {
+    double const nan = std::numeric_limits<double>::quiet_NaN();
+    double * ellipseRow = ellipse.getData() + n * ellipse.getStride<0>();
+    std::fill(ellipseRow, ellipseRow + ellipse.getSize<1>(), nan);
+    flux.getData()[n] = nan;
+    fluxErr.getData()[n] = nan;
+    chisq.getData()[n] = nan;
+    flags.getData()[n] = flagBits | FLUX_FLAG;
+}
+
+FitProfileBatchResults FitProfileBatch::apply(
+    FitProfileControl const & ctrl,
+    FitPsfControl const & psfCtrl,
+    FitPsfBatchResults const & psfModels,
+    ndarray::Array<double const,2,2> const & ellipses,
+    std::vector<ModelInputHandler> const & inputs,
+    int nThreads
+) {
+    int const size = inputs.size();
+    if (psfModels.getSize() != size || ellipses.getSize<0>() != size || ellipses.getSize<1>() != 3) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Got %d inputs, %d PSF models, and %dx%d ellipses (expected %dx3)")
+             % size % psfModels.getSize() % ellipses.getSize<0>() % ellipses.getSize<1>() % size).str()
+        );
+    }
+    FitProfileBatchResults results(size);
+    // Reassemble the PSF models and predict costs here, so the tasks only have to fit.
+    std::vector<FitPsfModel> psfModelStorage;
+    psfModelStorage.reserve(size); // so the pointers below stay valid
+    std::vector<FitPsfModel const *> psfModelPointers(size, 0);
+    std::vector<double> costs(size, 0.0);
+    for (int n = 0; n < size; ++n) {
+        if (psfModels.flags[n]) continue;
+        psfModelStorage.push_back(psfModels.getModel(psfCtrl, n));
+        if (!(psfModelStorage.back().ellipse.getArea() > 0.0)) continue;
+        psfModelPointers[n] = &psfModelStorage.back();
+        costs[n] = FitProfileAlgorithm::predictCost(ctrl, psfModelStorage.back(), inputs[n].getSize());
+        results.predictedCost[n] = costs[n];
+    }
+    std::vector<double> times;
+    BatchRunner::run(
+        costs,
+        boost::bind(
+            &fitOne, boost::cref(ctrl), boost::cref(psfModelPointers), boost::cref(ellipses),
+            boost::cref(inputs), boost::ref(results), _1
+        ),
+        nThreads,
+        &times
+    );
+    std::copy(times.begin(), times.end(), results.time.begin());
+    return results;
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
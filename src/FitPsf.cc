@@ -21,9 +21,18 @@
  * see <http://www.lsstcorp.org/LegalNotices/>.
  */
 
+#include <algorithm>
+#include <cmath>
+
+#include "Eigen/Cholesky"
+#include "boost/bind.hpp"
+
 #include "lsst/meas/extensions/multiShapelet/FitPsf.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGrid.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGridCache.h"
+#include "lsst/meas/extensions/multiShapelet/BoxGridCache.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
-#include "lsst/shapelet/MatrixBuilder.h"
+#include "lsst/meas/extensions/multiShapelet/PsfModelObjective.h"
 #include "lsst/afw/math/LeastSquares.h"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
@@ -42,6 +51,50 @@ int computeOrder(int size2d) {
     );
 }
 
+// Solve for the shapelet coefficients from normal equations accumulated over blocks of pixels,
+// so we never hold more than a block of the design matrix.  Returns false if the normal matrix
+// isn't positive definite, in which case the caller should fall back to a more robust solver.
+bool fitShapeletTermsNormal(
+    FitPsfControl const & ctrl,
+    ModelInputHandler const & inputs,
+    FitPsfModel & model
+) {
+    int const innerCoeffs = shapelet::computeSize(ctrl.innerOrder);
+    int const outerCoeffs = shapelet::computeSize(ctrl.outerOrder);
+    int const nCoeffs = innerCoeffs + outerCoeffs;
+    int const size = inputs.getSize();
+    afw::geom::ellipses::Ellipse innerEllipse(model.ellipse);
+    afw::geom::ellipses::Ellipse outerEllipse(model.ellipse);
+    outerEllipse.scale(ctrl.radiusRatio);
+    Eigen::MatrixXd fisher = Eigen::MatrixXd::Zero(nCoeffs, nCoeffs);
+    Eigen::VectorXd rhs = Eigen::VectorXd::Zero(nCoeffs);
+    double dataSquaredNorm = 0.0;
+    int const blockSize = ShapeletMatrixBuilder::BLOCK_SIZE;
+    ndarray::Array<double,2,-2> workspace = ndarray::allocate(blockSize, nCoeffs);
+    for (int begin = 0; begin < size; begin += blockSize) {
+        int const n = std::min(blockSize, size - begin);
+        ndarray::Array<double,2,-1> block = workspace[ndarray::view(0, n)()];
+        BoxGridCache::fillMatrix(
+            inputs, ctrl.innerOrder, innerEllipse, block[ndarray::view()(0, innerCoeffs)], begin
+        );
+        BoxGridCache::fillMatrix(
+            inputs, ctrl.outerOrder, outerEllipse, block[ndarray::view()(innerCoeffs, nCoeffs)], begin
+        );
+        Eigen::VectorXd data = inputs.getData().asEigen().segment(begin, n);
+        fisher.selfadjointView<Eigen::Lower>().rankUpdate(block.asEigen().transpose());
+        rhs.noalias() += block.asEigen().transpose() * data;
+        dataSquaredNorm += data.squaredNorm();
+    }
+    Eigen::LLT<Eigen::MatrixXd,Eigen::Lower> cholesky(fisher);
+    if (cholesky.info() != Eigen::Success) return false;
+    Eigen::VectorXd solution = cholesky.solve(rhs);
+    model.inner.asEigen() = solution.head(innerCoeffs);
+    model.outer.asEigen() = solution.tail(outerCoeffs);
+    // At the solution, |A x - b|^2 = |b|^2 - x^T A^T b; round-off can make this slightly negative.
+    model.chisq = std::max(dataSquaredNorm - solution.dot(rhs), 0.0) / (size - nCoeffs);
+    return true;
+}
+
 } // anonymous
 
 MultiGaussian FitPsfControl::getMultiGaussian() const {
@@ -74,6 +127,19 @@ FitPsfModel::FitPsfModel(
     outer.asEigen() *= amplitude;
 }
 
+FitPsfModel::FitPsfModel(
+    FitPsfControl const & ctrl,
+    ndarray::Array<double const,1,1> const & parameters,
+    ndarray::Array<double const,1,1> const & inner_,
+    ndarray::Array<double const,1,1> const & outer_
+) :
+    inner(ndarray::copy(inner_)),
+    outer(ndarray::copy(outer_)),
+    ellipse(MultiGaussianObjective::EllipseCore(parameters[0], parameters[1], parameters[2])),
+    radiusRatio(ctrl.radiusRatio), chisq(std::numeric_limits<double>::quiet_NaN()),
+    failedMaxIter(false), failedTinyStep(false), failedMinRadius(false), failedMinAxisRatio(false)
+{}
+
 FitPsfModel::FitPsfModel(FitPsfControl const & ctrl, afw::table::BaseRecord const & source) :
     inner(ndarray::allocate(shapelet::computeSize(ctrl.innerOrder))),
     outer(ndarray::allocate(shapelet::computeSize(ctrl.outerOrder))),
@@ -163,7 +229,63 @@ shapelet::MultiShapeletFunction FitPsfModel::asMultiShapelet(
     return shapelet::MultiShapeletFunction(components);
 }
 
-FitPsfAlgorithm::FitPsfAlgorithm(FitPsfControl const & ctrl, afw::table::Schema & schema) :
+int FitPsfModel::getOrder() const {
+    return std::max(computeOrder(inner.getSize<0>()), computeOrder(outer.getSize<0>()));
+}
+
+FitPsfModel FitPsfModel::truncate(int order) const {
+    FitPsfModel result(*this);
+    int const innerSize = std::min(inner.getSize<0>(), shapelet::computeSize(order));
+    int const outerSize = std::min(outer.getSize<0>(), shapelet::computeSize(order));
+    result.inner = ndarray::copy(inner[ndarray::view(0, innerSize)]);
+    result.outer = ndarray::copy(outer[ndarray::view(0, outerSize)]);
+    return result;
+}
+
+double FitPsfModel::computeTruncationError(int order) const {
+    double error = 0.0;
+    selectTruncationOrder(order, 0.0, error);
+    return error;
+}
+
+int FitPsfModel::selectTruncationOrder(int maxOrder, double tolerance) const {
+    double error = 0.0;
+    return selectTruncationOrder(maxOrder, tolerance, error);
+}
+
+int FitPsfModel::selectTruncationOrder(int maxOrder, double tolerance, double & error) const {
+    int const fullOrder = getOrder();
+    if (maxOrder < 0 || maxOrder > fullOrder) maxOrder = fullOrder;
+    error = 0.0;
+    if (maxOrder == fullOrder && !(tolerance > 0.0)) return fullOrder;
+    // Zero the coefficients one order at a time (they're ordered by total order), so the norm of
+    // what's left after zeroing order n is the norm of the terms neglected by truncating to n.
+    shapelet::MultiShapeletFunction neglected = asMultiShapelet();
+    double const fullNorm = PsfModelObjective::computeInnerProduct(neglected, neglected);
+    for (int order = 0; order < fullOrder; ++order) {
+        int const offset = shapelet::computeOffset(order);
+        for (
+            shapelet::MultiShapeletFunction::ComponentList::iterator i = neglected.getComponents().begin();
+            i != neglected.getComponents().end();
+            ++i
+        ) {
+            if (order <= i->getOrder()) {
+                i->getCoefficients()[ndarray::view(offset, offset + order + 1)].deep() = 0.0;
+            }
+        }
+        double neglectedNorm = PsfModelObjective::computeInnerProduct(neglected, neglected);
+        error = std::sqrt(std::max(neglectedNorm, 0.0) / fullNorm);
+        if (order == maxOrder || (tolerance > 0.0 && error <= tolerance)) return order;
+    }
+    error = 0.0;
+    return fullOrder;
+}
+
+FitPsfAlgorithm::FitPsfAlgorithm(
+    FitPsfControl const & ctrl,
+    afw::table::Schema & schema,
+    PTR(daf::base::PropertyList) const & metadata
+) :
     algorithms::Algorithm(ctrl),
     _innerKey(
         schema.addField< afw::table::Array<float> >(
@@ -216,7 +338,13 @@ FitPsfAlgorithm::FitPsfAlgorithm(FitPsfControl const & ctrl, afw::table::Schema
             ctrl.name + ".flags.constraint.q",
             "set if the best-fit axis ratio (b/a) was the minimum allowed by the constraint"
         ))
-{}
+{
+#if MULTISHAPELET_ENABLE_TIMERS
+    if (metadata) {
+        _stageTimes = boost::make_shared<StageTimes>(ctrl.name, metadata);
+    }
+#endif
+}
 
 PTR(MultiGaussianObjective) FitPsfAlgorithm::makeObjective(
     FitPsfControl const & ctrl,
@@ -248,20 +376,19 @@ void FitPsfAlgorithm::fitShapeletTerms(
     ModelInputHandler const & inputs,
     FitPsfModel & model
 ) {
+    MULTISHAPELET_TIMER(timer, SHAPELET_TERMS);
+    if (ctrl.useNormalEquations && fitShapeletTermsNormal(ctrl, inputs, model)) {
+        return;
+    }
     int innerCoeffs = shapelet::computeSize(ctrl.innerOrder);
     int outerCoeffs = shapelet::computeSize(ctrl.outerOrder);
-    shapelet::MatrixBuilder<double> innerBuilder(inputs.getX(), inputs.getY(), ctrl.innerOrder);
-    shapelet::MatrixBuilder<double> outerBuilder(inputs.getX(), inputs.getY(), ctrl.outerOrder);
     ndarray::Array<double,2,-2> matrix = ndarray::allocate(inputs.getSize(), innerCoeffs + outerCoeffs);
-    matrix.asEigen().setZero();
     afw::geom::ellipses::Ellipse tmpEllipse(model.ellipse);
-    innerBuilder(matrix[ndarray::view()(0, innerCoeffs)], tmpEllipse);
+    BoxGridCache::fillMatrix(inputs, ctrl.innerOrder, tmpEllipse, matrix[ndarray::view()(0, innerCoeffs)]);
     tmpEllipse.scale(ctrl.radiusRatio);
-    innerBuilder(matrix[ndarray::view()(innerCoeffs, innerCoeffs + outerCoeffs)], tmpEllipse);
-    if (!inputs.getWeights().isEmpty()) {
-        matrix.asEigen<Eigen::ArrayXpr>() 
-            *= (inputs.getWeights().asEigen() * Eigen::RowVectorXd::Ones(matrix.getSize<1>())).array();
-    }
+    BoxGridCache::fillMatrix(
+        inputs, ctrl.outerOrder, tmpEllipse, matrix[ndarray::view()(innerCoeffs, innerCoeffs + outerCoeffs)]
+    );
     afw::math::LeastSquares lstsq = afw::math::LeastSquares::fromDesignMatrix(matrix, inputs.getData());
     model.inner.deep() = lstsq.getSolution()[ndarray::view(0, innerCoeffs)];
     model.outer.deep() = lstsq.getSolution()[ndarray::view(innerCoeffs, innerCoeffs + outerCoeffs)];
@@ -275,8 +402,13 @@ FitPsfModel FitPsfAlgorithm::apply(
     FitPsfControl const & ctrl,
     ModelInputHandler const & inputs
 ) {
+    MULTISHAPELET_TIMER(setupTimer, OPTIMIZER_SETUP);
     HybridOptimizer opt = makeOptimizer(ctrl, inputs);
-    opt.run();
+    MULTISHAPELET_TIMER_STOP(setupTimer);
+    {
+        MULTISHAPELET_TIMER(runTimer, OPTIMIZER_RUN);
+        opt.run();
+    }
     Model model(
         ctrl, 
         boost::static_pointer_cast<MultiGaussianObjective const>(opt.getObjective())->getAmplitude(),
@@ -299,10 +431,12 @@ FitPsfModel FitPsfAlgorithm::apply(
     afw::detection::Psf const & psf,
     afw::geom::Point2D const & center
 ) {
+    MULTISHAPELET_TIMER(timer, INPUTS);
     PTR(afw::image::Image<afw::math::Kernel::Pixel>) image = psf.computeImage(center);
     double s = image->getArray().asEigen().sum();
     image->getArray().asEigen() /= s;
     ModelInputHandler inputs(*image, center, image->getBBox());
+    MULTISHAPELET_TIMER_STOP(timer);
     return apply(ctrl, inputs);
 }
 
@@ -313,6 +447,11 @@ FitPsfModel FitPsfAlgorithm::fit(
 ) const {
     record.set(_flagKey, true);
     FitPsfModel model = apply(getControl(), psf, center);
+    _save(record, model);
+    return model;
+}
+
+void FitPsfAlgorithm::_save(afw::table::BaseRecord & record, FitPsfModel const & model) const {
     record[_innerKey] = model.inner;
     record[_outerKey] = model.outer;
     record.set(_ellipseKey, model.ellipse);
@@ -324,7 +463,26 @@ FitPsfModel FitPsfAlgorithm::fit(
     record.set(_flagMinAxisRatioKey, model.failedMinAxisRatio);
     record.set(_flagKey, model.failedMaxIter || model.failedTinyStep
                || model.failedMinAxisRatio || model.failedMinRadius);
-    return model;
+}
+
+CONST_PTR(FitPsfGrid) FitPsfAlgorithm::_makeGrid(
+    CONST_PTR(afw::detection::Psf) const & psf,
+    afw::geom::Box2D const & bbox,
+    CONST_PTR(daf::base::PropertySet) const & metadata
+) const {
+    if (getControl().cacheDir.empty()) {
+        return boost::make_shared<FitPsfGrid>(getControl(), *psf, bbox);
+    }
+    FitPsfGridCache cache(getControl().cacheDir);
+    FitPsfGridCache::Key key = FitPsfGridCache::makeKey(getControl(), *psf, bbox, metadata);
+    CONST_PTR(FitPsfGrid) grid = cache.read(key, getControl(), bbox);
+    if (!grid) {
+        grid = boost::make_shared<FitPsfGrid>(getControl(), *psf, bbox);
+        try {
+            cache.write(key, *grid);
+        } catch (pex::exceptions::IoError &) {} // the cache is just an optimization
+    }
+    return grid;
 }
 
 template <typename PixelT>
@@ -333,6 +491,7 @@ void FitPsfAlgorithm::_apply(
     afw::image::Exposure<PixelT> const & exposure,
     afw::geom::Point2D const & center
 ) const {
+    MULTISHAPELET_APPLY_TIMER(_stageTimes.get());
     source.set(_flagKey, true);
     if (!exposure.hasPsf()) {
         throw LSST_EXCEPT(
@@ -340,7 +499,16 @@ void FitPsfAlgorithm::_apply(
             "Cannot run FitPsfAlgorithm without a PSF."
         );
     }
-    fit(source, *exposure.getPsf(), center);
+    if (getControl().useGrid) {
+        afw::geom::Box2D bbox(exposure.getMaskedImage().getBBox(afw::image::PARENT));
+        CONST_PTR(FitPsfGrid) grid = _grid.get(
+            exposure.getPsf(), bbox,
+            boost::bind(&FitPsfAlgorithm::_makeGrid, this, exposure.getPsf(), bbox, exposure.getMetadata())
+        );
+        _save(source, grid->evaluate(center));
+    } else {
+        fit(source, *exposure.getPsf(), center);
+    }
 }
 
 PTR(algorithms::AlgorithmControl) FitPsfControl::_clone() const {
@@ -351,7 +519,7 @@ PTR(algorithms::Algorithm) FitPsfControl::_makeAlgorithm(
     afw::table::Schema & schema,
     PTR(daf::base::PropertyList) const & metadata
 ) const {
-    return boost::make_shared<FitPsfAlgorithm>(*this, boost::ref(schema));
+    return boost::make_shared<FitPsfAlgorithm>(*this, boost::ref(schema), metadata);
 }
 
 LSST_MEAS_ALGORITHM_PRIVATE_IMPLEMENTATION(FitPsfAlgorithm);
@@ -0,0 +1,190 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <algorithm>
+#include <limits>
+
+#include "boost/bind.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/FitPsfBatch.h"
+#include "lsst/meas/extensions/multiShapelet/BatchRunner.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Fits one input; inputs[n] may be null if it could not be constructed.
+void fitOne(
+    FitPsfControl const & ctrl,
+    std::vector<ModelInputHandler const *> const & inputs,
+    FitPsfBatchResults & results,
+    int n
+) {
+    if (!inputs[n]) {
+        results.setFailed(n);
+        return;
+    }
+    try {
+        results.setModel(n, FitPsfAlgorithm::apply(ctrl, *inputs[n]));
+    } catch (std::exception &) {
+        results.setFailed(n);
+    }
+}
+
+FitPsfBatchResults runBatch(
+    FitPsfControl const & ctrl,
+    std::vector<ModelInputHandler const *> const & inputs,
+    int nThreads
+) {
+    FitPsfBatchResults results(ctrl, inputs.size());
+    BatchRunner::run(
+        inputs.size(),
+        boost::bind(&fitOne, boost::cref(ctrl), boost::cref(inputs), boost::ref(results), _1),
+        nThreads
+    );
+    return results;
+}
+
+} // anonymous
+
+FitPsfBatchResults::FitPsfBatchResults(FitPsfControl const & ctrl, int size) :
+    ellipse(ndarray::allocate(size, 3)),
+    inner(ndarray::allocate(size, shapelet::computeSize(ctrl.innerOrder))),
+    outer(ndarray::allocate(size, shapelet::computeSize(ctrl.outerOrder))),
+    chisq(ndarray::allocate(size)),
+    flags(ndarray::allocate(size))
+{
+    flags.deep() = 0;
+}
+
+FitPsfModel FitPsfBatchResults::getModel(FitPsfControl const & ctrl, int n) const {
+    ndarray::Array<double,1,1> parameters = ndarray::allocate(3);
+    parameters.deep() = 0.0;
+    FitPsfModel model(ctrl, 1.0, parameters);
+    model.ellipse = afw::geom::ellipses::Quadrupole(ellipse[n][0], ellipse[n][1], ellipse[n][2]);
+    model.inner.deep() = inner[n];
+    model.outer.deep() = outer[n];
+    model.chisq = chisq[n];
+    model.failedMaxIter = flags[n] & FAILED_MAXITER;
+    model.failedTinyStep = flags[n] & FAILED_TINYSTEP;
+    model.failedMinRadius = flags[n] & FAILED_MINRADIUS;
+    model.failedMinAxisRatio = flags[n] & FAILED_MINAXISRATIO;
+    return model;
+}
+
+void FitPsfBatchResults::setModel(int n, FitPsfModel const & model) {
+    double * ellipseRow = ellipse.getData() + n * ellipse.getStride<0>();
+    ellipseRow[0] = model.ellipse.getIxx();
+    ellipseRow[1] = model.ellipse.getIyy();
+    ellipseRow[2] = model.ellipse.getIxy();
+    std::copy(model.inner.begin(), model.inner.end(), inner.getData() + n * inner.getStride<0>());
+    std::copy(model.outer.begin(), model.outer.end(), outer.getData() + n * outer.getStride<0>());
+    chisq.getData()[n] = model.chisq;
+    flags.getData()[n] = (model.failedMaxIter ? FAILED_MAXITER : 0)
+        | (model.failedTinyStep ? FAILED_TINYSTEP : 0)
+        | (model.failedMinRadius ? FAILED_MINRADIUS : 0)
+        | (model.failedMinAxisRatio ? FAILED_MINAXISRATIO : 0);
+}
+
+void FitPsfBatchResults::setFailed(int n) {
+    double const nan = std::numeric_limits<double>::quiet_NaN();
+    double * ellipseRow = ellipse.getData() + n * ellipse.getStride<0>();
+    std::fill(ellipseRow, ellipseRow + ellipse.getSize<1>(), nan);
+    double * innerRow = inner.getData() + n * inner.getStride<0>();
+    std::fill(innerRow, innerRow + inner.getSize<1>(), nan);
+    double * outerRow = outer.getData() + n * outer.getStride<0>();
+    std::fill(outerRow, outerRow + outer.getSize<1>(), nan);
+    chisq.getData()[n] = nan;
+    flags.getData()[n] = FAILED_EXCEPTION;
+}
+
+FitPsfBatchResults FitPsfBatch::apply(
+    FitPsfControl const & ctrl,
+    std::vector<ModelInputHandler> const & inputs,
+    int nThreads
+) {
+    std::vector<ModelInputHandler const *> pointers(inputs.size());
+    for (std::size_t n = 0; n < inputs.size(); ++n) {
+        pointers[n] = &inputs[n];
+    }
+    return runBatch(ctrl, pointers, nThreads);
+}
+
+template <typename PixelT>
+FitPsfBatchResults FitPsfBatch::apply(
+    FitPsfControl const & ctrl,
+    afw::image::Exposure<PixelT> const & exposure,
+    std::vector<afw::geom::Point2D> const & centers,
+    afw::image::MaskPixel badPixelMask,
+    int nThreads
+) {
+    if (!exposure.hasPsf()) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LogicError,
+            "Cannot run FitPsfBatch on an exposure without a PSF."
+        );
+    }
+    std::vector<ModelInputHandler> inputs;
+    std::vector<ModelInputHandler const *> pointers(centers.size(), 0);
+    if (centers.empty()) {
+        return runBatch(ctrl, pointers, nThreads);
+    }
+    // The Psf interface doesn't promise its methods are thread-safe, and the
+    // ModelInputHandlers are cheap compared to the fits, so we make them all here.
+    afw::geom::Extent2I dimensions = exposure.getPsf()->computeImage(centers.front())->getDimensions();
+    afw::geom::Box2I imageBBox = exposure.getMaskedImage().getBBox(afw::image::PARENT);
+    inputs.reserve(centers.size()); // so the pointers below stay valid
+    for (std::size_t n = 0; n < centers.size(); ++n) {
+        afw::geom::Point2I pixel(
+            int(std::floor(centers[n].getX() + 0.5)),
+            int(std::floor(centers[n].getY() + 0.5))
+        );
+        afw::geom::Box2I box(
+            pixel - afw::geom::Extent2I(dimensions.getX() / 2, dimensions.getY() / 2),
+            dimensions
+        );
+        box.clip(imageBBox);
+        if (box.isEmpty()) continue;
+        try {
+            inputs.push_back(
+                ModelInputHandler(exposure.getMaskedImage(), centers[n], box, badPixelMask)
+            );
+            pointers[n] = &inputs.back();
+        } catch (pex::exceptions::Exception &) {}
+    }
+    return runBatch(ctrl, pointers, nThreads);
+}
+
+#define INSTANTIATE(T)                                                  \
+    template FitPsfBatchResults FitPsfBatch::apply(                     \
+        FitPsfControl const & ctrl,                                     \
+        afw::image::Exposure<T> const & exposure,                       \
+        std::vector<afw::geom::Point2D> const & centers,                \
+        afw::image::MaskPixel badPixelMask,                             \
+        int nThreads                                                    \
+    )
+
+INSTANTIATE(float);
+INSTANTIATE(double);
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
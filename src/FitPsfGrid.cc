@@ -0,0 +1,142 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include "boost/format.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/FitPsfGrid.h"
+#include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+FitPsfGrid::FitPsfGrid(
+    FitPsfControl const & ctrl,
+    afw::detection::Psf const & psf,
+    afw::geom::Box2D const & bbox
+) : _ctrl(ctrl), _failureCount(0), _points(),
+    _values(_fitGrid(ctrl, psf, bbox, _points, _failureCount)),
+    _interpolator(bbox, ctrl.gridOrder, _points, _values)
+{}
+
+FitPsfGrid::FitPsfGrid(
+    FitPsfControl const & ctrl,
+    afw::geom::Box2D const & bbox,
+    std::vector<afw::geom::Point2D> const & points,
+    ndarray::Array<double const,2,2> const & values,
+    int failureCount
+) : _ctrl(ctrl), _failureCount(failureCount), _points(points), _values(ndarray::copy(values)),
+    _interpolator(bbox, ctrl.gridOrder, _points, _values)
+{
+    if (_values.getSize<1>() != getValueSize(ctrl)) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Number of values per point (%d) does not match control object (%d)")
+             % _values.getSize<1>() % getValueSize(ctrl)).str()
+        );
+    }
+}
+
+FitPsfModel FitPsfGrid::evaluate(afw::geom::Point2D const & point) const {
+    int const innerSize = shapelet::computeSize(_ctrl.innerOrder);
+    int const outerSize = shapelet::computeSize(_ctrl.outerOrder);
+    ndarray::Array<double,1,1> vector = _interpolator.evaluate(point);
+    return FitPsfModel(
+        _ctrl, vector[ndarray::view(0, 3)], vector[ndarray::view(3, 3 + innerSize)],
+        vector[ndarray::view(3 + innerSize, 3 + innerSize + outerSize)]
+    );
+}
+
+FitPsfGridResidual FitPsfGrid::computeResidual(afw::detection::Psf const & psf, int nx, int ny) const {
+    FitPsfGridResidual result;
+    afw::geom::Box2D const & bbox = getBBox();
+    ndarray::Array<double,1,1> direct = ndarray::allocate(_interpolator.getValueSize());
+    ndarray::Array<double,1,1> interpolated = ndarray::allocate(_interpolator.getValueSize());
+    int nCoefficients = 0;
+    for (int j = 0; j < ny; ++j) {
+        double y = bbox.getMinY() + bbox.getHeight() * (j + 0.25) / ny;
+        for (int i = 0; i < nx; ++i) {
+            afw::geom::Point2D point(bbox.getMinX() + bbox.getWidth() * (i + 0.25) / nx, y);
+            try {
+                FitPsfModel directModel = FitPsfAlgorithm::apply(_ctrl, psf, point);
+                if (directModel.hasFailed()) continue;
+                _writeVector(directModel, direct);
+            } catch (pex::exceptions::Exception &) {
+                continue;
+            }
+            evaluate(point, interpolated);
+            ++result.count;
+            for (int n = 0; n < 3; ++n) {
+                double d = std::abs(interpolated[n] - direct[n]);
+                result.maxEllipse = std::max(result.maxEllipse, d);
+                result.rmsEllipse += d * d;
+            }
+            for (int n = 3; n < direct.getSize<0>(); ++n, ++nCoefficients) {
+                double d = std::abs((interpolated[n] - direct[n]) / direct[3]);
+                result.maxCoefficient = std::max(result.maxCoefficient, d);
+                result.rmsCoefficient += d * d;
+            }
+        }
+    }
+    if (result.count > 0) {
+        result.rmsEllipse = std::sqrt(result.rmsEllipse / (3 * result.count));
+        result.rmsCoefficient = std::sqrt(result.rmsCoefficient / nCoefficients);
+    }
+    return result;
+}
+
+ndarray::Array<double,2,2> FitPsfGrid::_fitGrid(
+    FitPsfControl const & ctrl, afw::detection::Psf const & psf, afw::geom::Box2D const & bbox,
+    std::vector<afw::geom::Point2D> & goodPoints, int & failureCount
+) {
+    std::vector<afw::geom::Point2D> gridPoints = SpatialInterpolator::makeGrid(bbox, ctrl.gridNx, ctrl.gridNy);
+    std::vector<FitPsfModel> models;
+    failureCount = 0;
+    for (std::size_t n = 0; n < gridPoints.size(); ++n) {
+        try {
+            FitPsfModel model = FitPsfAlgorithm::apply(ctrl, psf, gridPoints[n]);
+            if (model.hasFailed()) {
+                ++failureCount;
+                continue;
+            }
+            models.push_back(model);
+            goodPoints.push_back(gridPoints[n]);
+        } catch (pex::exceptions::Exception &) {
+            ++failureCount;
+        }
+    }
+    ndarray::Array<double,2,2> values = ndarray::allocate(models.size(), getValueSize(ctrl));
+    for (std::size_t n = 0; n < models.size(); ++n) {
+        _writeVector(models[n], values[n]);
+    }
+    return values;
+}
+
+void FitPsfGrid::_writeVector(FitPsfModel const & model, ndarray::Array<double,1,1> const & vector) {
+    MultiGaussianObjective::EllipseCore core(model.ellipse);
+    core.writeParameters(vector.getData());
+    int const innerSize = model.inner.getSize<0>();
+    int const outerSize = model.outer.getSize<0>();
+    vector[ndarray::view(3, 3 + innerSize)].deep() = model.inner;
+    vector[ndarray::view(3 + innerSize, 3 + innerSize + outerSize)].deep() = model.outer;
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
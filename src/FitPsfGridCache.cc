@@ -0,0 +1,299 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "boost/format.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/make_shared.hpp"
+#include "boost/thread/thread.hpp"
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/meas/extensions/multiShapelet/FitPsfGridCache.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Increment whenever the file layout or the meaning of the saved values changes.
+boost::uint32_t const VERSION = 1;
+
+char const MAGIC[8] = { 'M', 'S', 'P', 'S', 'F', 'G', 'R', 'D' };
+
+// On-disk layout: this header, then pointCount (x, y) pairs, then a (pointCount, valueSize)
+// row-major array of values, all doubles.  The header size is a multiple of 8 bytes, so the
+// doubles that follow it in a memory-mapped file are properly aligned.
+struct Header {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t pointCount;
+    boost::uint32_t valueSize;
+    boost::int32_t failureCount;
+    boost::uint64_t exposure;
+    boost::uint64_t psf;
+    boost::uint64_t control;
+    double bbox[4];
+    boost::uint64_t checksum;  // hash of the data section
+};
+
+// 64-bit FNV-1a hash; unlike boost::hash, it's stable across platforms and library versions,
+// which is what we want for something written to disk.
+class Hasher {
+public:
+
+    void add(void const * data, std::size_t size) {
+        unsigned char const * bytes = reinterpret_cast<unsigned char const *>(data);
+        for (std::size_t n = 0; n < size; ++n) {
+            _value ^= bytes[n];
+            _value *= UINT64_C(1099511628211);
+        }
+    }
+
+    template <typename T>
+    void add(T const & value) { add(&value, sizeof(T)); }
+
+    boost::uint64_t getValue() const { return _value; }
+
+    Hasher() : _value(UINT64_C(14695981039346656037)) {}
+
+private:
+    boost::uint64_t _value;
+};
+
+void hashBBox(Hasher & hasher, afw::geom::Box2D const & bbox) {
+    hasher.add(bbox.getMinX());
+    hasher.add(bbox.getMinY());
+    hasher.add(bbox.getMaxX());
+    hasher.add(bbox.getMaxY());
+}
+
+// A read-only memory mapping of a complete file; empty if the file could not be mapped.
+class MappedFile : private boost::noncopyable {
+public:
+
+    explicit MappedFile(std::string const & filename) : _data(0), _size(0) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat status;
+        if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+            void * data = ::mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                _data = data;
+                _size = status.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    char const * getData() const { return reinterpret_cast<char const *>(_data); }
+
+    std::size_t getSize() const { return _size; }
+
+    ~MappedFile() { if (_data) ::munmap(_data, _size); }
+
+private:
+    void * _data;
+    std::size_t _size;
+};
+
+} // anonymous
+
+FitPsfGridCache::FitPsfGridCache(std::string const & directory) : _directory(directory) {}
+
+FitPsfGridCache::Key FitPsfGridCache::makeKey(
+    FitPsfControl const & ctrl,
+    afw::detection::Psf const & psf,
+    afw::geom::Box2D const & bbox,
+    CONST_PTR(daf::base::PropertySet) const & metadata
+) {
+    Key key;
+    Hasher exposureHasher;
+    hashBBox(exposureHasher, bbox);
+    if (metadata) {
+        for (std::size_t n = 0; n < ctrl.cacheMetadataKeys.size(); ++n) {
+            std::string const & name = ctrl.cacheMetadataKeys[n];
+            if (!metadata->exists(name)) continue;
+            daf::base::PropertySet entry;
+            entry.copy(name, metadata, name);
+            std::string s = entry.toString();
+            exposureHasher.add(s.data(), s.size());
+        }
+    }
+    key.exposure = exposureHasher.getValue();
+    // We only need to tell PSFs apart, not sample them as densely as the fit does, so we render
+    // the center and corners rather than every grid point.
+    Hasher psfHasher;
+    std::vector<afw::geom::Point2D> points;
+    points.push_back(bbox.getCenter());
+    points.push_back(bbox.getMin());
+    points.push_back(afw::geom::Point2D(bbox.getMaxX(), bbox.getMinY()));
+    points.push_back(afw::geom::Point2D(bbox.getMinX(), bbox.getMaxY()));
+    points.push_back(bbox.getMax());
+    for (std::size_t n = 0; n < points.size(); ++n) {
+        PTR(afw::image::Image<afw::math::Kernel::Pixel>) image = psf.computeImage(points[n]);
+        psfHasher.add(image->getX0());
+        psfHasher.add(image->getY0());
+        psfHasher.add(image->getWidth());
+        psfHasher.add(image->getHeight());
+        ndarray::Array<afw::math::Kernel::Pixel const,2,1> array = image->getArray();
+        for (int y = 0; y < array.getSize<0>(); ++y) {
+            psfHasher.add(array[y].getData(), array.getSize<1>() * sizeof(afw::math::Kernel::Pixel));
+        }
+    }
+    key.psf = psfHasher.getValue();
+    key.control = hashControl(ctrl);
+    return key;
+}
+
+boost::uint64_t FitPsfGridCache::hashControl(FitPsfControl const & ctrl) {
+    Hasher hasher;
+    hasher.add(VERSION);
+    hasher.add(ctrl.innerOrder);
+    hasher.add(ctrl.outerOrder);
+    hasher.add(ctrl.minRadius);
+    hasher.add(ctrl.minAxisRatio);
+    hasher.add(ctrl.radiusRatio);
+    hasher.add(ctrl.peakRatio);
+    hasher.add(ctrl.initialRadius);
+    hasher.add(ctrl.gridNx);
+    hasher.add(ctrl.gridNy);
+    hasher.add(ctrl.gridOrder);
+    hasher.add(ctrl.useNormalEquations);
+    return hasher.getValue();
+}
+
+std::string FitPsfGridCache::getFileName(Key const & key) const {
+    return (boost::format("%s/psfgrid-%016x-%016x-%016x.bin")
+            % _directory % key.exposure % key.psf % key.control).str();
+}
+
+CONST_PTR(FitPsfGrid) FitPsfGridCache::read(
+    Key const & key,
+    FitPsfControl const & ctrl,
+    afw::geom::Box2D const & bbox
+) const {
+    CONST_PTR(FitPsfGrid) result;
+    MappedFile file(getFileName(key));
+    if (file.getSize() < sizeof(Header)) return result;
+    Header header;
+    std::memcpy(&header, file.getData(), sizeof(Header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) return result;
+    if (header.exposure != key.exposure || header.psf != key.psf || header.control != key.control
+        || header.control != hashControl(ctrl)) {
+        return result;
+    }
+    if (header.bbox[0] != bbox.getMinX() || header.bbox[1] != bbox.getMinY()
+        || header.bbox[2] != bbox.getMaxX() || header.bbox[3] != bbox.getMaxY()) {
+        return result;
+    }
+    if (header.valueSize != boost::uint32_t(FitPsfGrid::getValueSize(ctrl))) return result;
+    std::size_t const dataSize = std::size_t(header.pointCount) * (2 + header.valueSize);
+    if (file.getSize() != sizeof(Header) + dataSize * sizeof(double)) return result;
+    double const * data = reinterpret_cast<double const *>(file.getData() + sizeof(Header));
+    Hasher checksum;
+    checksum.add(data, dataSize * sizeof(double));
+    if (checksum.getValue() != header.checksum) return result;
+    std::vector<afw::geom::Point2D> points;
+    points.reserve(header.pointCount);
+    for (std::size_t n = 0; n < header.pointCount; ++n) {
+        points.push_back(afw::geom::Point2D(data[2*n], data[2*n + 1]));
+    }
+    ndarray::Array<double const,2,2> values = ndarray::external(
+        data + 2 * header.pointCount,
+        ndarray::makeVector(int(header.pointCount), int(header.valueSize)),
+        ndarray::makeVector(int(header.valueSize), 1)
+    );
+    try {
+        // FitPsfGrid copies the values, so it's safe to unmap the file when we return.
+        result = boost::make_shared<FitPsfGrid>(ctrl, bbox, points, values, header.failureCount);
+    } catch (pex::exceptions::Exception &) {}
+    return result;
+}
+
+void FitPsfGridCache::write(Key const & key, FitPsfGrid const & grid) const {
+    ::mkdir(_directory.c_str(), 0777); // if this fails for any reason but EEXIST, opening the file will too
+    std::vector<afw::geom::Point2D> const & points = grid.getPoints();
+    ndarray::Array<double const,2,2> values = grid.getValues();
+    std::vector<double> data;
+    data.reserve(points.size() * (2 + values.getSize<1>()));
+    for (std::size_t n = 0; n < points.size(); ++n) {
+        data.push_back(points[n].getX());
+        data.push_back(points[n].getY());
+    }
+    data.insert(data.end(), values.getData(), values.getData() + values.getNumElements());
+    Header header;
+    std::memset(&header, 0, sizeof(Header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.pointCount = points.size();
+    header.valueSize = values.getSize<1>();
+    header.failureCount = grid.getFailureCount();
+    header.exposure = key.exposure;
+    header.psf = key.psf;
+    header.control = key.control;
+    header.bbox[0] = grid.getBBox().getMinX();
+    header.bbox[1] = grid.getBBox().getMinY();
+    header.bbox[2] = grid.getBBox().getMaxX();
+    header.bbox[3] = grid.getBBox().getMaxY();
+    Hasher checksum;
+    if (!data.empty()) {
+        checksum.add(&data.front(), data.size() * sizeof(double));
+    }
+    header.checksum = checksum.getValue();
+    std::string filename = getFileName(key);
+    // Unique to this thread, so concurrent writers never share a temporary file.
+    std::string tmpFilename
+        = (boost::format("%s.%d.%s.tmp") % filename % ::getpid() % boost::this_thread::get_id()).str();
+    {
+        std::ofstream stream(tmpFilename.c_str(), std::ios::binary | std::ios::trunc);
+        stream.write(reinterpret_cast<char const *>(&header), sizeof(Header));
+        if (!data.empty()) {
+            stream.write(reinterpret_cast<char const *>(&data.front()), data.size() * sizeof(double));
+        }
+        stream.close();
+        if (!stream) {
+            std::remove(tmpFilename.c_str());
+            throw LSST_EXCEPT(
+                pex::exceptions::IoError,
+                (boost::format("Could not write PSF grid cache file '%s'") % tmpFilename).str()
+            );
+        }
+    }
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpFilename.c_str());
+        throw LSST_EXCEPT(
+            pex::exceptions::IoError,
+            (boost::format("Could not rename PSF grid cache file to '%s'") % filename).str()
+        );
+    }
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
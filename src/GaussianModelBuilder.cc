@@ -31,7 +31,7 @@ GaussianModelBuilder::GaussianModelBuilder(
     double flux, double radius, afw::geom::ellipses::Quadrupole const & psfEllipse,
     double psfAmplitude
 ) : _flux(flux), _psfAmplitude(psfAmplitude),
-    _scaling(afw::geom::LinearTransform::makeScaling(radius)), _psfEllipse(psfEllipse),
+    _radius(radius), _psfEllipse(psfEllipse),
     _x(x), _y(y), _rx(x.size()), _ry(y.size())
 {
     if (_x.size() != _y.size()) {
@@ -45,7 +45,7 @@ GaussianModelBuilder::GaussianModelBuilder(
 
 GaussianModelBuilder::GaussianModelBuilder(GaussianModelBuilder const & other) :
     _flux(other._flux), _psfAmplitude(other._psfAmplitude),
-    _scaling(other._scaling), _psfEllipse(other._psfEllipse),
+    _radius(other._radius), _psfEllipse(other._psfEllipse),
     _esn(other._esn), _esnJacobian(other._esnJacobian), _dNorm(other._dNorm),
     _x(other._x), _y(other._y), _rx(other._rx), _ry(other._ry)
 {}
@@ -54,7 +54,7 @@ GaussianModelBuilder & GaussianModelBuilder::operator=(GaussianModelBuilder cons
     if (&other != this) {
         _flux = other._flux;
         _psfAmplitude = other._psfAmplitude;
-        _scaling = other._scaling;
+        _radius = other._radius;
         _psfEllipse = other._psfEllipse;
         _x.reset(other._x.shallow());
         _y.reset(other._y.shallow());
@@ -69,12 +69,23 @@ GaussianModelBuilder & GaussianModelBuilder::operator=(GaussianModelBuilder cons
 }
 
 void GaussianModelBuilder::update(afw::geom::ellipses::BaseCore const & core) {
-    Eigen::Matrix3d scaleJac = core.transform(_scaling).d();
-    PTR(afw::geom::ellipses::BaseCore) ellipse = core.transform(_scaling).copy();
-    Eigen::Matrix3d convJac = ellipse->convolve(_psfEllipse).d();
-    ellipse->convolve(_psfEllipse).inPlace();
-    afw::geom::ellipses::Quadrupole q;
-    Eigen::Matrix3d quadJacobian = q.dAssign(*ellipse) * convJac * scaleJac;
+    afw::geom::ellipses::Quadrupole ellipse;
+    Eigen::Matrix3d jacobian = ellipse.dAssign(core);
+    update(ellipse, jacobian);
+}
+
+void GaussianModelBuilder::update(
+    afw::geom::ellipses::Quadrupole const & ellipse,
+    Eigen::Matrix3d const & jacobian
+) {
+    // Scaling by the radius multiplies the moments by radius^2, and convolving adds the PSF moments.
+    double const r2 = _radius * _radius;
+    afw::geom::ellipses::Quadrupole q(
+        r2 * ellipse.getIxx() + _psfEllipse.getIxx(),
+        r2 * ellipse.getIyy() + _psfEllipse.getIyy(),
+        r2 * ellipse.getIxy() + _psfEllipse.getIxy()
+    );
+    Eigen::Matrix3d quadJacobian = r2 * jacobian;
     _esnJacobian = _esn.update(q) * quadJacobian; 
     if (_model.isEmpty()) {
         _model = ndarray::allocate(_x.size());
@@ -0,0 +1,176 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "boost/make_shared.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/MixtureKernel.h"
+#include "lsst/meas/extensions/multiShapelet/EllipseSquaredNorm.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Per-component constants, updated once per evaluation.
+struct Term {
+    EllipseSquaredNorm esn;
+    double norm;
+    Eigen::Matrix3d jacobian;
+    Eigen::RowVector3d dNorm;
+};
+
+template <int N>
+class FixedMixtureKernel : public MixtureKernel {
+public:
+
+    // All the profile components convolved with a single PSF component.
+    struct Block {
+        afw::geom::ellipses::Quadrupole psfEllipse;
+        double psfFlux;
+        Term terms[N];
+    };
+
+    FixedMixtureKernel(
+        ndarray::Array<double const,1,1> const & x,
+        ndarray::Array<double const,1,1> const & y,
+        MultiGaussian const & multiGaussian,
+        MultiGaussian const & psfMultiGaussian,
+        afw::geom::ellipses::Quadrupole const & psfEllipse
+    ) : _x(x), _y(y), _blocks(psfMultiGaussian.size()) {
+        for (int i = 0; i < N; ++i) {
+            _flux[i] = multiGaussian[i].flux;
+            _radiusSquared[i] = multiGaussian[i].radius * multiGaussian[i].radius;
+        }
+        for (std::size_t j = 0; j < _blocks.size(); ++j) {
+            _blocks[j].psfEllipse = psfEllipse;
+            _blocks[j].psfEllipse.scale(psfMultiGaussian[j].radius);
+            _blocks[j].psfFlux = psfMultiGaussian[j].flux;
+        }
+    }
+
+    virtual void update(afw::geom::ellipses::Quadrupole const & ellipse, Eigen::Matrix3d const & jacobian) {
+        // This is the same math as GaussianModelBuilder::update, for each convolved component.
+        for (typename std::vector<Block>::iterator j = _blocks.begin(); j != _blocks.end(); ++j) {
+            for (int i = 0; i < N; ++i) {
+                Term & t = j->terms[i];
+                double const r2 = _radiusSquared[i];
+                afw::geom::ellipses::Quadrupole q(
+                    r2 * ellipse.getIxx() + j->psfEllipse.getIxx(),
+                    r2 * ellipse.getIyy() + j->psfEllipse.getIyy(),
+                    r2 * ellipse.getIxy() + j->psfEllipse.getIxy()
+                );
+                Eigen::Matrix3d quadJacobian = r2 * jacobian;
+                t.jacobian = t.esn.update(q) * quadJacobian;
+                double det = q.getDeterminant();
+                Eigen::RowVector3d dNorm_dq;
+                dNorm_dq[0] = -0.5 * q.getIyy() / det;
+                dNorm_dq[1] = -0.5 * q.getIxx() / det;
+                dNorm_dq[2] = q.getIxy() / det;
+                t.dNorm = dNorm_dq * quadJacobian;
+                t.norm = (_flux[i] * j->psfFlux) / (std::sqrt(det) * afw::geom::PI * 2.0);
+            }
+        }
+    }
+
+    virtual void computeModel(ndarray::Array<double,1,1> const & model) const {
+        int const size = _x.getSize<0>();
+        _values.resize(N * _blocks.size(), size);
+        for (int p = 0; p < size; ++p) {
+            double const x = _x[p];
+            double const y = _y[p];
+            double m = 0.0;
+            int c = 0;
+            for (typename std::vector<Block>::const_iterator j = _blocks.begin(); j != _blocks.end(); ++j) {
+                for (int i = 0; i < N; ++i, ++c) {
+                    double rx, ry, z;
+                    j->terms[i].esn(x, y, rx, ry, z);
+                    m += _values(c, p) = j->terms[i].norm * std::exp(-0.5 * z);
+                }
+            }
+            model[p] = m;
+        }
+    }
+
+    virtual void computeDerivative(ndarray::Array<double,2,-2> const & derivative) const {
+        int const size = _x.getSize<0>();
+        assert(_values.cols() == size);
+        for (int p = 0; p < size; ++p) {
+            double const x = _x[p];
+            double const y = _y[p];
+            Eigen::RowVector3d d = Eigen::RowVector3d::Zero();
+            int c = 0;
+            for (typename std::vector<Block>::const_iterator j = _blocks.begin(); j != _blocks.end(); ++j) {
+                for (int i = 0; i < N; ++i, ++c) {
+                    Term const & t = j->terms[i];
+                    double rx, ry, z;
+                    t.esn(x, y, rx, ry, z);
+                    double const m = _values(c, p);
+                    Eigen::RowVector3d dz = Eigen::RowVector3d::Zero();
+                    t.esn.dEllipse(x, y, rx, ry, t.jacobian, dz);
+                    d += m * (t.dNorm - 0.5 * dz);
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                derivative[p][k] += d[k];
+            }
+        }
+    }
+
+private:
+    ndarray::Array<double const,1,1> _x;
+    ndarray::Array<double const,1,1> _y;
+    double _flux[N];
+    double _radiusSquared[N];
+    std::vector<Block> _blocks;
+    mutable Eigen::ArrayXXd _values; // (component, pixel) values from the last call to computeModel()
+};
+
+} // anonymous
+
+PTR(MixtureKernel) MixtureKernel::make(
+    ndarray::Array<double const,1,1> const & x,
+    ndarray::Array<double const,1,1> const & y,
+    MultiGaussian const & multiGaussian,
+    MultiGaussian const & psfMultiGaussian,
+    afw::geom::ellipses::Quadrupole const & psfEllipse
+) {
+    // Specializations for the sizes of the built-in profiles (see BuiltinProfiles.h) and the
+    // reduced profiles in data/reduced.mgp.
+    switch (multiGaussian.size()) {
+    case 3:
+        return boost::make_shared< FixedMixtureKernel<3> >(x, y, multiGaussian, psfMultiGaussian, psfEllipse);
+    case 4:
+        return boost::make_shared< FixedMixtureKernel<4> >(x, y, multiGaussian, psfMultiGaussian, psfEllipse);
+    case 6:
+        return boost::make_shared< FixedMixtureKernel<6> >(x, y, multiGaussian, psfMultiGaussian, psfEllipse);
+    case 8:
+        return boost::make_shared< FixedMixtureKernel<8> >(x, y, multiGaussian, psfMultiGaussian, psfEllipse);
+    default:
+        return PTR(MixtureKernel)();
+    }
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
@@ -108,6 +108,11 @@ ModelInputHandler::ModelInputHandler(
     }
     _data = ndarray::allocate(_footprint->getArea());
     afw::detection::flattenArray(*_footprint, image.getArray(), _data, image.getXY0());
+    if (image.getBBox().contains(region)) {
+        // No clipping, so the pixels are the complete box (usually a PSF image).
+        _boxDimensions = region.getDimensions();
+        _boxCenter = afw::geom::Point2D(center.getX() - region.getMinX(), center.getY() - region.getMinY());
+    }
     initCoords(_x, _y, *_footprint, center);
 }
 
@@ -21,16 +21,77 @@
  * see <http://www.lsstcorp.org/LegalNotices/>.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #include "lsst/utils/ieee.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianObjective.h"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
+namespace {
+
+// Inner product of two unit-flux Gaussians with moments (xx, yy, xy) a and b.
+double computeOverlap(Eigen::Vector3d const & a, Eigen::Vector3d const & b) {
+    Eigen::Vector3d s = a + b;
+    return 1.0 / (2.0 * afw::geom::PI * std::sqrt(s[0] * s[1] - s[2] * s[2]));
+}
+
+// Squared L2 norm of the sum of the Gaussians with moments (xx, yy, xy) given by the columns of
+// 'moments' and fluxes given by 'flux', restricted to the indices in 'group'.
+double computeSquaredNorm(
+    std::vector<int> const & group,
+    Eigen::Matrix3Xd const & moments,
+    Eigen::VectorXd const & flux
+) {
+    double result = 0.0;
+    for (std::size_t k = 0; k < group.size(); ++k) {
+        Eigen::Vector3d mk = moments.col(group[k]);
+        for (std::size_t l = 0; l < group.size(); ++l) {
+            result += flux[group[k]] * flux[group[l]] * computeOverlap(mk, moments.col(group[l]));
+        }
+    }
+    return result;
+}
+
+// Squared L2 norm of the difference between a group of Gaussians and a single Gaussian with the
+// same total flux and second moments.
+double computeMergeError(
+    std::vector<int> const & group,
+    Eigen::Matrix3Xd const & moments,
+    Eigen::VectorXd const & flux
+) {
+    double total = 0.0;
+    Eigen::Vector3d merged = Eigen::Vector3d::Zero();
+    for (std::size_t k = 0; k < group.size(); ++k) {
+        total += flux[group[k]];
+        merged += flux[group[k]] * moments.col(group[k]);
+    }
+    merged /= total;
+    double result = total * total * computeOverlap(merged, merged) + computeSquaredNorm(group, moments, flux);
+    for (std::size_t k = 0; k < group.size(); ++k) {
+        result -= 2.0 * total * flux[group[k]] * computeOverlap(moments.col(group[k]), merged);
+    }
+    return std::max(result, 0.0);
+}
+
+struct CompareRadius {
+    bool operator()(int a, int b) const { return radii[a] < radii[b]; }
+    explicit CompareRadius(std::vector<double> const & radii_) : radii(radii_) {}
+    std::vector<double> const & radii;
+};
+
+} // anonymous
+
+double const MultiGaussianObjective::PRUNE_PARAMETER_CHANGE = 0.25;
+
 MultiGaussianObjective::MultiGaussianObjective(
     ModelInputHandler const & inputs,
     MultiGaussian const & multiGaussian,
     double minRadius, double minAxisRatio
-) : Objective(inputs.getSize(), 3), _minRadius(minRadius), _minAxisRatio(minAxisRatio), 
+) : Objective(inputs.getSize(), 3), _sharedNorm(true), _minRadius(minRadius), _minAxisRatio(minAxisRatio),
+    _componentTolerance(0.0), _maxBuilders(0), _pruningError(0.0), _evaluationCount(0),
     _amplitude(1.0), _modelSquaredNorm(1.0),
     _ellipse(), _inputs(inputs), _model(ndarray::allocate(inputs.getSize()))
 {
@@ -46,15 +107,15 @@ MultiGaussianObjective::MultiGaussianObjective(
             "Minimum axis ratio must be between 0 and 1"
         );
     }
-    _builders.reserve(multiGaussian.size());
+    _components.reserve(multiGaussian.size());
     for (MultiGaussian::const_iterator i = multiGaussian.begin(); i != multiGaussian.end(); ++i) {
-        _builders.push_back(
-            GaussianModelBuilder(
-                _inputs.getX(), _inputs.getY(), i->flux, i->radius,
-                afw::geom::ellipses::Quadrupole(0.0, 0.0, 0.0), 1.0
-            )
-        );
+        Component component = { i->flux, i->radius, 0, afw::geom::ellipses::Quadrupole(0.0, 0.0, 0.0) };
+        _components.push_back(component);
     }
+    _rx.resize(_inputs.getSize());
+    _ry.resize(_inputs.getSize());
+    _sharedModel.resize(_inputs.getSize());
+    _sharedModelDerivative.resize(_inputs.getSize());
 }
 
 MultiGaussianObjective::MultiGaussianObjective(
@@ -62,8 +123,10 @@ MultiGaussianObjective::MultiGaussianObjective(
     MultiGaussian const & multiGaussian,
     MultiGaussian const & psfMultiGaussian,
     afw::geom::ellipses::Quadrupole const & psfEllipse,
-    double minRadius, double minAxisRatio
-) : Objective(inputs.getSize(), 3), _minRadius(minRadius), _minAxisRatio(minAxisRatio),
+    double minRadius, double minAxisRatio, double componentTolerance, int maxBuilders
+) : Objective(inputs.getSize(), 3), _sharedNorm(false), _minRadius(minRadius), _minAxisRatio(minAxisRatio),
+    _componentTolerance(componentTolerance), _maxBuilders(maxBuilders), _pruningError(0.0),
+    _evaluationCount(0),
     _amplitude(1.0), _modelSquaredNorm(1.0),
     _ellipse(), _inputs(inputs), _model(ndarray::allocate(inputs.getSize()))
 {
@@ -79,21 +142,226 @@ MultiGaussianObjective::MultiGaussianObjective(
             "Minimum axis ratio must be between 0 and 1"
         );
     }
-    _builders.reserve(multiGaussian.size() * psfMultiGaussian.size());
+    _components.reserve(multiGaussian.size() * psfMultiGaussian.size());
     for (MultiGaussian::const_iterator j = psfMultiGaussian.begin(); j != psfMultiGaussian.end(); ++j) {
         afw::geom::ellipses::Quadrupole psfComponentEllipse(psfEllipse);
         psfComponentEllipse.scale(j->radius);
         for (MultiGaussian::const_iterator i = multiGaussian.begin(); i != multiGaussian.end(); ++i) {
+            Component component = {
+                i->flux * j->flux, i->radius, int(j - psfMultiGaussian.begin()), psfComponentEllipse
+            };
+            _components.push_back(component);
+        }
+    }
+    if (_componentTolerance <= 0.0 && _maxBuilders <= 0) {
+        // No pruning; use a fused kernel if there's one for this profile size, and otherwise
+        // we set up one builder per component here, instead of in pruneBuilders().
+        _kernel = MixtureKernel::make(_inputs.getX(), _inputs.getY(), multiGaussian, psfMultiGaussian,
+                                      psfEllipse);
+    }
+    if (_componentTolerance <= 0.0 && _maxBuilders <= 0 && !_kernel) {
+        _builders.reserve(_components.size());
+        for (ComponentList::const_iterator k = _components.begin(); k != _components.end(); ++k) {
             _builders.push_back(
                 GaussianModelBuilder(
-                    _inputs.getX(), _inputs.getY(), i->flux, i->radius,
-                    psfComponentEllipse, j->flux
+                    _inputs.getX(), _inputs.getY(), k->flux, k->radius, k->psfEllipse, 1.0
                 )
             );
         }
     }
 }
 
+void MultiGaussianObjective::computeSharedModel(ndarray::EigenView<double,1,1> & model) {
+    // With z the squared norm for the ellipse Q, the component with radius r_k has squared norm
+    // z/r_k^2 and determinant r_k^4 |Q|, so the model is f(z)/sqrt(|Q|) with
+    // f(z) = sum_k flux_k exp(-z/(2 r_k^2)) / (2 pi r_k^2).  We save df/dz for the derivative.
+    Eigen::Matrix3d quadJacobian;
+    afw::geom::ellipses::Quadrupole q = computeQuadrupole(_ellipse, quadJacobian);
+    _esnJacobian = _esn.update(q) * quadJacobian;
+    ndarray::EigenView<double const,1,1> x(_inputs.getX());
+    ndarray::EigenView<double const,1,1> y(_inputs.getY());
+    Eigen::VectorXd & z = _sharedModelDerivative; // z is replaced by df/dz below
+    _esn(x, y, _rx, _ry, z);
+    double det = q.getDeterminant();
+    Eigen::RowVector3d dNorm_dq;
+    dNorm_dq[0] = -0.5 * q.getIyy() / det;
+    dNorm_dq[1] = -0.5 * q.getIxx() / det;
+    dNorm_dq[2] = q.getIxy() / det;
+    _dNorm = dNorm_dq * quadJacobian;
+    double const norm = 1.0 / (std::sqrt(det) * afw::geom::PI * 2.0);
+    for (int p = 0; p < z.size(); ++p) {
+        double f = 0.0;
+        double df = 0.0;
+        for (ComponentList::const_iterator k = _components.begin(); k != _components.end(); ++k) {
+            double s = 1.0 / (k->radius * k->radius);
+            double g = k->flux * s * std::exp(-0.5 * s * z[p]);
+            f += g;
+            df -= 0.5 * s * g;
+        }
+        _sharedModel[p] = norm * f;
+        z[p] = norm * df;
+    }
+    model = _sharedModel;
+}
+
+void MultiGaussianObjective::computeSharedDerivative(ndarray::Array<double,2,-2> const & derivative) {
+    ndarray::EigenView<double const,1,1> x(_inputs.getX());
+    ndarray::EigenView<double const,1,1> y(_inputs.getY());
+    Eigen::MatrixXd dz_de = Eigen::MatrixXd::Zero(_inputs.getSize(), _esnJacobian.cols());
+    _esn.dEllipse(x, y, _rx, _ry, _esnJacobian, dz_de);
+    for (int n = 0; n < _esnJacobian.cols(); ++n) {
+        dz_de.col(n).array() *= _sharedModelDerivative.array();
+    }
+    derivative.asEigen() += dz_de;
+    derivative.asEigen() += _sharedModel * _dNorm;
+}
+
+void MultiGaussianObjective::pruneBuilders() {
+    // Any group of components can be replaced by a single Gaussian with the same flux and second
+    // moments; because the moments of each component are r_k^2 Q + P_k for ellipse moments Q, the
+    // merged Gaussian has moments r^2 Q + P with r^2 and P the flux-weighted means of r_k^2 and P_k,
+    // so it can be represented (with exact derivatives) by a GaussianModelBuilder.
+    //
+    // If there's a tolerance, we first group components that share a PSF component, in order of
+    // increasing radius, allowing each merge to change the model by 1/n of the tolerance, and drop
+    // groups whose total contribution is smaller than that.  If there's a maximum number of builders,
+    // we then greedily merge the pair of groups (from any PSF components) that increases the error
+    // the least, until we reach that number or (with a tolerance) exhaust the error budget.
+    // We track the error bound as the sum of the L2 norms of the changes due to each group.
+    int const n = _components.size();
+    Eigen::Matrix2d q = afw::geom::ellipses::Quadrupole(_ellipse).getMatrix();
+    Eigen::Matrix3Xd moments(3, n);
+    Eigen::VectorXd flux(n);
+    std::vector<double> radii(n);
+    std::vector<int> all(n);
+    for (int k = 0; k < n; ++k) {
+        Component const & c = _components[k];
+        Eigen::Matrix2d m = c.radius * c.radius * q + c.psfEllipse.getMatrix();
+        moments.col(k) << m(0, 0), m(1, 1), m(0, 1);
+        flux[k] = c.flux;
+        radii[k] = c.radius;
+        all[k] = k;
+    }
+    double const modelNorm = std::sqrt(computeSquaredNorm(all, moments, flux));
+    double const maxError = modelNorm * _componentTolerance;
+    double spent = 0.0;
+    std::vector< std::vector<int> > groups;
+    std::vector<double> errors; // L2 norm of the change due to merging each group
+    if (_componentTolerance > 0.0) {
+        double const maxSquaredError = (maxError / n) * (maxError / n);
+        CompareRadius compare(radii);
+        std::vector<int> largest; // the group with the largest norm, in case we drop them all
+        double largestSquaredNorm = -1.0;
+        double largestSquaredError = 0.0;
+        for (int begin = 0, end = 0; begin < n; begin = end) {
+            while (end < n && _components[end].psfIndex == _components[begin].psfIndex) ++end;
+            std::stable_sort(all.begin() + begin, all.begin() + end, compare);
+            std::vector<int> group(1, all[begin]);
+            double squaredError = 0.0;
+            for (int k = begin + 1; k <= end; ++k) {
+                if (k < end) {
+                    std::vector<int> candidate(group);
+                    candidate.push_back(all[k]);
+                    double candidateSquaredError = computeMergeError(candidate, moments, flux);
+                    if ((flux[all[k]] > 0.0) == (flux[group.front()] > 0.0)
+                        && candidateSquaredError <= maxSquaredError) {
+                        group.swap(candidate);
+                        squaredError = candidateSquaredError;
+                        continue;
+                    }
+                }
+                double squaredNorm = computeSquaredNorm(group, moments, flux);
+                if (squaredNorm > largestSquaredNorm) {
+                    largest = group;
+                    largestSquaredNorm = squaredNorm;
+                    largestSquaredError = squaredError;
+                }
+                if (squaredNorm > maxSquaredError) {
+                    groups.push_back(group);
+                    errors.push_back(std::sqrt(squaredError));
+                } else {
+                    spent += std::sqrt(squaredNorm);
+                }
+                if (k < end) {
+                    group.assign(1, all[k]);
+                    squaredError = 0.0;
+                }
+            }
+        }
+        if (groups.empty()) {
+            // Never drop everything; keep the group that contributes the most.
+            groups.push_back(largest);
+            errors.push_back(std::sqrt(largestSquaredError));
+            spent -= std::sqrt(largestSquaredNorm);
+        }
+    } else {
+        for (int k = 0; k < n; ++k) {
+            groups.push_back(std::vector<int>(1, k));
+            errors.push_back(0.0);
+        }
+    }
+    for (std::size_t g = 0; g < errors.size(); ++g) {
+        spent += errors[g];
+    }
+    while (_maxBuilders > 0 && groups.size() > std::size_t(_maxBuilders)) {
+        std::size_t bestA = 0, bestB = 0;
+        double bestIncrease = std::numeric_limits<double>::infinity();
+        double bestError = 0.0;
+        for (std::size_t a = 0; a < groups.size(); ++a) {
+            for (std::size_t b = a + 1; b < groups.size(); ++b) {
+                if ((flux[groups[a].front()] > 0.0) != (flux[groups[b].front()] > 0.0)) continue;
+                std::vector<int> candidate(groups[a]);
+                candidate.insert(candidate.end(), groups[b].begin(), groups[b].end());
+                double error = std::sqrt(computeMergeError(candidate, moments, flux));
+                double increase = error - errors[a] - errors[b];
+                if (increase < bestIncrease) {
+                    bestA = a;
+                    bestB = b;
+                    bestIncrease = increase;
+                    bestError = error;
+                }
+            }
+        }
+        if (bestA == bestB || (_componentTolerance > 0.0 && spent + bestIncrease > maxError)) break;
+        groups[bestA].insert(groups[bestA].end(), groups[bestB].begin(), groups[bestB].end());
+        errors[bestA] = bestError;
+        groups.erase(groups.begin() + bestB);
+        errors.erase(errors.begin() + bestB);
+        spent += bestIncrease;
+    }
+    // Compute the actual relative L2 error of the pruned model, by differencing it with the full model.
+    Eigen::Matrix3Xd allMoments(3, n + groups.size());
+    Eigen::VectorXd allFlux(n + groups.size());
+    allMoments.leftCols(n) = moments;
+    allFlux.head(n) = flux;
+    _builders.clear();
+    for (std::size_t g = 0; g < groups.size(); ++g) {
+        double groupFlux = 0.0;
+        double groupRadiusSquared = 0.0;
+        Eigen::Vector3d groupMoments = Eigen::Vector3d::Zero();
+        Eigen::Matrix2d groupPsfMoments = Eigen::Matrix2d::Zero();
+        for (std::size_t i = 0; i < groups[g].size(); ++i) {
+            int k = groups[g][i];
+            groupFlux += flux[k];
+            groupRadiusSquared += flux[k] * radii[k] * radii[k];
+            groupMoments += flux[k] * moments.col(k);
+            groupPsfMoments += flux[k] * _components[k].psfEllipse.getMatrix();
+        }
+        allMoments.col(n + g) = groupMoments / groupFlux;
+        allFlux[n + g] = -groupFlux;
+        _builders.push_back(
+            GaussianModelBuilder(
+                _inputs.getX(), _inputs.getY(), groupFlux, std::sqrt(groupRadiusSquared / groupFlux),
+                afw::geom::ellipses::Quadrupole(Eigen::Matrix2d(groupPsfMoments / groupFlux)), 1.0
+            )
+        );
+    }
+    all.resize(n + groups.size());
+    for (std::size_t k = n; k < all.size(); ++k) all[k] = k;
+    _pruningError = std::sqrt(std::max(computeSquaredNorm(all, allMoments, allFlux), 0.0)) / modelNorm;
+    _pruneEllipse = _ellipse;
+}
+
 Objective::StepResult MultiGaussianObjective::tryStep(
     ndarray::Array<double const,1,1> const & oldParameters, 
     ndarray::Array<double,1,1> const & newParameters
@@ -118,12 +386,33 @@ void MultiGaussianObjective::computeFunction(
     ndarray::Array<double,1,1> const & function
 ) {
     _ellipse.readParameters(parameters.getData());
+    if ((_componentTolerance > 0.0 || _maxBuilders > 0)
+        && (_builders.empty()
+            || std::abs(_ellipse.getRadius() - _pruneEllipse.getRadius()) > PRUNE_PARAMETER_CHANGE
+            || std::abs(_ellipse.getEllipticity().getE1() - _pruneEllipse.getEllipticity().getE1())
+                > PRUNE_PARAMETER_CHANGE
+            || std::abs(_ellipse.getEllipticity().getE2() - _pruneEllipse.getEllipticity().getE2())
+                > PRUNE_PARAMETER_CHANGE)) {
+        pruneBuilders();
+    }
     ndarray::EigenView<double,1,1> model(_model);
-    model.setZero();
-    for (std::size_t n = 0; n < _builders.size(); ++n) {
-        _builders[n].update(_ellipse);
-        model += _builders[n].getModel().asEigen();
+    if (_sharedNorm) {
+        computeSharedModel(model);
+    } else {
+        Eigen::Matrix3d jacobian;
+        afw::geom::ellipses::Quadrupole q = computeQuadrupole(_ellipse, jacobian);
+        if (_kernel) {
+            _kernel->update(q, jacobian);
+            _kernel->computeModel(_model);
+        } else {
+            model.setZero();
+            for (std::size_t n = 0; n < _builders.size(); ++n) {
+                _builders[n].update(q, jacobian);
+                model += _builders[n].getModel().asEigen();
+            }
+        }
     }
+    _evaluationCount += getBuilderCount();
     if (!_inputs.getWeights().isEmpty()) {
         model.array() *= _inputs.getWeights().asEigen<Eigen::ArrayXpr>();
     }
@@ -138,6 +427,11 @@ void MultiGaussianObjective::computeDerivative(
     ndarray::Array<double,2,-2> const & derivative
 ) {
     derivative.asEigen().setZero();
+    if (_sharedNorm) {
+        computeSharedDerivative(derivative);
+    } else if (_kernel) {
+        _kernel->computeDerivative(derivative);
+    }
     for (std::size_t n = 0; n < _builders.size(); ++n) {
         _builders[n].computeDerivative(derivative, true);
     }
@@ -163,6 +457,42 @@ MultiGaussianObjective::readParameters(ndarray::Array<double const,1,1> const &
     return r;
 }
 
+afw::geom::ellipses::Quadrupole MultiGaussianObjective::computeQuadrupole(
+    EllipseCore const & ellipse,
+    Eigen::Matrix3d & jacobian
+) {
+    // The conformal shear eta has magnitude ln(a/b), so the distortion (the ellipticity of the
+    // moments) is delta = tanh(|eta|) eta / |eta|.  With r^2 = exp(2 * LogTraceRadius) = (Ixx + Iyy)/2,
+    // the moments are r^2 (1 + delta_1, 1 - delta_1, delta_2).
+    double const eta1 = ellipse.getEllipticity().getE1();
+    double const eta2 = ellipse.getEllipticity().getE2();
+    double const eta = std::sqrt(eta1 * eta1 + eta2 * eta2);
+    double const r2 = std::exp(2.0 * ellipse.getRadius());
+    // f = tanh(eta)/eta, g = f'(eta)/eta; we use series expansions near zero.
+    double f, g;
+    if (eta < 1E-4) {
+        double etaSquared = eta * eta;
+        f = 1.0 - etaSquared / 3.0;
+        g = -2.0 / 3.0 + 8.0 * etaSquared / 15.0;
+    } else {
+        double t = std::tanh(eta);
+        f = t / eta;
+        g = ((1.0 - t * t) * eta - t) / (eta * eta * eta);
+    }
+    double const delta1 = f * eta1;
+    double const delta2 = f * eta2;
+    afw::geom::ellipses::Quadrupole result(r2 * (1.0 + delta1), r2 * (1.0 - delta1), r2 * delta2);
+    // d(delta_i)/d(eta_j) = f I_ij + g eta_i eta_j
+    double const d11 = f + g * eta1 * eta1;
+    double const d12 = g * eta1 * eta2;
+    double const d22 = f + g * eta2 * eta2;
+    jacobian <<
+         r2 * d11,  r2 * d12, 2.0 * result.getIxx(),
+        -r2 * d11, -r2 * d12, 2.0 * result.getIyy(),
+         r2 * d12,  r2 * d22, 2.0 * result.getIxy();
+    return result;
+}
+
 void MultiGaussianObjective::writeParameters(
     EllipseCore const & ellipse,
     ndarray::Array<double,1,1> const & parameters
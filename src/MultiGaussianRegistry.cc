@@ -22,25 +22,223 @@
  */
 
 #include <list>
+#include <map>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "boost/format.hpp"
+#include "boost/noncopyable.hpp"
+#include "boost/cstdint.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/make_shared.hpp"
+#include "boost/thread/mutex.hpp"
 
 #include "lsst/pex/exceptions.h"
 #include "lsst/meas/extensions/multiShapelet/MultiGaussianRegistry.h"
+#include "lsst/meas/extensions/multiShapelet/BuiltinProfiles.h"
 
 namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
 
 namespace {
 
+// Guards the registry list and the profile file list; lookup() reorders the registry list, so
+// even lookups need it.
+boost::mutex registryMutex;
+
 typedef std::pair<std::string,MultiGaussian> RegistryItem;
 typedef std::list<RegistryItem> RegistryList;
 
+// Callers must hold registryMutex: the builtin profiles are inserted lazily, on first use.
 RegistryList & getRegistryList() {
     static RegistryList it;
+    if (it.empty()) {
+        // Profiles compiled into the library are always available, but may be replaced by insert().
+        it.push_back(RegistryItem(TractorExponentialProfile::NAME,
+                                  makeMultiGaussian<TractorExponentialProfile>()));
+        it.push_back(RegistryItem(TractorDeVaucouleurProfile::NAME,
+                                  makeMultiGaussian<TractorDeVaucouleurProfile>()));
+    }
     return it;
 }
 
+// Increment whenever the layout of profile files changes.
+boost::uint32_t const VERSION = 1;
+
+char const MAGIC[8] = { 'M', 'S', 'P', 'R', 'O', 'F', 'I', 'L' };
+
+struct FileHeader {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t count;
+};
+
+struct ProfileHeader {
+    boost::uint32_t nameSize;
+    boost::uint32_t componentCount;
+};
+
+// Profile files are little-endian, and we read them in place.
+bool isLittleEndian() {
+    boost::uint32_t const one = 1;
+    return *reinterpret_cast<unsigned char const *>(&one) == 1;
+}
+
+// A read-only memory mapping of a profile file, with an index of the profiles it contains.  We
+// only copy a profile out of the mapping when it's looked up, so the cost of opening a file
+// with many profiles is just that of reading the names.
+class ProfileFile : private boost::noncopyable {
+public:
+
+    explicit ProfileFile(std::string const & filename) : _filename(filename), _data(0), _size(0) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw LSST_EXCEPT(
+                pex::exceptions::IoError,
+                (boost::format("Could not open profile file '%s'") % filename).str()
+            );
+        }
+        struct stat status;
+        if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+            void * data = ::mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                _data = data;
+                _size = status.st_size;
+            }
+        }
+        ::close(fd);
+        if (!_data) {
+            throw LSST_EXCEPT(
+                pex::exceptions::IoError,
+                (boost::format("Could not map profile file '%s'") % filename).str()
+            );
+        }
+        try {
+            readIndex();
+        } catch (...) {
+            ::munmap(_data, _size);
+            throw;
+        }
+    }
+
+    /// Copy the named profile into multiGaussian and return true, or return false if not present.
+    bool get(std::string const & name, MultiGaussian & multiGaussian) const {
+        Index::const_iterator i = _index.find(name);
+        if (i == _index.end()) return false;
+        multiGaussian = MultiGaussian();
+        double const * fluxes = reinterpret_cast<double const *>(getData() + i->second.first);
+        double const * radii = fluxes + i->second.second;
+        for (std::size_t n = 0; n < i->second.second; ++n) {
+            multiGaussian.add(GaussianComponent(fluxes[n], radii[n]));
+        }
+        return true;
+    }
+
+    ~ProfileFile() { ::munmap(_data, _size); }
+
+private:
+
+    // Map from name to (offset of the fluxes, number of components).
+    typedef std::map< std::string, std::pair<std::size_t,std::size_t> > Index;
+
+    char const * getData() const { return reinterpret_cast<char const *>(_data); }
+
+    void fail(std::string const & message) const {
+        throw LSST_EXCEPT(
+            pex::exceptions::IoError,
+            (boost::format("Invalid profile file '%s': %s") % _filename % message).str()
+        );
+    }
+
+    void readIndex() {
+        if (!isLittleEndian()) fail("profile files can only be read on little-endian platforms");
+        if (_size < sizeof(FileHeader)) fail("file is too small for header");
+        FileHeader header;
+        std::memcpy(&header, getData(), sizeof(FileHeader));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) fail("bad magic number");
+        if (header.version != VERSION) {
+            fail((boost::format("version %d is not supported (expected %d)")
+                  % header.version % VERSION).str());
+        }
+        // Every section is a multiple of 8 bytes, so the doubles in a mapped file are aligned.
+        std::size_t offset = sizeof(FileHeader);
+        for (std::size_t n = 0; n < header.count; ++n) {
+            if (_size - offset < sizeof(ProfileHeader)) fail("file is truncated");
+            ProfileHeader profile;
+            std::memcpy(&profile, getData() + offset, sizeof(ProfileHeader));
+            offset += sizeof(ProfileHeader);
+            // Check the sizes against the remaining bytes before padding or adding them, so
+            // corrupt values can't overflow.
+            if (std::size_t(profile.nameSize) > _size - offset) fail("file is truncated");
+            std::size_t const nameSize = ((std::size_t(profile.nameSize) + 7) / 8) * 8;
+            if (nameSize > _size - offset) fail("file is truncated");
+            if (std::size_t(profile.componentCount) > (_size - offset - nameSize) / (2 * sizeof(double))) {
+                fail("file is truncated");
+            }
+            std::size_t const dataSize = 2 * sizeof(double) * std::size_t(profile.componentCount);
+            std::string name(getData() + offset, profile.nameSize);
+            offset += nameSize;
+            // Keep the first profile with a given name, so files behave like a search path.
+            _index.insert(std::make_pair(name, std::make_pair(offset, std::size_t(profile.componentCount))));
+            offset += dataSize;
+        }
+    }
+
+    std::string _filename;
+    void * _data;
+    std::size_t _size;
+    Index _index;
+};
+
+// Profile files are added to the pending list, and are only opened (and moved to the open list)
+// when a lookup fails to find a name in the registry.
+struct ProfileFileList {
+
+    ProfileFileList() {
+        char const * dir = std::getenv("MEAS_EXTENSIONS_MULTISHAPELET_DIR");
+        if (dir) {
+            std::string filename = std::string(dir) + "/data/reduced.mgp";
+            struct stat status;
+            if (::stat(filename.c_str(), &status) == 0) {
+                pending.push_back(filename);
+            }
+        }
+    }
+
+    std::list<std::string> pending;
+    std::list< boost::shared_ptr<ProfileFile> > open;
+};
+
+ProfileFileList & getProfileFileList() {
+    static ProfileFileList it;
+    return it;
+}
+
+// Search profile files for the given name, opening pending files as necessary.
+bool findInFiles(std::string const & name, MultiGaussian & multiGaussian) {
+    ProfileFileList & files = getProfileFileList();
+    for (
+        std::list< boost::shared_ptr<ProfileFile> >::const_iterator i = files.open.begin();
+        i != files.open.end();
+        ++i
+    ) {
+        if ((**i).get(name, multiGaussian)) return true;
+    }
+    while (!files.pending.empty()) {
+        std::string filename = files.pending.front();
+        files.pending.pop_front();
+        files.open.push_back(boost::make_shared<ProfileFile>(filename));
+        if (files.open.back()->get(name, multiGaussian)) return true;
+    }
+    return false;
+}
+
 struct CompareRegistryItem {
 
     bool operator()(RegistryItem const & item) const { return item.first == name; }
@@ -53,9 +251,15 @@ struct CompareRegistryItem {
 } // anonymous
 
 MultiGaussian const & MultiGaussianRegistry::lookup(std::string const & name) {
+    boost::mutex::scoped_lock lock(registryMutex);
     RegistryList & l = getRegistryList();
     RegistryList::iterator i = std::find_if(l.begin(), l.end(), CompareRegistryItem(name));
     if (i == l.end()) {
+        MultiGaussian multiGaussian;
+        if (findInFiles(name, multiGaussian)) {
+            l.push_front(RegistryItem(name, multiGaussian));
+            return l.front().second;
+        }
         throw LSST_EXCEPT(
             pex::exceptions::NotFoundError,
             (boost::format("MultiGaussian with name '%s' not found in registry.") % name).str()
@@ -68,7 +272,13 @@ MultiGaussian const & MultiGaussianRegistry::lookup(std::string const & name) {
     return result;
 }
 
+void MultiGaussianRegistry::addFile(std::string const & filename) {
+    boost::mutex::scoped_lock lock(registryMutex);
+    getProfileFileList().pending.push_back(filename);
+}
+
 void MultiGaussianRegistry::insert(std::string const & name, MultiGaussian const & multiGaussian) {
+    boost::mutex::scoped_lock lock(registryMutex);
     RegistryList & l = getRegistryList();
     RegistryList::iterator i = std::find_if(l.begin(), l.end(), CompareRegistryItem(name));
     if (i != l.end()) {
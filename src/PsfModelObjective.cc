@@ -0,0 +1,283 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "lsst/utils/ieee.h"
+#include "lsst/meas/extensions/multiShapelet/PsfModelObjective.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Return the function g'(x) = g(-x).  Shapelet basis functions of order n have parity (-1)^n
+// about their center, so we just need to negate the center and the odd-order coefficients.
+shapelet::MultiShapeletFunction reflect(shapelet::MultiShapeletFunction const & input) {
+    typedef shapelet::MultiShapeletFunction MSF;
+    MSF::ComponentList components;
+    for (MSF::ComponentList::const_iterator i = input.getComponents().begin();
+         i != input.getComponents().end(); ++i) {
+        ndarray::Array<double,1,1> coefficients = ndarray::copy(i->getCoefficients());
+        for (int n = 1; n <= i->getOrder(); n += 2) {
+            coefficients.asEigen().segment(shapelet::computeOffset(n), n + 1) *= -1.0;
+        }
+        afw::geom::ellipses::Ellipse ellipse(i->getEllipse());
+        ellipse.setCenter(afw::geom::Point2D(-ellipse.getCenter().getX(), -ellipse.getCenter().getY()));
+        components.push_back(
+            shapelet::ShapeletFunction(i->getOrder(), i->getBasisType(), ellipse, coefficients)
+        );
+    }
+    return MSF(components);
+}
+
+// Inner product of a and g, given b = g reflected through the origin.
+double dotReflected(shapelet::MultiShapeletFunction const & a, shapelet::MultiShapeletFunction const & b) {
+    return a.convolve(b).evaluate()(afw::geom::Point2D());
+}
+
+// Fill t(x, y) = E[H_x(u) H_y(v)] for x + y <= order, where H_n are the (physicists') Hermite
+// polynomials and (u, v) is Gaussian with zero mean and covariance k.  dt[0], dt[1], and dt[2]
+// are set to the derivatives of t with respect to k(0,0), k(1,1), and k(0,1).
+//
+// This follows from H_{n+1}(u) = 2u H_n(u) - 2n H_{n-1}(u), H_n'(u) = 2n H_{n-1}(u), and
+// E[u f(u,v)] = k(0,0) E[df/du] + k(0,1) E[df/dv] for Gaussian (u, v).
+void computeHermiteMoments(
+    Eigen::Matrix2d const & k, int order, Eigen::ArrayXXd & t, Eigen::ArrayXXd * dt
+) {
+    t = Eigen::ArrayXXd::Zero(order + 1, order + 1);
+    for (int j = 0; j < 3; ++j) {
+        dt[j] = Eigen::ArrayXXd::Zero(order + 1, order + 1);
+    }
+    t(0, 0) = 1.0;
+    for (int x = 1; x < order; ++x) {
+        double const c = 2.0 * x * (2.0 * k(0, 0) - 1.0);
+        t(x + 1, 0) = c * t(x - 1, 0);
+        for (int j = 0; j < 3; ++j) {
+            dt[j](x + 1, 0) = c * dt[j](x - 1, 0);
+        }
+        dt[0](x + 1, 0) += 4.0 * x * t(x - 1, 0);
+    }
+    for (int y = 0; y < order; ++y) {
+        double const c = 2.0 * y * (2.0 * k(1, 1) - 1.0);
+        for (int x = 0; x + y < order; ++x) {
+            double const d = 4.0 * x * k(0, 1);
+            double const ty = (y > 0) ? t(x, y - 1) : 0.0;
+            double const tx = (x > 0) ? t(x - 1, y) : 0.0;
+            t(x, y + 1) = c * ty + d * tx;
+            for (int j = 0; j < 3; ++j) {
+                dt[j](x, y + 1) = c * ((y > 0) ? dt[j](x, y - 1) : 0.0)
+                    + d * ((x > 0) ? dt[j](x - 1, y) : 0.0);
+            }
+            dt[1](x, y + 1) += 4.0 * y * ty;
+            dt[2](x, y + 1) += 4.0 * x * tx;
+        }
+    }
+}
+
+// Return the derivatives of a function of a moments matrix with respect to (Ixx, Iyy, Ixy), given
+// its (symmetric) gradient with respect to the matrix.
+Eigen::RowVector3d flattenGradient(Eigen::Matrix2d const & gradient) {
+    return Eigen::RowVector3d(gradient(0, 0), gradient(1, 1), 2.0 * gradient(0, 1));
+}
+
+} // anonymous
+
+PsfModelObjective::PsfModelObjective(
+    MultiGaussian const & multiGaussian,
+    FitPsfModel const & psfModel,
+    double minRadius, double minAxisRatio
+) : Objective(1, 3), _minRadius(minRadius), _minAxisRatio(minAxisRatio),
+    _amplitude(1.0), _psfSquaredNorm(0.0),
+    _ellipse(), _gradient(Eigen::RowVector3d::Zero())
+{
+    if (_minRadius <= 0.0) {
+        throw LSST_EXCEPT(
+            pex::exceptions::InvalidParameterError,
+            "Minimum radius must be > 0"
+        );
+    }
+    if (_minAxisRatio < 0.0 || _minAxisRatio > 1.0) {
+        throw LSST_EXCEPT(
+            pex::exceptions::InvalidParameterError,
+            "Minimum axis ratio must be between 0 and 1"
+        );
+    }
+    Eigen::Matrix2d psfMoments = afw::geom::ellipses::Quadrupole(psfModel.ellipse).getMatrix();
+    MultiGaussian psfMultiGaussian = psfModel.getMultiGaussian();
+    for (MultiGaussian::const_iterator i = multiGaussian.begin(); i != multiGaussian.end(); ++i) {
+        for (MultiGaussian::const_iterator j = psfMultiGaussian.begin(); j != psfMultiGaussian.end(); ++j) {
+            ModelTerm term;
+            term.flux = i->flux * j->flux;
+            term.radius2 = i->radius * i->radius;
+            term.psfMoments = j->radius * j->radius * psfMoments;
+            _modelTerms.push_back(term);
+        }
+    }
+    shapelet::MultiShapeletFunction psf = psfModel.asMultiShapelet();
+    int maxOrder = 0;
+    for (shapelet::MultiShapeletFunction::ComponentList::const_iterator i = psf.getComponents().begin();
+         i != psf.getComponents().end(); ++i) {
+        maxOrder = std::max(maxOrder, i->getOrder());
+    }
+    std::vector<double> norms;
+    for (shapelet::PackedIndex i; i.getOrder() <= maxOrder; ++i) {
+        _indices.push_back(std::make_pair(i.getX(), i.getY()));
+        double norm = 1.0;
+        for (int n = 2; n <= i.getX(); ++n) norm *= n;
+        for (int n = 2; n <= i.getY(); ++n) norm *= n;
+        norms.push_back(1.0 / std::sqrt(std::ldexp(norm, i.getOrder())));
+    }
+    for (shapelet::MultiShapeletFunction::ComponentList::const_iterator i = psf.getComponents().begin();
+         i != psf.getComponents().end(); ++i) {
+        PsfTerm term;
+        term.order = i->getOrder();
+        afw::geom::LinearTransform gridTransform = i->getEllipse().getCore().getGridTransform();
+        term.gridTransform = gridTransform.getMatrix();
+        term.coefficients = i->getCoefficients().asEigen();
+        for (int n = 0; n < term.coefficients.size(); ++n) {
+            term.coefficients[n] *= norms[n];
+        }
+        _psfTerms.push_back(term);
+    }
+    _psfSquaredNorm = dotReflected(psf, reflect(psf));
+}
+
+double PsfModelObjective::computeInnerProduct(
+    shapelet::MultiShapeletFunction const & a,
+    shapelet::MultiShapeletFunction const & b
+) {
+    return dotReflected(a, reflect(b));
+}
+
+double PsfModelObjective::_computeGaussianProduct(
+    Eigen::Matrix2d const & moments, Eigen::Matrix2d & gradient
+) const {
+    //
+    // In the grid coordinates u = G x of a PSF term, a unit-flux Gaussian with moments S has moments
+    // M = G S G^T, and the basis functions are |G| psi_x(u_0) psi_y(u_1), where psi_n are the
+    // orthonormal Hermite functions.  The Gaussian factor of the basis functions multiplies the
+    // Gaussian to give one with moments K = I - (I + M)^{-1}, so the integral of the product is
+    //
+    //   |G| det(I + M)^{-1/2} E_K[H_x(u_0) H_y(u_1)] / sqrt(pi 2^(x+y) x! y!)
+    //
+    // We also return the derivative with respect to S, using dK = (I + M)^{-1} dM (I + M)^{-1}.
+    //
+    double result = 0.0;
+    gradient.setZero();
+    Eigen::ArrayXXd t;
+    Eigen::ArrayXXd dt[3];
+    Eigen::Matrix2d dk[3];
+    for (std::size_t i = 0; i < _psfTerms.size(); ++i) {
+        PsfTerm const & term = _psfTerms[i];
+        Eigen::Matrix2d m = term.gridTransform * moments * term.gridTransform.transpose();
+        Eigen::Matrix2d b = (Eigen::Matrix2d::Identity() + m).inverse();
+        computeHermiteMoments(Eigen::Matrix2d::Identity() - b, term.order, t, dt);
+        dk[0] = b.col(0) * b.col(0).transpose();
+        dk[1] = b.col(1) * b.col(1).transpose();
+        dk[2] = 0.5 * (b.col(0) * b.col(1).transpose() + b.col(1) * b.col(0).transpose());
+        double value = 0.0;
+        Eigen::Matrix2d dm = Eigen::Matrix2d::Zero();
+        for (int n = 0; n < term.coefficients.size(); ++n) {
+            int const x = _indices[n].first;
+            int const y = _indices[n].second;
+            value += term.coefficients[n] * t(x, y);
+            dm += term.coefficients[n] * (dt[0](x, y) * dk[0] + dt[1](x, y) * dk[1] + dt[2](x, y) * dk[2]);
+        }
+        dm -= 0.5 * value * b;
+        double const scale = std::abs(term.gridTransform.determinant())
+            * std::sqrt(b.determinant() / afw::geom::PI);
+        result += scale * value;
+        gradient += scale * term.gridTransform.transpose() * dm * term.gridTransform;
+    }
+    return result;
+}
+
+Objective::StepResult PsfModelObjective::tryStep(
+    ndarray::Array<double const,1,1> const & oldParameters, 
+    ndarray::Array<double,1,1> const & newParameters
+) {
+    StepResult result(VALID);
+    for (int n = 0; n < oldParameters.getSize<0>(); ++n) {
+        if (!lsst::utils::isfinite(newParameters[n]) && lsst::utils::isfinite(oldParameters[n])) {
+            newParameters[n] = oldParameters[n];
+        }
+    }
+    _ellipse.readParameters(newParameters.getData());
+    std::pair<bool,bool> constrained
+        = MultiGaussianObjective::constrainEllipse(_ellipse, _minRadius, _minAxisRatio);
+    if (constrained.first || constrained.second) {
+        result = MODIFIED;
+        _ellipse.writeParameters(newParameters.getData());
+    }
+    return result;
+}
+
+void PsfModelObjective::computeFunction(
+    ndarray::Array<double const,1,1> const & parameters, 
+    ndarray::Array<double,1,1> const & function
+) {
+    _ellipse.readParameters(parameters.getData());
+    Eigen::Matrix3d jacobian;
+    Eigen::Matrix2d q = MultiGaussianObjective::computeQuadrupole(_ellipse, jacobian).getMatrix();
+    // a is the squared norm of the unit-amplitude model and b is its inner product with the PSF
+    // model; da and db are their derivatives with respect to (Ixx, Iyy, Ixy).
+    double a = 0.0;
+    double b = 0.0;
+    Eigen::RowVector3d da = Eigen::RowVector3d::Zero();
+    Eigen::RowVector3d db = Eigen::RowVector3d::Zero();
+    Eigen::Matrix2d gradient;
+    for (std::size_t i = 0; i < _modelTerms.size(); ++i) {
+        ModelTerm const & ti = _modelTerms[i];
+        Eigen::Matrix2d s = ti.radius2 * q + ti.psfMoments;
+        b += ti.flux * _computeGaussianProduct(s, gradient);
+        db += ti.flux * ti.radius2 * flattenGradient(gradient);
+        for (std::size_t j = 0; j < _modelTerms.size(); ++j) {
+            ModelTerm const & tj = _modelTerms[j];
+            Eigen::Matrix2d sum = s + tj.radius2 * q + tj.psfMoments;
+            double const p = ti.flux * tj.flux / (2.0 * afw::geom::PI * std::sqrt(sum.determinant()));
+            a += p;
+            da -= 0.5 * p * (ti.radius2 + tj.radius2) * flattenGradient(sum.inverse());
+        }
+    }
+    _amplitude = b / a;
+    double const chisq = _psfSquaredNorm - _amplitude * b;
+    // Round-off can make the residual norm very slightly negative at a perfect fit.
+    if (chisq > 0.0) {
+        function[0] = std::sqrt(chisq);
+        _gradient = (_amplitude * _amplitude * da - 2.0 * _amplitude * db) * jacobian / (2.0 * function[0]);
+    } else {
+        function[0] = 0.0;
+        _gradient.setZero();
+    }
+}
+
+void PsfModelObjective::computeDerivative(
+    ndarray::Array<double const,1,1> const & parameters, 
+    ndarray::Array<double const,1,1> const & function,
+    ndarray::Array<double,2,-2> const & derivative
+) {
+    derivative.asEigen().row(0) = _gradient;
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
@@ -0,0 +1,201 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "boost/format.hpp"
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/afw/geom/Angle.h"
+#include "lsst/meas/extensions/multiShapelet/ShapeletMatrixBuilder.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Fill the first n rows of h with the 1-d Hermite functions of orders [0, h.cols()), divided by
+// the zeroth-order function (so the Gaussian factor can be applied once, in 2-d).  With
+// phi_n the normalized functions, phi_{n+1} = sqrt(2/(n+1)) u phi_n - sqrt(n/(n+1)) phi_{n-1}.
+void fillHermite(Eigen::ArrayXXd & h, Eigen::ArrayXd const & u, int n) {
+    int const order = h.cols() - 1;
+    h.col(0).head(n).setOnes();
+    if (order > 0) {
+        h.col(1).head(n) = M_SQRT2 * u.head(n);
+    }
+    for (int k = 1; k < order; ++k) {
+        h.col(k + 1).head(n) = std::sqrt(2.0 / (k + 1)) * u.head(n) * h.col(k).head(n)
+            - std::sqrt(double(k) / (k + 1)) * h.col(k - 1).head(n);
+    }
+}
+
+void checkWeights(ndarray::Array<double const,1,1> const & weights, int dataSize) {
+    if (!weights.isEmpty() && weights.getSize<0>() != dataSize) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Size of weights (%d) does not match number of pixels (%d)")
+             % weights.getSize<0>() % dataSize).str()
+        );
+    }
+}
+
+} // anonymous
+
+ShapeletMatrixBuilder::Workspace::Workspace(afw::geom::ellipses::Ellipse const & ellipse, int order) :
+    _gt(ellipse.getGridTransform()),
+    // The basis functions are normalized in the grid coordinates, and the Jacobian of the
+    // transform keeps their integrals independent of the ellipse.
+    _norm(std::abs(_gt.getLinear().computeDeterminant()) / std::sqrt(afw::geom::PI)),
+    _u(BLOCK_SIZE),
+    _v(BLOCK_SIZE),
+    _g(BLOCK_SIZE),
+    _sum(BLOCK_SIZE),
+    _hu(BLOCK_SIZE, order + 1),
+    _hv(BLOCK_SIZE, order + 1)
+{}
+
+void ShapeletMatrixBuilder::Workspace::fill(
+    double const * xData, double const * yData, double const * weightData, int n
+) {
+    typedef afw::geom::AffineTransform AT;
+    Eigen::Map<Eigen::ArrayXd const> x(xData, n);
+    Eigen::Map<Eigen::ArrayXd const> y(yData, n);
+    _u.head(n) = _gt[AT::XX] * x + _gt[AT::XY] * y + _gt[AT::X];
+    _v.head(n) = _gt[AT::YX] * x + _gt[AT::YY] * y + _gt[AT::Y];
+    _g.head(n) = _norm * (-0.5 * (_u.head(n).square() + _v.head(n).square())).exp();
+    if (weightData) {
+        _g.head(n) *= Eigen::Map<Eigen::ArrayXd const>(weightData, n);
+    }
+    fillHermite(_hu, _u, n);
+    fillHermite(_hv, _v, n);
+}
+
+ShapeletMatrixBuilder::ShapeletMatrixBuilder(
+    ndarray::Array<double const,1,1> const & x,
+    ndarray::Array<double const,1,1> const & y,
+    int order
+) : _order(order), _x(x), _y(y)
+{
+    if (x.getSize<0>() != y.getSize<0>()) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Size of x (%d) does not match size of y (%d)")
+             % x.getSize<0>() % y.getSize<0>()).str()
+        );
+    }
+    if (order < 0) {
+        throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, "Shapelet order must be >= 0");
+    }
+    _indices.reserve(shapelet::computeSize(order));
+    for (shapelet::PackedIndex i; i.getOrder() <= order; ++i) {
+        _indices.push_back(std::make_pair(i.getX(), i.getY()));
+    }
+}
+
+void ShapeletMatrixBuilder::operator()(
+    ndarray::Array<double,2,-1> const & output,
+    afw::geom::ellipses::Ellipse const & ellipse,
+    ndarray::Array<double const,1,1> const & weights,
+    int begin
+) const {
+    int const dataSize = getDataSize();
+    int const rows = output.getSize<0>();
+    if (begin < 0 || begin + rows > dataSize || output.getSize<1>() != getBasisSize()) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Output matrix with shape (%d, %d) starting at row %d does not fit in (%d, %d)")
+             % rows % output.getSize<1>() % begin % dataSize % getBasisSize()).str()
+        );
+    }
+    checkWeights(weights, dataSize);
+    Workspace ws(ellipse, _order);
+    ndarray::EigenView<double,2,-1,Eigen::ArrayXpr> out(output);
+    for (int start = 0; start < rows; start += BLOCK_SIZE) {
+        int const n = std::min(int(BLOCK_SIZE), rows - start);
+        int const offset = begin + start;
+        ws.fill(_x.getData() + offset, _y.getData() + offset,
+                weights.isEmpty() ? 0 : weights.getData() + offset, n);
+        for (int i = 0; i < getBasisSize(); ++i) {
+            out.col(i).segment(start, n) = ws._g.head(n)
+                * ws._hu.col(_indices[i].first).head(n) * ws._hv.col(_indices[i].second).head(n);
+        }
+    }
+}
+
+void ShapeletMatrixBuilder::addModel(
+    ndarray::Array<double,1,1> const & output,
+    afw::geom::ellipses::Ellipse const & ellipse,
+    ndarray::Array<double const,1,1> const & coefficients,
+    ndarray::Array<double const,1,1> const & weights,
+    int begin
+) const {
+    Workspace ws(ellipse, _order);
+    addModel(output, ws, coefficients, weights, begin);
+}
+
+void ShapeletMatrixBuilder::addModel(
+    ndarray::Array<double,1,1> const & output,
+    Workspace & ws,
+    ndarray::Array<double const,1,1> const & coefficients,
+    ndarray::Array<double const,1,1> const & weights,
+    int begin
+) const {
+    int const dataSize = getDataSize();
+    int const rows = output.getSize<0>();
+    if (begin < 0 || begin + rows > dataSize) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Output vector with size %d starting at pixel %d does not fit in %d pixels")
+             % rows % begin % dataSize).str()
+        );
+    }
+    if (coefficients.getSize<0>() != getBasisSize()) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Size of coefficients (%d) does not match basis size (%d)")
+             % coefficients.getSize<0>() % getBasisSize()).str()
+        );
+    }
+    if (ws.getOrder() != _order) {
+        throw LSST_EXCEPT(
+            pex::exceptions::InvalidParameterError,
+            (boost::format("Workspace order (%d) does not match builder order (%d)")
+             % ws.getOrder() % _order).str()
+        );
+    }
+    checkWeights(weights, dataSize);
+    for (int start = 0; start < rows; start += BLOCK_SIZE) {
+        int const n = std::min(int(BLOCK_SIZE), rows - start);
+        int const offset = begin + start;
+        ws.fill(_x.getData() + offset, _y.getData() + offset,
+                weights.isEmpty() ? 0 : weights.getData() + offset, n);
+        ws._sum.head(n).setZero();
+        for (int i = 0; i < getBasisSize(); ++i) {
+            ws._sum.head(n) += coefficients[i]
+                * ws._hu.col(_indices[i].first).head(n) * ws._hv.col(_indices[i].second).head(n);
+        }
+        output.asEigen<Eigen::ArrayXpr>().segment(start, n) += ws._g.head(n) * ws._sum.head(n);
+    }
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
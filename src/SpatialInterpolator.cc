@@ -0,0 +1,147 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include "Eigen/SVD"
+#include "boost/format.hpp"
+
+#include "lsst/pex/exceptions.h"
+#include "lsst/afw/geom/Angle.h"
+#include "lsst/meas/extensions/multiShapelet/SpatialInterpolator.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+// Transform a coordinate from [min, max] to [-1, 1]; degenerate ranges map to zero.
+double scaleCoordinate(double x, double min, double max) {
+    if (!(max > min)) return 0.0;
+    return (2.0 * x - (min + max)) / (max - min);
+}
+
+// Fill t[0..order] with Chebyshev polynomials of the first kind evaluated at x.
+void fillChebyshev(double x, int order, Eigen::VectorXd & t) {
+    t[0] = 1.0;
+    if (order > 0) t[1] = x;
+    for (int n = 1; n < order; ++n) {
+        t[n + 1] = 2.0 * x * t[n] - t[n - 1];
+    }
+}
+
+} // anonymous
+
+SpatialInterpolator::SpatialInterpolator(
+    afw::geom::Box2D const & bbox,
+    int order,
+    std::vector<afw::geom::Point2D> const & points,
+    ndarray::Array<double const,2,2> const & values
+) : _bbox(bbox), _order(order), _coefficients()
+{
+    if (order < 0) {
+        throw LSST_EXCEPT(
+            pex::exceptions::InvalidParameterError,
+            (boost::format("Interpolation order (%d) must be nonnegative") % order).str()
+        );
+    }
+    if (values.getSize<0>() != static_cast<int>(points.size())) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Number of value rows (%d) does not match number of points (%d)")
+             % values.getSize<0>() % points.size()).str()
+        );
+    }
+    int const nTerms = computeTermSize(order);
+    if (static_cast<int>(points.size()) < nTerms) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Not enough points (%d) to constrain order %d interpolation (%d terms)")
+             % points.size() % order % nTerms).str()
+        );
+    }
+    Eigen::MatrixXd matrix(points.size(), nTerms);
+    Eigen::VectorXd basis(nTerms);
+    for (std::size_t n = 0; n < points.size(); ++n) {
+        _fillBasis(points[n], basis);
+        matrix.row(n) = basis.transpose();
+    }
+    Eigen::MatrixXd rhs = values.asEigen();
+    Eigen::JacobiSVD<Eigen::MatrixXd> svd(matrix, Eigen::ComputeThinU | Eigen::ComputeThinV);
+    _coefficients = svd.solve(rhs);
+}
+
+void SpatialInterpolator::_fillBasis(afw::geom::Point2D const & point, Eigen::VectorXd & basis) const {
+    Eigen::VectorXd tx(_order + 1);
+    Eigen::VectorXd ty(_order + 1);
+    fillChebyshev(scaleCoordinate(point.getX(), _bbox.getMinX(), _bbox.getMaxX()), _order, tx);
+    fillChebyshev(scaleCoordinate(point.getY(), _bbox.getMinY(), _bbox.getMaxY()), _order, ty);
+    for (int n = 0, k = 0; n <= _order; ++n) {
+        for (int i = 0; i <= n; ++i, ++k) {
+            basis[k] = tx[i] * ty[n - i];
+        }
+    }
+}
+
+void SpatialInterpolator::evaluate(
+    afw::geom::Point2D const & point,
+    ndarray::Array<double,1,1> const & output
+) const {
+    if (output.getSize<0>() != getValueSize()) {
+        throw LSST_EXCEPT(
+            pex::exceptions::LengthError,
+            (boost::format("Output array size (%d) does not match interpolated vector size (%d)")
+             % output.getSize<0>() % getValueSize()).str()
+        );
+    }
+    Eigen::VectorXd basis(getTermSize());
+    _fillBasis(point, basis);
+    output.asEigen() = _coefficients.transpose() * basis;
+}
+
+ndarray::Array<double,1,1> SpatialInterpolator::evaluate(afw::geom::Point2D const & point) const {
+    ndarray::Array<double,1,1> output = ndarray::allocate(getValueSize());
+    evaluate(point, output);
+    return output;
+}
+
+std::vector<afw::geom::Point2D> SpatialInterpolator::makeGrid(
+    afw::geom::Box2D const & bbox, int nx, int ny
+) {
+    if (nx < 1 || ny < 1) {
+        throw LSST_EXCEPT(
+            pex::exceptions::InvalidParameterError,
+            (boost::format("Grid dimensions (%d, %d) must be positive") % nx % ny).str()
+        );
+    }
+    std::vector<afw::geom::Point2D> points;
+    points.reserve(nx * ny);
+    afw::geom::Point2D center = bbox.getCenter();
+    for (int j = 0; j < ny; ++j) {
+        double y = center.getY() - 0.5 * bbox.getHeight() * std::cos(afw::geom::PI * (j + 0.5) / ny);
+        for (int i = 0; i < nx; ++i) {
+            double x = center.getX() - 0.5 * bbox.getWidth() * std::cos(afw::geom::PI * (i + 0.5) / nx);
+            points.push_back(afw::geom::Point2D(x, y));
+        }
+    }
+    return points;
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
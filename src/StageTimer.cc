@@ -0,0 +1,175 @@
+// -*- lsst-c++ -*-
+/* 
+ * LSST Data Management System
+ * Copyright 2012 LSST Corporation.
+ * 
+ * This product includes software developed by the
+ * LSST Project (http://www.lsst.org/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the LSST License Statement and 
+ * the GNU General Public License along with this program.  If not, 
+ * see <http://www.lsstcorp.org/LegalNotices/>.
+ */
+
+#include <cctype>
+#include <algorithm>
+#include <set>
+
+#include <time.h>
+
+#include "boost/thread/tss.hpp"
+
+#include "lsst/meas/extensions/multiShapelet/StageTimer.h"
+
+namespace lsst { namespace meas { namespace extensions { namespace multiShapelet {
+
+namespace {
+
+char const * const STAGE_NAMES[StageTimes::N_STAGES] = {
+    "INPUTS", "OPTIMIZER_SETUP", "OPTIMIZER_RUN", "SHAPELET_TERMS", "PSF_FACTOR_RENDER",
+    "PSF_FACTOR_FIT", "APPLY"
+};
+
+// Timer state for a single thread.
+struct ThreadState {
+    StageTimes * times; // set by ApplyTimer
+    bool active;        // true if a StageTimer is running
+
+    ThreadState() : times(0), active(false) {}
+};
+
+ThreadState & getThreadState() {
+    static boost::thread_specific_ptr<ThreadState> state;
+    if (!state.get()) {
+        state.reset(new ThreadState());
+    }
+    return *state;
+}
+
+// Several algorithms can share a PropertyList, so we need a global lock to write to them.
+boost::mutex & getMetadataMutex() {
+    static boost::mutex mutex;
+    return mutex;
+}
+
+// All existing StageTimes, for writeAllMetadata().
+boost::mutex registryMutex;
+std::set<StageTimes const *> registry;
+
+} // anonymous
+
+char const * StageTimes::getStageName(Stage stage) { return STAGE_NAMES[stage]; }
+
+double StageTimes::getTime() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+StageTimes::StageTimes(std::string const & algorithmName, PTR(daf::base::PropertyList) const & metadata) :
+    _prefix(), _metadata(metadata)
+{
+    for (std::string::const_iterator i = algorithmName.begin(); i != algorithmName.end(); ++i) {
+        _prefix.push_back((*i == '.') ? '_' : std::toupper(*i));
+    }
+    _prefix += "_TIMER_";
+    for (int n = 0; n < N_STAGES; ++n) {
+        _seconds[n] = 0.0;
+        _counts[n] = 0;
+    }
+    boost::mutex::scoped_lock lock(registryMutex);
+    registry.insert(this);
+}
+
+StageTimes::~StageTimes() {
+    {
+        boost::mutex::scoped_lock lock(registryMutex);
+        registry.erase(this);
+    }
+    try {
+        writeMetadata();
+    } catch (...) {} // timing is only diagnostic, and we can't throw from a destructor
+}
+
+void StageTimes::writeAllMetadata() {
+    boost::mutex::scoped_lock lock(registryMutex);
+    for (std::set<StageTimes const *>::const_iterator i = registry.begin(); i != registry.end(); ++i) {
+        (**i).writeMetadata();
+    }
+}
+
+bool StageTimes::isEnabled() { return MULTISHAPELET_ENABLE_TIMERS; }
+
+void StageTimes::add(Stage stage, double seconds) {
+    boost::mutex::scoped_lock lock(_mutex);
+    _seconds[stage] += seconds;
+    ++_counts[stage];
+}
+
+double StageTimes::getSeconds(Stage stage) const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _seconds[stage];
+}
+
+int StageTimes::getCount(Stage stage) const {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _counts[stage];
+}
+
+void StageTimes::writeMetadata() const {
+    if (!_metadata) return;
+    double seconds[N_STAGES];
+    int counts[N_STAGES];
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        std::copy(_seconds, _seconds + N_STAGES, seconds);
+        std::copy(_counts, _counts + N_STAGES, counts);
+    }
+    boost::mutex::scoped_lock lock(getMetadataMutex());
+    for (int n = 0; n < N_STAGES; ++n) {
+        _metadata->set(_prefix + STAGE_NAMES[n] + "_SECONDS", seconds[n]);
+        _metadata->set(_prefix + STAGE_NAMES[n] + "_COUNT", counts[n]);
+    }
+}
+
+StageTimer::StageTimer(StageTimes::Stage stage) : _stage(stage), _times(0), _start(0.0) {
+    ThreadState & state = getThreadState();
+    if (state.times && !state.active) {
+        state.active = true;
+        _times = state.times;
+        _start = StageTimes::getTime();
+    }
+}
+
+void StageTimer::stop() {
+    if (_times) {
+        _times->add(_stage, StageTimes::getTime() - _start);
+        _times = 0;
+        getThreadState().active = false;
+    }
+}
+
+ApplyTimer::ApplyTimer(StageTimes * times) : _times(times), _previous(0), _start(StageTimes::getTime()) {
+    ThreadState & state = getThreadState();
+    _previous = state.times;
+    state.times = _times;
+}
+
+ApplyTimer::~ApplyTimer() {
+    getThreadState().times = _previous;
+    if (_times) {
+        _times->add(StageTimes::APPLY, StageTimes::getTime() - _start);
+    }
+}
+
+}}}} // namespace lsst::meas::extensions::multiShapelet
@@ -32,6 +32,10 @@ or
    >>> import testFitProfile; testFitProfile.run()
 """
 
+import os
+import struct
+import shutil
+import tempfile
 import unittest
 import numpy
 
@@ -41,6 +45,9 @@ import lsst.afw.geom as geom
 import lsst.afw.geom.ellipses
 import lsst.afw.image
 import lsst.afw.detection
+import lsst.afw.table
+import lsst.shapelet
+import lsst.meas.algorithms
 import lsst.meas.extensions.multiShapelet as ms
 
 numpy.random.seed(5)
@@ -105,6 +112,41 @@ class FitProfileTestMixin(object):
             self.assert_(numpy.isfinite(z0).all())
             self.assert_(numpy.isfinite(z1).all())
 
+    def testReducedProfiles(self):
+        for name in ("tractor-exponential", "tractor-devaucouleur"):
+            for n in (3, 4, 6):
+                multiGaussian = ms.MultiGaussianRegistry.lookup("%s-%d" % (name, n))
+                self.assertEqual(len(multiGaussian), n)
+                self.assertClose(multiGaussian.integrate(), 1.0)
+                self.assert_(all(c.flux > 0.0 and c.radius > 0.0 for c in multiGaussian))
+
+    def testProfileFile(self):
+        directory = tempfile.mkdtemp()
+        try:
+            filename = os.path.join(directory, "test.mgp")
+            flux = numpy.array([0.25, 0.75])
+            radius = numpy.array([0.5, 2.0])
+            with open(filename, "wb") as f:
+                f.write(struct.pack("<8sII", "MSPROFIL", 1, 1))
+                f.write(struct.pack("<II", len("test-profile"), 2))
+                f.write("test-profile\0\0\0\0")
+                f.write(flux.astype("<f8").tostring())
+                f.write(radius.astype("<f8").tostring())
+            ms.MultiGaussianRegistry.addFile(filename)
+            multiGaussian = ms.MultiGaussianRegistry.lookup("test-profile")
+            self.assertClose([c.flux for c in multiGaussian], flux)
+            self.assertClose([c.radius for c in multiGaussian], radius)
+            # a file that fails to parse is reported when it's first needed, not when it's added
+            badFilename = os.path.join(directory, "bad.mgp")
+            with open(badFilename, "wb") as f:
+                f.write(struct.pack("<8sII", "MSPROFIL", 2, 0))
+            ms.MultiGaussianRegistry.addFile(badFilename)
+            self.assertClose(ms.MultiGaussianRegistry.lookup("test-profile").integrate(), 1.0)
+            self.assertRaises(lsst.pex.exceptions.IoError, ms.MultiGaussianRegistry.lookup, "missing")
+            self.assertRaises(lsst.pex.exceptions.NotFoundError, ms.MultiGaussianRegistry.lookup, "missing")
+        finally:
+            shutil.rmtree(directory)
+
     def testConvolvedModel(self):
         psfModel = ms.FitPsfModel(ms.FitPsfControl(), 1.0, numpy.array([0.1, -0.05, 1.0]))
         psfMultiGaussian = psfModel.getMultiGaussian()
@@ -162,7 +204,149 @@ class FitProfileTestMixin(object):
                 d1[:,i] = (f1a - f1b) / (2.0 * eps)
             self.assertClose(d0, d1, atol=1E-4, rtol=1E-10)
             print d0
-            
+
+    def testFitShapeletTerms(self):
+        # a noise-free image of the PSF-convolved model should give back its flux exactly
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, self.center)
+        flux = 150.0
+        parameters = numpy.array([0.2, -0.1, numpy.log(3.0)])
+        model = ms.FitProfileModel(self.ctrl, flux, parameters)
+        image = lsst.afw.image.ImageD(self.bbox)
+        model.asMultiShapelet(self.center).convolve(psfModel.asMultiShapelet()).evaluate().addToImage(image)
+        inputs = ms.ModelInputHandler(image, self.center, self.bbox)
+        fitted = ms.FitProfileModel(self.ctrl, 1.0, parameters)
+        ms.FitProfileAlgorithm.fitShapeletTerms(self.ctrl, psfModel, inputs, fitted)
+        self.assertClose(fitted.flux, flux, rtol=1E-6)
+        self.assertClose(fitted.chisq, 0.0, atol=1E-8)
+        # truncating the PSF expansions should change the flux by roughly the estimated error
+        self.assertEqual(fitted.psfTruncationError, 0.0)
+        ctrl = self.config.makeControl()
+        ctrl.psfShapeletOrder = 0
+        truncated = ms.FitProfileModel(ctrl, 1.0, parameters)
+        ms.FitProfileAlgorithm.fitShapeletTerms(ctrl, psfModel, inputs, truncated)
+        error = psfModel.computeTruncationError(0)
+        self.assertClose(truncated.psfTruncationError, error)
+        self.assertClose(truncated.flux, flux, rtol=2.0 * error)
+
+    def testConvolutionCache(self):
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, self.center)
+        model = ms.FitProfileModel(self.ctrl, 1.0, numpy.array([0.2, -0.1, numpy.log(3.0)]))
+        ms.ConvolutionCache.clear()
+        ms.ConvolutionCache.resetCounts()
+        ms.FitProfileAlgorithm.fitShapeletTerms(self.ctrl, psfModel, self.inputs, model)
+        flux = model.flux
+        self.assertEqual(ms.ConvolutionCache.getMissCount(), 1)
+        self.assertEqual(ms.ConvolutionCache.getHitCount(), 0)
+        # the fitted flux isn't part of the key, so this is a hit, and gives the same answer
+        ms.FitProfileAlgorithm.fitShapeletTerms(self.ctrl, psfModel, self.inputs, model)
+        self.assertEqual(ms.ConvolutionCache.getMissCount(), 1)
+        self.assertEqual(ms.ConvolutionCache.getHitCount(), 1)
+        self.assertClose(model.flux, flux, rtol=1E-14)
+        model = ms.FitProfileModel(self.ctrl, 1.0, numpy.array([0.2, -0.1, numpy.log(3.3)]))
+        ms.FitProfileAlgorithm.fitShapeletTerms(self.ctrl, psfModel, self.inputs, model)
+        self.assertEqual(ms.ConvolutionCache.getMissCount(), 2)
+
+    def testAnalyticPsfFactor(self):
+        # inner product of a unit-flux circular Gaussian with itself is 1/(4 pi sigma^2)
+        sigma = 2.5
+        gaussian = ms.GaussianComponent(1.0, sigma).makeShapelet(
+            geom.ellipses.Ellipse(geom.ellipses.Axes(1.0, 1.0, 0.0), geom.Point2D(0.3, -0.2))
+            )
+        msf = lsst.shapelet.MultiShapeletFunction([gaussian])
+        self.assertClose(ms.PsfModelObjective.computeInnerProduct(msf, msf), 1.0 / (4.0 * numpy.pi * sigma**2))
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, self.center)
+        reference = ms.FitProfileAlgorithm.computePsfFactor(self.ctrl, psfModel, psf, self.center)
+        ctrl = self.config.makeControl()
+        ctrl.analyticPsfFactor = True
+        analytic = ms.FitProfileAlgorithm.computePsfFactor(ctrl, psfModel, psf, self.center)
+        self.assertFalse(analytic.fluxFlag)
+        self.assertClose(analytic.flux, reference.flux, rtol=1E-2)
+        self.assertClose(analytic.ellipse.getParameterVector(), reference.ellipse.getParameterVector(),
+                         rtol=1E-2, atol=1E-2)
+        # the analytic derivative of the residual norm should match finite differences
+        eps = 1E-6
+        obj = ms.PsfModelObjective(ms.MultiGaussianRegistry.lookup(ctrl.profile), psfModel)
+        parameters = numpy.array([0.1, -0.2, numpy.log(2.0)])
+        f0 = numpy.zeros(1, dtype=float)
+        d0 = numpy.zeros((1, 3), dtype=float)
+        obj.computeFunction(parameters, f0)
+        obj.computeDerivative(parameters, f0, d0)
+        self.assert_(f0[0] > 0.0)
+        for n in range(3):
+            p1 = parameters.copy()
+            p1[n] += eps
+            f1 = numpy.zeros(1, dtype=float)
+            obj.computeFunction(p1, f1)
+            p1[n] -= 2.0 * eps
+            f2 = numpy.zeros(1, dtype=float)
+            obj.computeFunction(p1, f2)
+            self.assertClose(d0[0,n], (f1[0] - f2[0]) / (2.0 * eps), rtol=1E-4, atol=1E-8)
+
+    def testBatch(self):
+        psfCtrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfImage = psf.computeImage(self.center)
+        bad = lsst.afw.image.MaskU.getPlaneBitMask("BAD")
+        psfInputs = ms.ModelInputHandlerList()
+        inputs = ms.ModelInputHandlerList()
+        # footprints of different sizes, so the predicted costs differ
+        for radius in (5.0, 20.0, 12.0):
+            psfInputs.append(ms.ModelInputHandler(psfImage, self.center, psfImage.getBBox()))
+            footprint = lsst.afw.detection.Footprint(
+                geom.ellipses.Ellipse(geom.ellipses.Axes(radius, radius, 0.0), self.center)
+                )
+            inputs.append(ms.ModelInputHandler(self.mi, self.center, footprint, 0, bad))
+        psfModels = ms.FitPsfBatch.apply(psfCtrl, psfInputs, 2)
+        shape = geom.ellipses.Quadrupole(self.ellipse.getCore())
+        ellipses = numpy.array([[shape.getIxx(), shape.getIyy(), shape.getIxy()]] * len(inputs))
+        results = ms.FitProfileBatch.apply(self.ctrl, psfCtrl, psfModels, ellipses, inputs, 2)
+        self.assertEqual(results.getSize(), len(inputs))
+        costs = []
+        for n in range(len(inputs)):
+            psfModel = psfModels.getModel(psfCtrl, n)
+            model = ms.FitProfileAlgorithm.apply(self.ctrl, psfModel,
+                                                 ms.MultiGaussianObjective.EllipseCore(shape), inputs[n])
+            self.assertClose(results.flux[n], model.flux)
+            self.assertClose(results.ellipse[n], [model.ellipse.getIxx(), model.ellipse.getIyy(),
+                                                  model.ellipse.getIxy()])
+            costs.append(ms.FitProfileAlgorithm.predictCost(self.ctrl, psfModel, inputs[n].getSize()))
+            self.assert_(results.time[n] > 0.0)
+        self.assertClose(results.predictedCost, costs)
+        self.assert_(costs[1] > costs[2] > costs[0])
+        # a failed PSF model skips the fit
+        psfModels.flags[1] = ms.FitPsfBatchResults.FAILED_EXCEPTION
+        results = ms.FitProfileBatch.apply(self.ctrl, psfCtrl, psfModels, ellipses, inputs)
+        self.assert_(results.flags[1] & ms.FitProfileBatchResults.FAILED_PSF)
+        self.assert_(numpy.isnan(results.flux[1]))
+
+    def testComponentCounts(self):
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, self.center)
+        ellipse = ms.MultiGaussianObjective.EllipseCore(geom.ellipses.Quadrupole(self.ellipse.getCore()))
+        full = ms.FitProfileAlgorithm.apply(self.ctrl, psfModel, ellipse, self.inputs)
+        nFull = len(self.ctrl.getMultiGaussian()) * len(psfModel.getMultiGaussian())
+        self.assert_(full.builderCount <= nFull)
+        self.assert_(full.evaluationCount >= full.builderCount)
+        # the adaptive mode should report the pruned number of components it actually evaluated
+        ctrl = self.config.makeControl()
+        ctrl.maxComponents = 2
+        pruned = ms.FitProfileAlgorithm.apply(ctrl, psfModel, ellipse, self.inputs)
+        self.assert_(0 < pruned.builderCount <= 2)
+        self.assert_(pruned.evaluationCount >= pruned.builderCount)
+        # the counts are only added to the schema when pruning is enabled
+        name = "multishapelet.exp"
+        for maxComponents in (0, 2):
+            schema = lsst.afw.table.SourceTable.makeMinimalSchema()
+            config = lsst.meas.algorithms.SourceMeasurementConfig()
+            config.algorithms.names |= ["multishapelet.psf", name]
+            config.algorithms[name].maxComponents = maxComponents
+            lsst.meas.algorithms.SourceMeasurementTask(schema=schema, config=config)
+            names = schema.getNames()
+            self.assertEqual(name + ".builders" in names, maxComponents > 0)
+            self.assertEqual(name + ".evaluations" in names, maxComponents > 0)
 
     def tearDown(self):
         del self.ellipse
@@ -182,6 +366,67 @@ class FitExponentialTestCase(unittest.TestCase,FitProfileTestMixin):
     def tearDown(self):
         FitProfileTestMixin.tearDown(self)
 
+class FitComboTestCase(unittest.TestCase):
+
+    def assertClose(self, a, b, rtol=1E-5, atol=1E-8):
+        self.assert_(numpy.allclose(a, b, rtol=rtol, atol=atol), "\n%s\n!=\n%s" % (a, b))
+
+    def testSolveNonNegative(self):
+        for size in (1, 2, 3, 4):
+            for trial in range(10):
+                a = numpy.random.randn(20, size)
+                data = numpy.random.randn(20)
+                fisher = numpy.dot(a.transpose(), a)
+                rhs = numpy.dot(a.transpose(), data)
+                x = ms.FitComboAlgorithm.solveNonNegative(fisher, rhs)
+                self.assert_((x >= 0.0).all())
+                # brute force: best unconstrained solution over all subsets that is non-negative
+                best = numpy.zeros(size, dtype=float)
+                bestChiSq = (data**2).sum()
+                for mask in range(1, 2**size):
+                    indices = [k for k in range(size) if mask & (1 << k)]
+                    z = numpy.zeros(size, dtype=float)
+                    z[indices] = numpy.linalg.lstsq(a[:,indices], data)[0]
+                    chisq = ((numpy.dot(a, z) - data)**2).sum()
+                    if (z >= 0.0).all() and chisq < bestChiSq:
+                        best, bestChiSq = z, chisq
+                self.assertClose(x, best)
+
+    def testApply(self):
+        center = geom.Point2D(40.3, 35.8)
+        bbox = geom.Box2I(geom.Point2I(10, 10), geom.Extent2I(60, 55))
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 25, 25, 1.5, 3.0, 0.1)
+        psfModel = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, center)
+        ctrls = [ms.FitExponentialConfig().makeControl(), ms.FitDeVaucouleurConfig().makeControl(),
+                 ms.FitExponentialConfig().makeControl()]
+        parameters = [numpy.array([0.2, -0.1, numpy.log(3.0)]),
+                      numpy.array([0.1, 0.1, numpy.log(2.0)]),
+                      numpy.array([-0.3, 0.0, numpy.log(6.0)])]
+        fluxes = [100.0, 50.0, 0.0]
+        image = lsst.afw.image.ImageD(bbox)
+        components = ms.FitProfileModelList()
+        for ctrl, p, flux in zip(ctrls, parameters, fluxes):
+            model = ms.FitProfileModel(ctrl, flux, p)
+            if flux > 0.0:
+                model.asMultiShapelet(center).convolve(psfModel.asMultiShapelet()).evaluate().addToImage(image)
+            components.append(ms.FitProfileModel(ctrl, 1.0, p))
+        comboCtrl = ms.FitComboControl()
+        comboCtrl.componentNames = ["a", "b", "c"]
+        # a noise-free image should give back the component fluxes exactly
+        inputs = ms.ModelInputHandler(image, center, bbox)
+        result = ms.FitComboAlgorithm.apply(comboCtrl, psfModel, components, inputs)
+        self.assertClose(result.flux, sum(fluxes), rtol=1E-6)
+        for n, flux in enumerate(fluxes):
+            self.assertClose(result.components[n] * result.flux, flux, rtol=1E-5, atol=1E-3)
+        # a negative-flux copy of the third component pulls its unconstrained amplitude below zero
+        negative = ms.FitProfileModel(ctrls[2], -20.0, parameters[2])
+        negative.asMultiShapelet(center).convolve(psfModel.asMultiShapelet()).evaluate().addToImage(image)
+        inputs = ms.ModelInputHandler(image, center, bbox)
+        result = ms.FitComboAlgorithm.apply(comboCtrl, psfModel, components, inputs)
+        self.assertEqual(result.components[2], 0.0)
+        self.assertClose(result.components.sum(), 1.0, rtol=1E-6)
+        self.assert_(result.fluxErr > 0.0)
+
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 def suite():
@@ -191,6 +436,7 @@ def suite():
 
     suites = []
     suites += unittest.makeSuite(FitExponentialTestCase)
+    suites += unittest.makeSuite(FitComboTestCase)
     suites += unittest.makeSuite(utilsTests.MemoryTestCase)
     return unittest.TestSuite(suites)
 
@@ -33,18 +33,35 @@ or
 """
 
 import unittest
+import threading
+import time
 import numpy
+import tempfile
+import shutil
 
 import lsst.utils.tests as utilsTests
 import lsst.pex.exceptions
+import lsst.daf.base
 import lsst.afw.geom as geom
 import lsst.afw.image
+import lsst.afw.math
 import lsst.afw.detection
+import lsst.afw.table
+import lsst.meas.algorithms
 import lsst.meas.extensions.multiShapelet as ms
 
 numpy.random.seed(5)
 numpy.set_printoptions(linewidth=120)
 
+def makeVaryingPsf(width, height, size=19, sigma=1.5, gradient=0.5):
+    """Return a double-Gaussian PCA PSF whose wings get stronger across the image."""
+    basis = lsst.afw.math.KernelList()
+    for s in (sigma, 2.0 * sigma):
+        basis.append(lsst.afw.math.AnalyticKernel(size, size, lsst.afw.math.GaussianFunction2D(s, s, 0.0)))
+    kernel = lsst.afw.math.LinearCombinationKernel(basis, lsst.afw.math.PolynomialFunction2D(1))
+    kernel.setSpatialParameters([[1.0, 0.0, 0.0], [0.1, gradient / width, gradient / height]])
+    return lsst.afw.detection.createPsf("PCA", kernel)
+
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 class FitPsfTestCase(unittest.TestCase):
@@ -102,6 +119,243 @@ class FitPsfTestCase(unittest.TestCase):
                 parameters[i,j] += eps
             self.assertClose(d0, d1, rtol=1E-10, atol=1E-8)
 
+    def testBoxInputs(self):
+        ctrl = ms.FitPsfControl()
+        ctrl.outerOrder = 1
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        for center in (geom.Point2D(30.2, 40.7), geom.Point2D(50.6, 20.1)):
+            image = psf.computeImage(center)
+            boxInputs = ms.ModelInputHandler(image, center, image.getBBox())
+            self.assertEqual(boxInputs.getBoxDimensions(), image.getDimensions())
+            spanInputs = ms.ModelInputHandler(image, center, lsst.afw.detection.Footprint(image.getBBox()))
+            self.assertEqual(spanInputs.getBoxDimensions(), geom.Extent2I(0, 0))
+            self.assertClose(boxInputs.getX(), spanInputs.getX(), rtol=0.0, atol=1E-12)
+            self.assertClose(boxInputs.getY(), spanInputs.getY(), rtol=0.0, atol=1E-12)
+            # box inputs use cached shapelet matrices, span inputs build them from scratch
+            boxModel = ms.FitPsfAlgorithm.apply(ctrl, boxInputs)
+            spanModel = ms.FitPsfAlgorithm.apply(ctrl, spanInputs)
+            self.assertClose(boxModel.inner, spanModel.inner)
+            self.assertClose(boxModel.outer, spanModel.outer)
+            self.assertClose(boxModel.chisq, spanModel.chisq)
+
+    def testNormalEquations(self):
+        ctrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        center = geom.Point2D(30.2, 40.7)
+        image = psf.computeImage(center)
+        image.getArray()[:,:] += numpy.random.randn(*image.getArray().shape) * 1E-3
+        for inputs in (ms.ModelInputHandler(image, center, image.getBBox()),
+                       ms.ModelInputHandler(image, center, lsst.afw.detection.Footprint(image.getBBox()))):
+            model1 = ms.FitPsfAlgorithm.apply(ctrl, inputs)
+            model2 = ms.FitPsfModel(model1)
+            ctrl.useNormalEquations = True
+            ms.FitPsfAlgorithm.fitShapeletTerms(ctrl, inputs, model2)
+            ctrl.useNormalEquations = False
+            self.assertClose(model1.inner, model2.inner, rtol=1E-8)
+            self.assertClose(model1.outer, model2.outer, rtol=1E-8)
+            self.assertClose(model1.chisq, model2.chisq, rtol=1E-6)
+
+    def testTruncation(self):
+        ctrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        model = ms.FitPsfAlgorithm.apply(ctrl, psf, geom.Point2D(30.2, 40.7))
+        order = model.getOrder()
+        self.assertEqual(order, max(ctrl.innerOrder, ctrl.outerOrder))
+        truncated = model.truncate(0)
+        self.assertEqual(truncated.inner.size, 1)
+        self.assertEqual(truncated.outer.size, 1)
+        self.assertClose(truncated.inner[0], model.inner[0])
+        self.assertEqual(model.computeTruncationError(order), 0.0)
+        self.assert_(model.computeTruncationError(0) > 0.0)
+        self.assertEqual(model.selectTruncationOrder(-1, 0.0), order)
+        self.assertEqual(model.selectTruncationOrder(1, 0.0), 1)
+        self.assertEqual(model.selectTruncationOrder(-1, 1.0), 0)
+        tolerance = 0.5 * (model.computeTruncationError(0) + model.computeTruncationError(1))
+        selected = model.selectTruncationOrder(-1, tolerance)
+        self.assert_(model.computeTruncationError(selected) <= tolerance)
+
+    def testBatch(self):
+        ctrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        inputs = ms.ModelInputHandlerList()
+        models = []
+        for x, y in numpy.random.rand(8, 2) * 100.0:
+            center = geom.Point2D(x, y)
+            image = psf.computeImage(center)
+            inputs.append(ms.ModelInputHandler(image, center, image.getBBox()))
+            models.append(ms.FitPsfAlgorithm.apply(ctrl, inputs[-1]))
+        results = ms.FitPsfBatch.apply(ctrl, inputs, 3)
+        self.assertEqual(results.getSize(), len(models))
+        for n, model in enumerate(models):
+            self.assertClose(results.inner[n], model.inner)
+            self.assertClose(results.outer[n], model.outer)
+            self.assertClose(results.chisq[n], model.chisq)
+            self.assertClose(results.ellipse[n], [model.ellipse.getIxx(), model.ellipse.getIyy(),
+                                                  model.ellipse.getIxy()])
+            self.assertEqual(results.flags[n], 0)
+            self.assertClose(results.getModel(ctrl, n).inner, model.inner)
+
+    def testThreads(self):
+        # apply releases the GIL; threads that don't share inputs should get the same results
+        # as serial calls
+        ctrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        inputs = []
+        for x, y in numpy.random.rand(16, 2) * 100.0:
+            center = geom.Point2D(x, y)
+            image = psf.computeImage(center)
+            inputs.append(ms.ModelInputHandler(image, center, image.getBBox()))
+        expected = [ms.FitPsfAlgorithm.apply(ctrl, i) for i in inputs]
+        results = [None] * len(inputs)
+        def work(offset):
+            for n in range(offset, len(inputs), 4):
+                results[n] = ms.FitPsfAlgorithm.apply(ctrl, inputs[n])
+        threads = [threading.Thread(target=work, args=(offset,)) for offset in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for result, model in zip(results, expected):
+            self.assertClose(result.inner, model.inner)
+            self.assertClose(result.outer, model.outer)
+            self.assertClose(result.chisq, model.chisq)
+        # a thread sampling the clock should keep running while apply is fitting a large image;
+        # if the GIL were held, it could only take samples just before or after each call
+        center = geom.Point2D(0.3, -0.2)
+        image = lsst.afw.detection.createPsf("DoubleGaussian", 151, 151, 12.0, 24.0, 0.1).computeImage(center)
+        bigInputs = ms.ModelInputHandler(image, center, image.getBBox())
+        samples = []
+        done = threading.Event()
+        def sample():
+            while not done.isSet():
+                samples.append(time.time())
+                time.sleep(0.001)
+        sampler = threading.Thread(target=sample)
+        sampler.start()
+        overlapped = False
+        try:
+            for attempt in range(20):
+                start = time.time()
+                ms.FitPsfAlgorithm.apply(ctrl, bigInputs)
+                end = time.time()
+                margin = 0.25 * (end - start)
+                if [t for t in samples if start + margin < t < end - margin]:
+                    overlapped = True
+                    break
+        finally:
+            done.set()
+            sampler.join()
+        self.assert_(overlapped)
+
+    def testGrid(self):
+        ctrl = ms.FitPsfControl()
+        psf = makeVaryingPsf(300, 200)
+        bbox = geom.Box2D(geom.Point2D(0.0, 0.0), geom.Point2D(300.0, 200.0))
+        # make sure the PSF really varies, so we aren't just testing a constant interpolation
+        corner0 = ms.FitPsfAlgorithm.apply(ctrl, psf, geom.Point2D(10.0, 10.0))
+        corner1 = ms.FitPsfAlgorithm.apply(ctrl, psf, geom.Point2D(290.0, 190.0))
+        self.assert_(abs(corner1.outer[0] / corner1.inner[0] - corner0.outer[0] / corner0.inner[0]) > 1E-2)
+        grid = ms.FitPsfGrid(ctrl, psf, bbox)
+        self.assertEqual(grid.getFailureCount(), 0)
+        for x, y in numpy.random.rand(5, 2) * numpy.array([300.0, 200.0]):
+            point = geom.Point2D(x, y)
+            direct = ms.FitPsfAlgorithm.apply(ctrl, psf, point)
+            interpolated = grid.evaluate(point)
+            self.assertClose(interpolated.ellipse.getParameterVector(), direct.ellipse.getParameterVector(),
+                             rtol=1E-3, atol=1E-4)
+            self.assertClose(interpolated.inner, direct.inner, rtol=1E-2, atol=1E-4)
+            self.assertClose(interpolated.outer, direct.outer, rtol=1E-2, atol=1E-4)
+        residual = grid.computeResidual(psf, 3, 3)
+        self.assertEqual(residual.count, 9)
+        self.assert_(residual.maxEllipse < 1E-3)
+        self.assert_(residual.maxCoefficient < 1E-2)
+
+    def testGridCache(self):
+        ctrl = ms.FitPsfControl()
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        bbox = geom.Box2D(geom.Point2D(0.0, 0.0), geom.Point2D(300.0, 200.0))
+        directory = tempfile.mkdtemp()
+        try:
+            cache = ms.FitPsfGridCache(directory)
+            key = ms.FitPsfGridCache.makeKey(ctrl, psf, bbox, None)
+            self.assert_(cache.read(key, ctrl, bbox) is None)
+            grid = ms.FitPsfGrid(ctrl, psf, bbox)
+            cache.write(key, grid)
+            cached = cache.read(key, ctrl, bbox)
+            self.assert_(cached is not None)
+            self.assertClose(cached.getValues(), grid.getValues(), rtol=0.0, atol=0.0)
+            point = geom.Point2D(120.0, 45.0)
+            self.assertClose(cached.evaluate(point).inner, grid.evaluate(point).inner)
+            # a different PSF or configuration must miss
+            psf2 = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.6, 3.0, 0.1)
+            self.assertNotEqual(ms.FitPsfGridCache.makeKey(ctrl, psf2, bbox, None).psf, key.psf)
+            ctrl2 = ms.FitPsfControl()
+            ctrl2.gridOrder = 3
+            self.assert_(cache.read(key, ctrl2, bbox) is None)
+            # only the metadata entries named in the control object are part of the key
+            metadata = lsst.daf.base.PropertyList()
+            metadata.set("FILTER", "r")
+            metadata.set("HISTORY", "processed")
+            self.assertEqual(ms.FitPsfGridCache.makeKey(ctrl, psf, bbox, metadata).exposure, key.exposure)
+            ctrl3 = ms.FitPsfControl()
+            ctrl3.cacheMetadataKeys = ["FILTER"]
+            self.assertNotEqual(ms.FitPsfGridCache.makeKey(ctrl3, psf, bbox, metadata).exposure,
+                                key.exposure)
+            # a corrupted file must miss
+            with open(cache.getFileName(key), "r+b") as f:
+                f.seek(-8, 2)
+                f.write("\0" * 8)
+            self.assert_(cache.read(key, ctrl, bbox) is None)
+        finally:
+            shutil.rmtree(directory)
+
+    def testStageTimes(self):
+        metadata = lsst.daf.base.PropertyList()
+        metadata.set("MULTISHAPELET_PSF_TIMER_OPTIMIZER_RUN_SECONDS", 1.5)
+        metadata.set("MULTISHAPELET_PSF_TIMER_OPTIMIZER_RUN_COUNT", 3)
+        metadata.set("MULTISHAPELET_PSF_TIMER_APPLY_SECONDS", 2.0)
+        metadata.set("MULTISHAPELET_PSF_TIMER_APPLY_COUNT", 2)
+        metadata.set("MULTISHAPELET_EXP_TIMER_APPLY_SECONDS", 4.0)
+        metadata.set("MULTISHAPELET_EXP_TIMER_APPLY_COUNT", 2)
+        times = ms.getStageTimes(metadata, "multishapelet.psf")
+        self.assertEqual(sorted(times.keys()), ["apply", "optimizer_run"])
+        self.assertClose(times["optimizer_run"][0], 1.5)
+        self.assertEqual(times["optimizer_run"][1], 3)
+        self.assertClose(times["apply"][0], 2.0)
+        self.assertEqual(ms.getStageTimes(metadata, "multishapelet.dev"), {})
+
+    def testApplyTimers(self):
+        # measure two stars with SourceMeasurementTask, so the stages timed in _apply are recorded
+        exposure = lsst.afw.image.ExposureF(80, 60)
+        psf = lsst.afw.detection.createPsf("DoubleGaussian", 19, 19, 1.5, 3.0, 0.1)
+        exposure.setPsf(psf)
+        image = lsst.afw.image.ImageD(exposure.getMaskedImage().getBBox(lsst.afw.image.PARENT))
+        for center in (geom.Point2D(20.3, 19.8), geom.Point2D(55.6, 38.1)):
+            model = ms.FitPsfAlgorithm.apply(ms.FitPsfControl(), psf, center)
+            model.asMultiShapelet(center).evaluate().addToImage(image)
+        mi = exposure.getMaskedImage()
+        mi.getImage().getArray()[:,:] = 1000.0 * image.getArray() + numpy.random.randn(60, 80)
+        mi.getVariance().getArray()[:,:] = 1.0
+        schema = lsst.afw.table.SourceTable.makeMinimalSchema()
+        detectionTask = lsst.meas.algorithms.SourceDetectionTask(schema=schema)
+        config = lsst.meas.algorithms.SourceMeasurementConfig()
+        config.algorithms.names |= ["multishapelet.psf"]
+        metadata = lsst.daf.base.PropertyList()
+        measureTask = lsst.meas.algorithms.SourceMeasurementTask(schema=schema, algMetadata=metadata,
+                                                                 config=config)
+        sources = detectionTask.makeSourceCatalog(lsst.afw.table.SourceTable.make(schema), exposure).sources
+        self.assertEqual(len(sources), 2)
+        measureTask.run(exposure, sources)
+        times = ms.getStageTimes(metadata, "multishapelet.psf")
+        if not ms.StageTimes.isEnabled():
+            self.assertEqual(times, {})
+            return
+        self.assertEqual(times["apply"][1], len(sources))
+        for stage in ("apply", "inputs", "optimizer_run"):
+            self.assert_(times[stage][0] > 0.0)
+            self.assert_(times[stage][1] > 0)
+        self.assert_(times["apply"][0] >= times["optimizer_run"][0])
+
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 def suite():
@@ -41,6 +41,7 @@ import lsst.afw.geom as geom
 import lsst.afw.geom.ellipses as ellipses
 import lsst.afw.image
 import lsst.afw.detection
+import lsst.shapelet
 import lsst.meas.extensions.multiShapelet as ms
 
 numpy.random.seed(5)
@@ -176,6 +177,27 @@ class GaussianModelBuilderTestCase(unittest.TestCase):
         # no hard requirement for tolerances here, but I've dialed them to the max to avoid regressions
         self.assertClose(a, n, rtol=1E-15, atol=1E-9)
 
+    def testShapeletMatrixBuilder(self):
+        order = 4
+        ellipse = ellipses.Ellipse(self.ellipse, geom.Point2D(1.5, -2.2))
+        coefficients = numpy.random.randn(lsst.shapelet.computeSize(order))
+        shapelet = lsst.shapelet.ShapeletFunction(order, lsst.shapelet.HERMITE, ellipse, coefficients)
+        z0 = self.evalShapelets(shapelet)
+        # use a size that isn't a multiple of the block size, to test the last partial block
+        self.assertNotEqual(self.x.size % ms.ShapeletMatrixBuilder.BLOCK_SIZE, 0)
+        builder = ms.ShapeletMatrixBuilder(self.x, self.y, order)
+        self.assertEqual(builder.getBasisSize(), coefficients.size)
+        self.assertEqual(builder.getDataSize(), self.x.size)
+        matrix = numpy.zeros((self.x.size, coefficients.size), dtype=float, order="F")
+        builder(matrix, ellipse)
+        self.assertClose(numpy.dot(matrix, coefficients), z0)
+        weights = numpy.random.rand(self.x.size)
+        builder(matrix, ellipse, weights)
+        self.assertClose(numpy.dot(matrix, coefficients), z0 * weights)
+        self.assertRaises(lsst.pex.exceptions.LengthError, builder, matrix[:,:-1], ellipse)
+        z1 = numpy.ones(self.x.size, dtype=float)
+        builder.addModel(z1, ellipse, coefficients, weights)
+        self.assertClose(z1, 1.0 + z0 * weights)
 
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -68,6 +68,23 @@ class MultiGaussianObjectiveTestCase(unittest.TestCase):
             derivative[:,i] /= 2.0 * eps
         return derivative
 
+    def checkDerivative(self, obj, parameters, eps=1E-6):
+        f0 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        obj.computeFunction(parameters, f0)
+        d0 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+        d1 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+        obj.computeDerivative(parameters, f0, d0)
+        for j in range(parameters.size):
+            parameters[j] += eps
+            f1a = numpy.zeros(self.inputs.getSize(), dtype=float)
+            obj.computeFunction(parameters, f1a)
+            parameters[j] -= 2.0*eps
+            f1b = numpy.zeros(self.inputs.getSize(), dtype=float)
+            obj.computeFunction(parameters, f1b)
+            d1[:,j] = (f1a - f1b) / (2.0 * eps)
+            parameters[j] += eps
+        self.assertClose(d0, d1, rtol=1E-6, atol=1E-8)
+
     def setUp(self):
         self.ellipse = ellipses.Axes(10, 7, 0.3)
         self.center = geom.Point2D(10.1, 11.2)
@@ -125,7 +142,121 @@ class MultiGaussianObjectiveTestCase(unittest.TestCase):
         multiGaussian.add(ms.GaussianComponent(1.23, 1.32))
         multiGaussian.add(ms.GaussianComponent(0.67, 0.9))
         self.doTest(multiGaussian)
-        
+
+    def testSharedNorm(self):
+        multiGaussian = ms.MultiGaussianRegistry.lookup("tractor-exponential")
+        delta = ms.MultiGaussian()
+        delta.add(ms.GaussianComponent(1.0, 1.0))
+        shared = ms.MultiGaussianObjective(self.inputs, multiGaussian)
+        separate = ms.MultiGaussianObjective(self.inputs, multiGaussian, delta, ellipses.Quadrupole(0, 0, 0))
+        self.assertEqual(shared.getBuilderCount(), 1)
+        self.assertEqual(separate.getBuilderCount(), len(multiGaussian))
+        for parameters in ([0.1, 0.2, 0.5], [0.0, 0.0, 1.0], [0.8, -1.1, -0.5]):
+            parameters = numpy.array(parameters)
+            f0 = numpy.zeros(self.inputs.getSize(), dtype=float)
+            f1 = numpy.zeros(self.inputs.getSize(), dtype=float)
+            shared.computeFunction(parameters, f0)
+            separate.computeFunction(parameters, f1)
+            self.assertClose(f0, f1, rtol=1E-12, atol=1E-14)
+            d0 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+            d1 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+            shared.computeDerivative(parameters, f0, d0)
+            separate.computeDerivative(parameters, f1, d1)
+            self.assertClose(d0, d1, rtol=1E-12, atol=1E-14)
+        self.assertEqual(shared.getEvaluationCount(), 3)
+
+    def testFixedKernel(self):
+        psfMultiGaussian = ms.MultiGaussian()
+        psfMultiGaussian.add(ms.GaussianComponent(0.9, 1.0))
+        psfMultiGaussian.add(ms.GaussianComponent(0.1, 2.0))
+        psfEllipse = ellipses.Quadrupole(4.0, 3.0, 0.5)
+        for name in ("tractor-exponential", "tractor-devaucouleur-3", "tractor-devaucouleur-4"):
+            multiGaussian = ms.MultiGaussianRegistry.lookup(name)
+            fixed = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse)
+            # a maximum number of builders larger than the number of components disables the fused
+            # kernel without merging anything
+            dynamic = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse,
+                                                1E-8, 1E-8, 0.0, 1000)
+            for parameters in ([0.1, 0.2, 0.5], [0.0, 0.0, 1.0], [0.8, -1.1, -0.5]):
+                parameters = numpy.array(parameters)
+                f0 = numpy.zeros(self.inputs.getSize(), dtype=float)
+                f1 = numpy.zeros(self.inputs.getSize(), dtype=float)
+                fixed.computeFunction(parameters, f0)
+                dynamic.computeFunction(parameters, f1)
+                self.assertEqual(fixed.getBuilderCount(), dynamic.getBuilderCount())
+                self.assertClose(f0, f1, rtol=1E-12, atol=1E-14)
+                d0 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+                d1 = numpy.zeros((parameters.size, self.inputs.getSize()), dtype=float).transpose()
+                fixed.computeDerivative(parameters, f0, d0)
+                dynamic.computeDerivative(parameters, f1, d1)
+                self.assertClose(d0, d1, rtol=1E-12, atol=1E-14)
+
+    def testPruning(self):
+        multiGaussian = ms.MultiGaussianRegistry.lookup("tractor-devaucouleur")
+        psfMultiGaussian = ms.MultiGaussian()
+        psfMultiGaussian.add(ms.GaussianComponent(0.9, 1.0))
+        psfMultiGaussian.add(ms.GaussianComponent(0.1, 2.0))
+        psfEllipse = ellipses.Quadrupole(4.0, 3.0, 0.5)
+        tolerance = 1E-2
+        full = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse)
+        pruned = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse,
+                                           1E-8, 1E-8, tolerance)
+        self.assertEqual(full.getComponentCount(), len(multiGaussian) * len(psfMultiGaussian))
+        self.assertEqual(pruned.getComponentCount(), full.getComponentCount())
+        # an unresolved source: most components should be merged
+        parameters = numpy.array([0.1, 0.2, numpy.log(0.05)])
+        f0 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        f1 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        full.computeFunction(parameters, f0)
+        pruned.computeFunction(parameters, f1)
+        self.assertEqual(full.getBuilderCount(), full.getComponentCount())
+        self.assert_(pruned.getBuilderCount() < full.getBuilderCount())
+        self.assertEqual(pruned.getEvaluationCount(), pruned.getBuilderCount())
+        error = numpy.sum((pruned.getModel() - full.getModel())**2)**0.5
+        self.assert_(error < 2.0 * tolerance * numpy.sum(full.getModel()**2)**0.5)
+        self.checkDerivative(pruned, parameters)
+        # with a huge tolerance everything could be dropped, but the largest group is kept
+        coarse = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse,
+                                           1E-8, 1E-8, 10.0)
+        coarse.computeFunction(parameters, f1)
+        self.assertEqual(coarse.getBuilderCount(), 1)
+        self.assert_(numpy.sum(coarse.getModel()**2) > 0.0)
+
+    def testMomentMatchedReduction(self):
+        multiGaussian = ms.MultiGaussianRegistry.lookup("tractor-devaucouleur")
+        psfMultiGaussian = ms.MultiGaussian()
+        psfMultiGaussian.add(ms.GaussianComponent(0.9, 1.0))
+        psfMultiGaussian.add(ms.GaussianComponent(0.1, 2.0))
+        psfEllipse = ellipses.Quadrupole(4.0, 3.0, 0.5)
+        full = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse)
+        reduced = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse,
+                                            1E-8, 1E-8, 0.0, 6)
+        parameters = numpy.array([0.3, -0.2, numpy.log(3.0)])
+        f0 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        f1 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        full.computeFunction(parameters, f0)
+        reduced.computeFunction(parameters, f1)
+        self.assertEqual(reduced.getBuilderCount(), 6)
+        self.assert_(reduced.getPruningError() < 1E-2)
+        error = numpy.sum((reduced.getModel() - full.getModel())**2)**0.5
+        self.assert_(error < 2.0 * reduced.getPruningError() * numpy.sum(full.getModel()**2)**0.5 + 1E-8)
+        self.checkDerivative(reduced, parameters)
+        # a large change in the ellipse should trigger a new reduction, matching the one a new
+        # objective would make at the new ellipse
+        evaluations = reduced.getEvaluationCount()
+        pruningError = reduced.getPruningError()
+        parameters[2] += 1.0
+        reduced.computeFunction(parameters, f1)
+        fresh = ms.MultiGaussianObjective(self.inputs, multiGaussian, psfMultiGaussian, psfEllipse,
+                                          1E-8, 1E-8, 0.0, 6)
+        f2 = numpy.zeros(self.inputs.getSize(), dtype=float)
+        fresh.computeFunction(parameters, f2)
+        self.assertNotEqual(reduced.getPruningError(), pruningError)
+        self.assertEqual(reduced.getPruningError(), fresh.getPruningError())
+        self.assertClose(reduced.getModel(), fresh.getModel())
+        self.assertEqual(reduced.getBuilderCount(), 6)
+        self.assertEqual(reduced.getEvaluationCount(), evaluations + 6)
+        self.checkDerivative(reduced, parameters)
 
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 